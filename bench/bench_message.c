@@ -0,0 +1,482 @@
+/*
+ * Cost of the message pipeline outside of Pidgin: finding the
+ * commands of a message, rebuilding it with placeholders and
+ * dispatching a snippet to its backend. libpurple is stubbed (see
+ * purple_stubs.c), jobs are queued nowhere and the only backend
+ * that renders anything hands back a canned png, so what is
+ * measured is the plugin's own code.
+ *
+ * Every corpus is generated from a fixed seed and every stage runs
+ * the same number of times, so the numbers of two commits can be
+ * compared line by line. Times are the best of a few rounds.
+ * Allocations are counted by wrapping glibc's malloc: allocs/msg
+ * are calls to malloc, calloc and realloc, alloc B/msg what they
+ * asked for and copied B/msg what realloc had to copy because a
+ * buffer could not grow in place.
+ *
+ *     $ make bench
+ *     $ ./bench/bench_message [rounds]
+ */
+#include "pifo_message.h"
+#include "pifo_scan.h"
+#include "pifo_generator.h"
+#include "pifo_cache.h"
+#include "pifo_job.h"
+#include "pifo.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#define DEFAULT_ROUNDS 5
+#define SEED 42
+
+#define PLAIN_MESSAGES 4000
+#define MARKUP_MESSAGES 4000
+#define ADVERSARIAL_MESSAGES 400
+
+#define CACHE_BYTES (64 << 20)
+
+/* Smallest valid png: one transparent pixel */
+static const guchar tiny_png[] = {
+    0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a,
+    0x00, 0x00, 0x00, 0x0d, 0x49, 0x48, 0x44, 0x52,
+    0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01,
+    0x08, 0x06, 0x00, 0x00, 0x00, 0x1f, 0x15, 0xc4,
+    0x89, 0x00, 0x00, 0x00, 0x0d, 0x49, 0x44, 0x41,
+    0x54, 0x78, 0x9c, 0x63, 0x60, 0x00, 0x02, 0x00,
+    0x00, 0x05, 0x00, 0x01, 0xe9, 0xfa, 0xdc, 0xd8,
+    0x00, 0x00, 0x00, 0x00, 0x49, 0x45, 0x4e, 0x44,
+    0xae, 0x42, 0x60, 0x82
+};
+
+struct allocations {
+    guint64 calls;
+    guint64 bytes;
+    guint64 copied;
+};
+
+static volatile gboolean counting = FALSE;
+static struct allocations counted;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *old, size_t size);
+
+void *malloc(size_t size){
+    if (counting){
+        counted.calls++;
+        counted.bytes += size;
+    }
+
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size){
+    if (counting){
+        counted.calls++;
+        counted.bytes += count * size;
+    }
+
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *old, size_t size){
+    size_t before = old != NULL && counting ? malloc_usable_size(old) : 0;
+    void *new = __libc_realloc(old, size);
+
+    if (counting){
+        counted.calls++;
+        if (new != old){
+            counted.bytes += size;
+            counted.copied += MIN(before, size);
+        }
+    }
+
+    return new;
+}
+#endif
+
+/* Stands in for the image registry, which needs Pidgin: a cached
+ * image is looked up like in the plugin and stored under a new id */
+int pifo_job_cached(PurpleConversation *conv,
+        const GString *command, const GString *snippet){
+    GString *png = lookup_render(command, snippet);
+    gsize size;
+
+    if (png == NULL)
+        return 0;
+
+    size = png->len;
+    return purple_imgstore_add_with_id(g_string_free(png, FALSE), size,
+            "pifo.png");
+}
+
+/* Stands in for the render threads: takes its copies of the
+ * snippet like the real one and gets a placeholder id, but
+ * nothing is ever rendered */
+int pifo_job_submit(PurpleConversation *conv,
+        const GString *command, const GString *snippet){
+    GString *queued_command = g_string_new(command->str);
+    GString *queued_snippet = g_string_new(snippet->str);
+    gpointer placeholder = g_malloc(sizeof(tiny_png));
+    int placeholder_id;
+
+    memcpy(placeholder, tiny_png, sizeof(tiny_png));
+    placeholder_id = purple_imgstore_add_with_id(placeholder,
+            sizeof(tiny_png), "pifo-pending.png");
+
+    g_string_free(queued_command, TRUE);
+    g_string_free(queued_snippet, TRUE);
+
+    return placeholder_id;
+}
+
+static GString *stub_render(const GString *snippet, const GString *command){
+    return g_string_new_len((const gchar *) tiny_png, sizeof(tiny_png));
+}
+
+/* Renders every time, so dispatch_command() runs in full */
+static const struct mapping stub_backend = {
+    "stub", NULL, NULL, NULL, 0, PIFO_COST_CHEAP, stub_render
+};
+
+static const char *words[] = {
+    "the", "build", "is", "green", "again", "did", "anybody",
+    "look", "at", "my", "patch", "yet", "lunch?", "ok,", "see",
+    "logs:", "[12:03:44]", "<nick>", "http://example.org/a/b", "::",
+    "{braces}", "50%", "a/b", "C:", "--", ";-)"
+};
+
+static const char *commands[] = {
+    "\\formula{\\frac{a}{b} + \\sqrt{c}}",
+    "\\formula{\\lim_{x \\to \\infty} \\exp(-x) = 0}",
+    "\\formula{e^{i\\pi} + 1 = 0}",
+    "\\c{int main(void){ return 0; }}",
+    "\\python{print([x * x for x in range(10)])}",
+    "\\dot{digraph g {a->b->c; b->{d e}}}",
+    "\\tikz{\\draw (0,0) -- (1,1);}",
+    "\\svg{<svg xmlns=\"http://www.w3.org/2000/svg\"/>}",
+    "\\stub{x^2}",
+    "\\nosuchcommand{x}",
+    "\\formula{   }"
+};
+
+static void append_words(GString *message, GRand *rand, int count){
+    int i;
+
+    for (i=0; i<count; i++){
+        if (i > 0)
+            g_string_append_c(message, ' ');
+        g_string_append(message,
+                words[g_rand_int_range(rand, 0, G_N_ELEMENTS(words))]);
+    }
+}
+
+/* What most of a chat looks like: no commands at all */
+static GString *plain_message(GRand *rand){
+    GString *message = g_string_new(NULL);
+
+    append_words(message, rand, g_rand_int_range(rand, 3, 40));
+
+    return message;
+}
+
+/* A few commands among the text, some of them repeated */
+static GString *markup_message(GRand *rand){
+    GString *message = g_string_new(NULL);
+    int count = g_rand_int_range(rand, 1, 7), i;
+
+    for (i=0; i<count; i++){
+        append_words(message, rand, g_rand_int_range(rand, 0, 12));
+        g_string_append_c(message, ' ');
+        g_string_append(message,
+                commands[g_rand_int_range(rand, 0, G_N_ELEMENTS(commands))]);
+        g_string_append_c(message, ' ');
+    }
+
+    return message;
+}
+
+/* Whatever makes a scanner work hard: runs of backslashes, braces
+ * that never close, deep nesting and huge messages */
+static GString *adversarial_message(GRand *rand){
+    GString *message = g_string_new(NULL);
+    int run = g_rand_int_range(rand, 16, 4096), i;
+
+    switch (g_rand_int_range(rand, 0, 5)){
+        case 0:
+            for (i=0; i<run; i++)
+                g_string_append_c(message, '\\');
+            g_string_append(message, "f{x}");
+            break;
+        case 1:
+            g_string_append(message, "\\formula{");
+            for (i=0; i<run; i++)
+                g_string_append(message, "{a");
+            break;
+        case 2:
+            g_string_append(message, "\\formula{");
+            for (i=0; i<run; i++)
+                g_string_append_c(message, '{');
+            for (i=0; i<run; i++)
+                g_string_append_c(message, '}');
+            g_string_append_c(message, '}');
+            break;
+        case 3:
+            for (i=0; i<run; i++)
+                g_string_append(message, "\\a\\{}\\x ");
+            break;
+        default:
+            for (i=0; i<run / 8; i++){
+                g_string_append(message, commands[i % 3]);
+                g_string_append(message, " and ");
+            }
+            break;
+    }
+
+    return message;
+}
+
+static GPtrArray *generate(GString *(*message)(GRand *rand), int count){
+    GPtrArray *corpus = g_ptr_array_new();
+    GRand *rand = g_rand_new_with_seed(SEED);
+    int i;
+
+    for (i=0; i<count; i++)
+        g_ptr_array_add(corpus, message(rand));
+
+    g_rand_free(rand);
+
+    return corpus;
+}
+
+static void free_corpus(GPtrArray *corpus){
+    guint i;
+
+    for (i=0; i<corpus->len; i++)
+        g_string_free(g_ptr_array_index(corpus, i), TRUE);
+    g_ptr_array_free(corpus, TRUE);
+}
+
+/* Puts an image into the cache for every snippet that has a
+ * cacheable backend, so dispatching it is a cache hit */
+static void warm_cache(const GPtrArray *commands, const GPtrArray *snippets){
+    struct mapping backend;
+    GString *png = g_string_new_len((const gchar *) tiny_png,
+            sizeof(tiny_png));
+    gchar *key;
+    guint i;
+
+    for (i=0; i<commands->len; i++){
+        if (!find_backend(g_ptr_array_index(commands, i), &backend)
+                || !(backend.flags & PIFO_BACKEND_CACHEABLE))
+            continue;
+
+        key = pifo_cache_key(g_ptr_array_index(commands, i),
+                g_ptr_array_index(snippets, i), &backend);
+        pifo_cache_insert(key, png, 1000);
+        g_free(key);
+    }
+
+    g_string_free(png, TRUE);
+}
+
+enum stage {
+    CONTAINS_WORK,
+    GET_COMMANDS,
+    MODIFY_MESSAGE,
+    DISPATCH_CACHED,
+    DISPATCH_STUB
+};
+
+static const char *stage_names[] = {
+    "contains_work",
+    "get_commands",
+    "modify_message",
+    "dispatch_cached",
+    "dispatch_stub"
+};
+
+/* Runs one stage over every message of the corpus */
+static void run_stage(enum stage stage, const GPtrArray *corpus,
+        const GPtrArray *cmds, const GPtrArray *snippets){
+    PurpleConversation *conv = NULL;
+    GPtrArray *found_commands, *found_snippets;
+    GArray *spans;
+    GString *message, *result, *command;
+    guint i;
+
+    if (stage == DISPATCH_CACHED || stage == DISPATCH_STUB){
+        for (i=0; i<cmds->len; i++){
+            command = g_ptr_array_index(cmds, i);
+            if ((stage == DISPATCH_STUB) != !strcmp(command->str, "stub"))
+                continue;
+            if ((result = dispatch_command(command,
+                            g_ptr_array_index(snippets, i))) != NULL)
+                g_string_free(result, TRUE);
+        }
+        return;
+    }
+
+    for (i=0; i<corpus->len; i++){
+        message = g_ptr_array_index(corpus, i);
+
+        switch (stage){
+            case CONTAINS_WORK:
+                contains_work(message->str);
+                break;
+            case GET_COMMANDS:
+                if (get_commands(message, &found_commands, &found_snippets,
+                            &spans)){
+                    free_commands(found_commands);
+                    free_snippets(found_snippets);
+                    g_ptr_array_free(found_commands, TRUE);
+                    g_ptr_array_free(found_snippets, TRUE);
+                    g_array_free(spans, TRUE);
+                }
+                break;
+            case MODIFY_MESSAGE:
+                if ((result = modify_message(conv, message)) != NULL)
+                    g_string_free(result, TRUE);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+/* How many times a stage handles something in one run */
+static guint stage_items(enum stage stage, const GPtrArray *corpus,
+        const GPtrArray *cmds){
+    guint i, items = 0;
+
+    if (stage != DISPATCH_CACHED && stage != DISPATCH_STUB)
+        return corpus->len;
+
+    for (i=0; i<cmds->len; i++){
+        if ((stage == DISPATCH_STUB) == !strcmp(
+                    ((GString *) g_ptr_array_index(cmds, i))->str, "stub"))
+            items++;
+    }
+
+    return items;
+}
+
+static void measure(const char *name, const GPtrArray *corpus,
+        const GPtrArray *cmds, const GPtrArray *snippets,
+        enum stage stage, int rounds){
+    guint items = stage_items(stage, corpus, cmds);
+    gint64 best = G_MAXINT64, start;
+    int round;
+
+    if (items == 0)
+        return;
+
+    /* Unmeasured, so caches and the allocator are warmed up */
+    run_stage(stage, corpus, cmds, snippets);
+
+    for (round=0; round<rounds; round++){
+        start = g_get_monotonic_time();
+        run_stage(stage, corpus, cmds, snippets);
+        best = MIN(best, g_get_monotonic_time() - start);
+    }
+
+    memset(&counted, 0, sizeof(counted));
+    counting = TRUE;
+    run_stage(stage, corpus, cmds, snippets);
+    counting = FALSE;
+
+    printf("%-12s %-16s %7u %12.1f %12.2f %12.1f %12.1f\n",
+            name, stage_names[stage], items,
+            (double) best * 1000 / items,
+            (double) counted.calls / items,
+            (double) counted.bytes / items,
+            (double) counted.copied / items);
+}
+
+/* Every command of the corpus, for the dispatch stages */
+static void collect_commands(const GPtrArray *corpus,
+        GPtrArray *cmds, GPtrArray *snippets){
+    GPtrArray *found_commands, *found_snippets;
+    GArray *spans;
+    guint i, j;
+
+    for (i=0; i<corpus->len; i++){
+        if (!get_commands(g_ptr_array_index(corpus, i),
+                    &found_commands, &found_snippets, &spans))
+            continue;
+
+        for (j=0; j<found_commands->len; j++){
+            if (!snippet_valid(g_ptr_array_index(found_snippets, j))
+                    || !is_command(g_ptr_array_index(found_commands, j))){
+                g_string_free(g_ptr_array_index(found_commands, j), TRUE);
+                g_string_free(g_ptr_array_index(found_snippets, j), TRUE);
+                continue;
+            }
+            g_ptr_array_add(cmds, g_ptr_array_index(found_commands, j));
+            g_ptr_array_add(snippets, g_ptr_array_index(found_snippets, j));
+        }
+
+        g_ptr_array_free(found_commands, TRUE);
+        g_ptr_array_free(found_snippets, TRUE);
+        g_array_free(spans, TRUE);
+    }
+}
+
+int main(int argc, char **argv){
+    struct {
+        const char *name;
+        GString *(*message)(GRand *rand);
+        int count;
+    } corpora[] = {
+        {"plain", plain_message, PLAIN_MESSAGES},
+        {"markup", markup_message, MARKUP_MESSAGES},
+        {"adversarial", adversarial_message, ADVERSARIAL_MESSAGES}
+    };
+    int rounds = argc > 1 ? atoi(argv[1]) : DEFAULT_ROUNDS;
+    static int handle;
+    GPtrArray *corpus, *cmds, *snippets;
+    enum stage stage;
+    int i;
+
+    pifo_generator_init(&handle);
+    pifo_generator_register(&stub_backend);
+    pifo_cache_init(CACHE_BYTES);
+
+#ifndef __GLIBC__
+    printf("Allocations are only counted with glibc\n");
+#endif
+    printf("%-12s %-16s %7s %12s %12s %12s %12s\n",
+            "corpus", "stage", "items", "ns/msg",
+            "allocs/msg", "alloc B/msg", "copied B/msg");
+
+    for (i=0; i<G_N_ELEMENTS(corpora); i++){
+        corpus = generate(corpora[i].message, corpora[i].count);
+        cmds = g_ptr_array_new();
+        snippets = g_ptr_array_new();
+        collect_commands(corpus, cmds, snippets);
+        warm_cache(cmds, snippets);
+
+        for (stage=CONTAINS_WORK; stage<=DISPATCH_STUB; stage++)
+            measure(corpora[i].name, corpus, cmds, snippets,
+                    stage, rounds);
+
+        free_commands(cmds);
+        free_snippets(snippets);
+        g_ptr_array_free(cmds, TRUE);
+        g_ptr_array_free(snippets, TRUE);
+        free_corpus(corpus);
+    }
+
+    pifo_cache_shutdown();
+    pifo_generator_unregister(&stub_backend);
+    pifo_generator_uninit(&handle);
+
+    return 0;
+}
@@ -0,0 +1,511 @@
+/*
+ * End to end latency of the backends: how long it takes from
+ * handing a snippet to dispatch_command() until the png is back,
+ * with the real tools doing the work. The snippets are the ones of
+ * test/smoketest.md and markup_tests/, plus a few of our own for
+ * the backends those have none for.
+ *
+ * Cold renders start from an empty format directory and without
+ * any warm TeX workers, like the first render after Pidgin was
+ * started. Warm renders have the formats dumped and the workers
+ * waiting already. The render caches are never used. For every
+ * backend this reports the p50, p95 and p99 latency of both, the
+ * largest resident set any of the tools had and how large the
+ * images came out, as JSON. Backends whose tools are not installed
+ * are skipped.
+ *
+ * Run it from the top of the tree, as it reads the corpus from
+ * there:
+ *
+ *     $ make bench
+ *     $ ./bench/bench_render [cold rounds] [warm rounds] > render.json
+ */
+#include "pifo_scan.h"
+#include "pifo_generator.h"
+#include "pifo_format.h"
+#include "pifo_worker.h"
+#include "pifo_workspace.h"
+#include "pifo_spawn.h"
+#include "pifo_util.h"
+#include "pifo.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#define DEFAULT_COLD_ROUNDS 3
+#define DEFAULT_WARM_ROUNDS 10
+
+#define SMOKETEST "test/smoketest.md"
+#define MARKUP_TESTS "markup_tests"
+
+/* Generous, a cold tikz render has to dump its format first */
+#define TIMEOUT_S 120
+
+struct backend_kind {
+    const char *name;
+    backend_handler handler;
+    /* What has to be in $PATH, NULL terminated */
+    const char *tools[4];
+};
+
+static const struct backend_kind kinds[] = {
+    {"latex_formula", generate_latex_formula, {"latex", "dvipng", NULL}},
+    {"latex_listing", generate_latex_listing, {"latex", "dvipng", NULL}},
+#ifdef HAVE_LIBGVC
+    {"graphviz", generate_graphviz_png, {NULL}},
+#else
+    {"graphviz", generate_graphviz_png, {"dot", NULL}},
+#endif
+#ifdef HAVE_POPPLER
+    {"tikz", generate_tikz_png, {"pdflatex", NULL}},
+#else
+    {"tikz", generate_tikz_png, {"pdflatex", "pdftops", "convert", NULL}},
+#endif
+#ifdef HAVE_LIBRSVG
+    {"svg", generate_svg_png, {NULL}},
+#else
+    {"svg", generate_svg_png, {"convert", NULL}},
+#endif
+    {"markdown", generate_markdown, {"pandoc", "latex", "dvipng", NULL}}
+};
+
+/* The corpus has nothing for these */
+static const char *extra_cases[][2] = {
+    {"svg",
+     "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"64\" height=\"64\">"
+     "<circle cx=\"32\" cy=\"32\" r=\"24\" fill=\"teal\"/></svg>"},
+    {"markdown",
+     "# Heading\n\nSome *emphasis* and `code`, and a list:\n\n"
+     "* one\n* two\n"}
+};
+
+struct render_case {
+    GString *command;
+    GString *snippet;
+};
+
+struct latencies {
+    /* Microseconds per successful render */
+    GArray *samples;
+    guint failures;
+};
+
+struct backend_result {
+    struct latencies cold;
+    struct latencies warm;
+    /* KB */
+    glong peak_rss;
+    /* Bytes of every png that came out */
+    GArray *png_sizes;
+};
+
+static void add_case(GPtrArray *cases, const char *command,
+        const char *snippet, gsize length){
+    struct render_case *render_case = g_new0(struct render_case, 1);
+
+    render_case->command = g_string_new(command);
+    render_case->snippet = g_string_new_len(snippet, length);
+    g_ptr_array_add(cases, render_case);
+}
+
+static void free_case(gpointer data){
+    struct render_case *render_case = data;
+
+    g_string_free(render_case->command, TRUE);
+    g_string_free(render_case->snippet, TRUE);
+    g_free(render_case);
+}
+
+/* Every command of the smoke test that has a backend */
+static gboolean read_smoketest(GPtrArray *cases){
+    GPtrArray *commands, *snippets;
+    GArray *spans;
+    GString *message, *command, *snippet;
+    gchar *contents;
+    gsize length;
+    guint i;
+
+    if (!g_file_get_contents(SMOKETEST, &contents, &length, NULL))
+        return FALSE;
+
+    message = g_string_new_len(contents, length);
+    g_free(contents);
+
+    if (get_commands(message, &commands, &snippets, &spans)){
+        for (i=0; i<commands->len; i++){
+            command = g_ptr_array_index(commands, i);
+            snippet = g_ptr_array_index(snippets, i);
+            if (is_command(command))
+                add_case(cases, command->str, snippet->str, snippet->len);
+            g_string_free(command, TRUE);
+            g_string_free(snippet, TRUE);
+        }
+        g_ptr_array_free(commands, TRUE);
+        g_ptr_array_free(snippets, TRUE);
+        g_array_free(spans, TRUE);
+    }
+
+    g_string_free(message, TRUE);
+
+    return TRUE;
+}
+
+/* What is between begin and end in contents, or NULL */
+static const char *between(const char *contents, const char *begin,
+        const char *end, gsize *length){
+    const char *start, *stop;
+
+    if ((start = strstr(contents, begin)) == NULL)
+        return NULL;
+    start += strlen(begin);
+
+    if ((stop = strstr(start, end)) == NULL)
+        return NULL;
+
+    *length = stop - start;
+
+    return start;
+}
+
+/* The listings and tikz pictures of the complete documents in
+ * markup_tests/, as the snippets they were made from */
+static void read_markup_test(GPtrArray *cases, const char *path){
+    const char *body;
+    gchar *contents, *language;
+    gsize length, language_length;
+
+    if (!g_file_get_contents(path, &contents, NULL, NULL))
+        return;
+
+    if ((body = between(contents, "\\begin{lstlisting}", "\\end{lstlisting}",
+                    &length)) != NULL){
+        /* The template puts the newlines around it again */
+        body += strspn(body, " \n");
+        while (length > 0 && strchr(" \n", body[length - 1]) != NULL)
+            length--;
+
+        language = (gchar *) between(contents, "\\lstset{language=", "}",
+                &language_length);
+        language = language != NULL
+            ? g_strndup(language, language_length) : g_strdup("latex");
+        add_case(cases, language, body, length);
+        g_free(language);
+    } else if ((body = between(contents, "\\begin{tikzpicture}",
+                    "\\end{tikzpicture}", &length)) != NULL){
+        add_case(cases, "tikz", body, length);
+    } else {
+        fprintf(stderr, "Nothing to render in %s\n", path);
+    }
+
+    g_free(contents);
+}
+
+static gint compare_names(gconstpointer a, gconstpointer b){
+    return strcmp(*(const char * const *) a, *(const char * const *) b);
+}
+
+static void read_markup_tests(GPtrArray *cases){
+    GPtrArray *paths = g_ptr_array_new_with_free_func(g_free);
+    const gchar *name;
+    GDir *dir;
+    guint i;
+
+    if ((dir = g_dir_open(MARKUP_TESTS, 0, NULL)) == NULL)
+        return;
+
+    while ((name = g_dir_read_name(dir)) != NULL){
+        if (g_str_has_suffix(name, ".tex"))
+            g_ptr_array_add(paths,
+                    g_build_filename(MARKUP_TESTS, name, NULL));
+    }
+    g_dir_close(dir);
+
+    g_ptr_array_sort(paths, compare_names);
+    for (i=0; i<paths->len; i++)
+        read_markup_test(cases, g_ptr_array_index(paths, i));
+
+    g_ptr_array_free(paths, TRUE);
+}
+
+/* The cases kind renders, in corpus order */
+static GPtrArray *cases_of(const GPtrArray *cases,
+        const struct backend_kind *kind){
+    GPtrArray *result = g_ptr_array_new();
+    struct render_case *render_case;
+    struct mapping backend;
+    guint i;
+
+    for (i=0; i<cases->len; i++){
+        render_case = g_ptr_array_index(cases, i);
+        if (find_backend(render_case->command, &backend)
+                && backend.handler == kind->handler)
+            g_ptr_array_add(result, render_case);
+    }
+
+    return result;
+}
+
+/* Names of the tools of kind that are not installed, or NULL */
+static gchar *missing_tools(const struct backend_kind *kind){
+    GString *missing = NULL;
+    gchar *path;
+    int i;
+
+    for (i=0; kind->tools[i] != NULL; i++){
+        if ((path = g_find_program_in_path(kind->tools[i])) != NULL){
+            g_free(path);
+            continue;
+        }
+
+        if (missing == NULL)
+            missing = g_string_new(kind->tools[i]);
+        else
+            g_string_append_printf(missing, ", %s", kind->tools[i]);
+    }
+
+    return missing != NULL ? g_string_free(missing, FALSE) : NULL;
+}
+
+/* A format directory of its own and a fresh set of workers, so
+ * nothing is left over from the renders before */
+static gchar *start_formats(void){
+    GError *error = NULL;
+    gchar *directory;
+
+    if ((directory = g_dir_make_tmp("pifo-bench-XXXXXX", &error)) == NULL){
+        fprintf(stderr, "No format directory: %s\n", error->message);
+        g_error_free(error);
+        exit(1);
+    }
+
+    pifo_format_init(directory);
+    pifo_worker_init();
+
+    return directory;
+}
+
+static void stop_formats(gchar *directory){
+    const gchar *name;
+    gchar *path;
+    GDir *dir;
+
+    pifo_worker_shutdown();
+    pifo_format_shutdown();
+
+    if ((dir = g_dir_open(directory, 0, NULL)) != NULL){
+        while ((name = g_dir_read_name(dir)) != NULL){
+            path = g_build_filename(directory, name, NULL);
+            unlink(path);
+            g_free(path);
+        }
+        g_dir_close(dir);
+    }
+
+    rmdir(directory);
+    g_free(directory);
+}
+
+static void render(const struct render_case *render_case,
+        struct latencies *latencies, struct backend_result *result){
+    GString *png;
+    gint64 start, elapsed;
+    glong rss;
+    gsize size;
+
+    /* Whatever was reaped before is none of ours */
+    pifo_spawn_peak_rss();
+
+    start = g_get_monotonic_time();
+    png = dispatch_command(render_case->command, render_case->snippet);
+    elapsed = g_get_monotonic_time() - start;
+
+    rss = pifo_spawn_peak_rss();
+    result->peak_rss = MAX(result->peak_rss, rss);
+
+    if (png == NULL){
+        fprintf(stderr, "Could not render \\%s{%.32s...}\n",
+                render_case->command->str, render_case->snippet->str);
+        latencies->failures++;
+        return;
+    }
+
+    size = png->len;
+    g_array_append_val(latencies->samples, elapsed);
+    g_array_append_val(result->png_sizes, size);
+    g_string_free(png, TRUE);
+}
+
+static void run_cold(const GPtrArray *cases, int rounds,
+        struct backend_result *result){
+    gchar *directory;
+    guint i;
+    int round;
+
+    for (round=0; round<rounds; round++){
+        for (i=0; i<cases->len; i++){
+            directory = start_formats();
+            render(g_ptr_array_index(cases, i), &result->cold, result);
+            stop_formats(directory);
+        }
+    }
+}
+
+static void run_warm(const GPtrArray *cases, int rounds,
+        struct backend_result *result){
+    struct backend_result unmeasured;
+    gchar *directory = start_formats();
+    guint i;
+    int round;
+
+    /* Dumps the formats and gets the workers going */
+    memset(&unmeasured, 0, sizeof(unmeasured));
+    unmeasured.warm.samples = g_array_new(FALSE, FALSE, sizeof(gint64));
+    unmeasured.png_sizes = g_array_new(FALSE, FALSE, sizeof(gsize));
+    for (i=0; i<cases->len; i++)
+        render(g_ptr_array_index(cases, i), &unmeasured.warm, &unmeasured);
+    g_array_free(unmeasured.warm.samples, TRUE);
+    g_array_free(unmeasured.png_sizes, TRUE);
+
+    for (round=0; round<rounds; round++){
+        for (i=0; i<cases->len; i++)
+            render(g_ptr_array_index(cases, i), &result->warm, result);
+    }
+
+    stop_formats(directory);
+}
+
+static gint compare_int64(gconstpointer a, gconstpointer b){
+    gint64 x = *(const gint64 *) a, y = *(const gint64 *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static gint compare_size(gconstpointer a, gconstpointer b){
+    gsize x = *(const gsize *) a, y = *(const gsize *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Nearest rank, of sorted samples */
+static double percentile_ms(const GArray *samples, int percent){
+    guint rank = (samples->len * percent + 99) / 100;
+
+    return g_array_index(samples, gint64, MAX(rank, 1) - 1) / 1000.0;
+}
+
+static void print_latencies(const char *name, struct latencies *latencies){
+    GArray *samples = latencies->samples;
+
+    printf("      \"%s\": {\"samples\": %u, \"failures\": %u",
+            name, samples->len, latencies->failures);
+
+    if (samples->len > 0){
+        g_array_sort(samples, compare_int64);
+        printf(", \"p50_ms\": %.1f, \"p95_ms\": %.1f, \"p99_ms\": %.1f",
+                percentile_ms(samples, 50), percentile_ms(samples, 95),
+                percentile_ms(samples, 99));
+    }
+
+    printf("},\n");
+}
+
+static void print_result(const struct backend_kind *kind, guint cases,
+        struct backend_result *result){
+    GArray *sizes = result->png_sizes;
+
+    printf("    {\n      \"backend\": \"%s\",\n      \"cases\": %u,\n",
+            kind->name, cases);
+    print_latencies("cold", &result->cold);
+    print_latencies("warm", &result->warm);
+    printf("      \"peak_child_rss_kb\": %ld", result->peak_rss);
+
+    if (sizes->len > 0){
+        g_array_sort(sizes, compare_size);
+        printf(",\n      \"png_bytes\": {\"min\": %lu, \"p50\": %lu, "
+                "\"max\": %lu}",
+                (unsigned long) g_array_index(sizes, gsize, 0),
+                (unsigned long) g_array_index(sizes, gsize,
+                    (sizes->len - 1) / 2),
+                (unsigned long) g_array_index(sizes, gsize, sizes->len - 1));
+    }
+
+    printf("\n    }");
+}
+
+int main(int argc, char **argv){
+    struct pifo_limits limits = {TIMEOUT_S, 0, 0, 0, 0};
+    int cold_rounds = argc > 1 ? atoi(argv[1]) : DEFAULT_COLD_ROUNDS;
+    int warm_rounds = argc > 2 ? atoi(argv[2]) : DEFAULT_WARM_ROUNDS;
+    struct backend_result result;
+    GPtrArray *cases, *kind_cases;
+    static int handle;
+    gchar *missing;
+    int i;
+
+    /* Like Pidgin, so a tool that quits early cannot kill us */
+    signal(SIGPIPE, SIG_IGN);
+
+    pifo_util_init();
+    pifo_spawn_set_limits(&limits);
+    pifo_workspace_init();
+    pifo_generator_init(&handle);
+
+    cases = g_ptr_array_new_with_free_func(free_case);
+    if (!read_smoketest(cases)){
+        fprintf(stderr, "Cannot read %s, run this from the top "
+                "of the tree\n", SMOKETEST);
+        return 1;
+    }
+    read_markup_tests(cases);
+    for (i=0; i<G_N_ELEMENTS(extra_cases); i++)
+        add_case(cases, extra_cases[i][0], extra_cases[i][1],
+                strlen(extra_cases[i][1]));
+
+    printf("{\n  \"cold_rounds\": %d,\n  \"warm_rounds\": %d,\n"
+            "  \"backends\": [\n", cold_rounds, warm_rounds);
+
+    for (i=0; i<G_N_ELEMENTS(kinds); i++){
+        if (i > 0)
+            printf(",\n");
+
+        kind_cases = cases_of(cases, &kinds[i]);
+
+        if ((missing = missing_tools(&kinds[i])) != NULL){
+            printf("    {\"backend\": \"%s\", \"skipped\": "
+                    "\"not installed: %s\"}", kinds[i].name, missing);
+            fprintf(stderr, "Skipping %s, not installed: %s\n",
+                    kinds[i].name, missing);
+            g_free(missing);
+            g_ptr_array_free(kind_cases, TRUE);
+            continue;
+        }
+
+        fprintf(stderr, "Rendering %u %s cases\n",
+                kind_cases->len, kinds[i].name);
+
+        memset(&result, 0, sizeof(result));
+        result.cold.samples = g_array_new(FALSE, FALSE, sizeof(gint64));
+        result.warm.samples = g_array_new(FALSE, FALSE, sizeof(gint64));
+        result.png_sizes = g_array_new(FALSE, FALSE, sizeof(gsize));
+
+        run_cold(kind_cases, cold_rounds, &result);
+        run_warm(kind_cases, warm_rounds, &result);
+        print_result(&kinds[i], kind_cases->len, &result);
+
+        g_array_free(result.cold.samples, TRUE);
+        g_array_free(result.warm.samples, TRUE);
+        g_array_free(result.png_sizes, TRUE);
+        g_ptr_array_free(kind_cases, TRUE);
+    }
+
+    printf("\n  ]\n}\n");
+
+    g_ptr_array_free(cases, TRUE);
+    pifo_generator_uninit(&handle);
+    pifo_workspace_shutdown();
+
+    return 0;
+}
@@ -0,0 +1,339 @@
+/*
+ * Throughput of the command scanner, in MB/s, on plain text, on text
+ * full of markup and on runs of backslashes. Every corpus is also
+ * run through the byte at a time state machine the scanner replaced,
+ * which the results have to agree with.
+ *
+ *     $ make bench
+ *     $ ./bench/bench_scanner [megabytes]
+ */
+#include "pifo_scan.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_MB 16
+#define ROUNDS 5
+
+/* The scanner cases of test/smoketest.md, and some more */
+static const char *cases[] = {
+    "\\n",
+    "\\\\\\\\\\\\\\\\\\\\\\\\\\\\",
+    "\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\f{fnord}",
+    "\\{foo}",
+    "{lol}",
+    "\\{}",
+    "\\f\\o\\r\\formula{abgefahren}",
+    "If \\formula{a \\to b} then \\formula{b \\to c}!",
+    "\\formula{\\lim_{x \\to \\infty} \\exp(-x) = 0}",
+    "\\dot{digraph foo {a->a->a->a;}} and \\dot{digraph foo {a->a->a->a;}}",
+    "\\c{ never closed",
+    "\\c{}\\c{{}}\\c{{{}}}",
+    "\\a b{c} \\d!{e} \\f\\g{h}",
+    "trailing \\",
+    "trailing \\c",
+    "",
+    NULL
+};
+
+static void free_strings(GPtrArray *strings){
+    guint i;
+
+    for (i=0; i<strings->len; i++)
+        g_string_free(g_ptr_array_index(strings, i), TRUE);
+    g_ptr_array_free(strings, TRUE);
+}
+
+/* The state machine get_commands() used to run, appending a
+ * character at a time */
+static void reference_scan(const GString *buffer, GArray *spans,
+        GPtrArray *commands, GPtrArray *arguments){
+    enum state {
+        NORMAL, BACKSLASH, CMDNAME, ARGOPEN, TERM
+    };
+
+    struct command_span span;
+    GString *cmd = NULL, *arg = NULL;
+    gsize i;
+    int stackcnt = 0;
+    char current;
+    enum state state = NORMAL;
+
+    for (i=0; i<buffer->len + 1 && state != TERM; i++){
+        current = buffer->str[i];
+        switch (state){
+            case NORMAL:
+                if (current == '\\'){
+                    state = BACKSLASH;
+                    span.start = i;
+                    cmd = g_string_new(NULL);
+                }
+                break;
+            case BACKSLASH:
+                if (current == '\\'){
+                    span.start = i;
+                } else if (g_ascii_isalnum(current)){
+                    state = CMDNAME;
+                    g_string_append_c(cmd, current);
+                } else {
+                    state = NORMAL;
+                    g_string_free(cmd, TRUE);
+                }
+                break;
+            case CMDNAME:
+                if (current == '\\'){
+                    state = BACKSLASH;
+                    span.start = i;
+                    g_string_free(cmd, TRUE);
+                    cmd = g_string_new(NULL);
+                } else if (g_ascii_isalnum(current)){
+                    g_string_append_c(cmd, current);
+                } else if (current == '{'){
+                    stackcnt = 1;
+                    state = ARGOPEN;
+                    arg = g_string_new(NULL);
+                } else {
+                    state = NORMAL;
+                    g_string_free(cmd, TRUE);
+                }
+                break;
+            case ARGOPEN:
+                if (current == '\0'){
+                    g_string_free(cmd, TRUE);
+                    g_string_free(arg, TRUE);
+                    state = TERM;
+                } else if (current == '}' && --stackcnt == 0){
+                    span.end = i + 1;
+                    g_array_append_val(spans, span);
+                    g_ptr_array_add(commands, cmd);
+                    g_ptr_array_add(arguments, arg);
+                    state = NORMAL;
+                } else {
+                    if (current == '{')
+                        stackcnt++;
+                    g_string_append_c(arg, current);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    if (state == BACKSLASH || state == CMDNAME)
+        g_string_free(cmd, TRUE);
+}
+
+/* Runs both scanners over buffer, returns the number of commands
+ * or -1 if they disagree */
+static int compare(const GString *buffer){
+    GArray *expected = g_array_new(FALSE, FALSE,
+            sizeof(struct command_span));
+    GPtrArray *expected_commands = g_ptr_array_new();
+    GPtrArray *expected_snippets = g_ptr_array_new();
+    GPtrArray *commands, *snippets;
+    GArray *spans;
+    struct command_span *a, *b;
+    GString *x, *y;
+    int result;
+    guint i;
+
+    reference_scan(buffer, expected, expected_commands, expected_snippets);
+
+    if (!get_commands(buffer, &commands, &snippets, &spans)){
+        result = expected->len == 0 ? 0 : -1;
+        goto out;
+    }
+
+    result = spans->len == expected->len ? (int) spans->len : -1;
+    for (i=0; result != -1 && i<spans->len; i++){
+        a = &g_array_index(spans, struct command_span, i);
+        b = &g_array_index(expected, struct command_span, i);
+        if (a->start != b->start || a->end != b->end)
+            result = -1;
+
+        x = g_ptr_array_index(commands, i);
+        y = g_ptr_array_index(expected_commands, i);
+        if (strcmp(x->str, y->str) != 0)
+            result = -1;
+
+        x = g_ptr_array_index(snippets, i);
+        y = g_ptr_array_index(expected_snippets, i);
+        if (x->len != y->len || memcmp(x->str, y->str, x->len) != 0)
+            result = -1;
+    }
+
+    if (pifo_scan_has_command(buffer->str, buffer->len) != (result > 0))
+        result = -1;
+
+    free_strings(commands);
+    free_strings(snippets);
+    g_array_free(spans, TRUE);
+
+out:
+    free_strings(expected_commands);
+    free_strings(expected_snippets);
+    g_array_free(expected, TRUE);
+
+    return result;
+}
+
+static void append_words(GString *corpus, GRand *rand, int words){
+    static const char *dictionary[] = {
+        "the", "build", "is", "green", "again", "did", "anybody",
+        "look", "at", "my", "patch", "yet", "lunch?", "ok,", "see",
+        "logs:", "[12:03:44]", "<nick>", "http://example.org/a/b", "::"
+    };
+    int i;
+
+    for (i=0; i<words; i++){
+        g_string_append(corpus,
+                dictionary[g_rand_int_range(rand, 0,
+                    G_N_ELEMENTS(dictionary))]);
+        g_string_append_c(corpus,
+                g_rand_int_range(rand, 0, 12) == 0 ? '\n' : ' ');
+    }
+}
+
+static GString *plain_text(gsize size, GRand *rand){
+    GString *corpus = g_string_sized_new(size + 64);
+
+    while (corpus->len < size)
+        append_words(corpus, rand, 64);
+
+    return corpus;
+}
+
+static GString *markup(gsize size, GRand *rand){
+    static const char *snippets[] = {
+        "\\formula{\\frac{a}{b} + \\sqrt{c}}",
+        "\\c{int main(void){ return 0; }}",
+        "\\dot{digraph g {a->b->c; b->{d e}}}",
+        "\\tikz{\\draw (0,0) -- (1,1);}",
+        "\\haskell{main = print [x | x <- [1..10]]}"
+    };
+    GString *corpus = g_string_sized_new(size + 256);
+
+    while (corpus->len < size){
+        append_words(corpus, rand, g_rand_int_range(rand, 2, 16));
+        g_string_append(corpus,
+                snippets[g_rand_int_range(rand, 0, G_N_ELEMENTS(snippets))]);
+        g_string_append_c(corpus, ' ');
+    }
+
+    return corpus;
+}
+
+static GString *backslashes(gsize size, GRand *rand){
+    GString *corpus = g_string_sized_new(size + 256);
+    int i, run;
+
+    while (corpus->len < size){
+        run = g_rand_int_range(rand, 1, 64);
+        switch (g_rand_int_range(rand, 0, 4)){
+            case 0:
+                for (i=0; i<run; i++)
+                    g_string_append_c(corpus, '\\');
+                break;
+            case 1:
+                for (i=0; i<run; i++)
+                    g_string_append(corpus, "\\a");
+                break;
+            case 2:
+                for (i=0; i<run; i++)
+                    g_string_append(corpus, "\\{}");
+                break;
+            default:
+                for (i=0; i<run; i++)
+                    g_string_append(corpus, "\\x ");
+                g_string_append(corpus, "\\y{\\}");
+                break;
+        }
+    }
+
+    return corpus;
+}
+
+static double megabytes_per_second(gsize bytes, gint64 usecs){
+    return usecs > 0 ? (double) bytes / usecs * G_USEC_PER_SEC / (1 << 20)
+        : 0.0;
+}
+
+/* Best of a few rounds, so a busy machine does not show up as
+ * a slow scanner */
+static gint64 time_scanner(const GString *corpus, gboolean reference){
+    GPtrArray *commands, *snippets;
+    GArray *spans;
+    gint64 best = G_MAXINT64, start, elapsed;
+    int round;
+
+    for (round=0; round<ROUNDS; round++){
+        start = g_get_monotonic_time();
+        if (reference){
+            spans = g_array_new(FALSE, FALSE, sizeof(struct command_span));
+            commands = g_ptr_array_new();
+            snippets = g_ptr_array_new();
+            reference_scan(corpus, spans, commands, snippets);
+            free_strings(commands);
+            free_strings(snippets);
+            g_array_free(spans, TRUE);
+        } else if (get_commands(corpus, &commands, &snippets, &spans)){
+            free_strings(commands);
+            free_strings(snippets);
+            g_array_free(spans, TRUE);
+        }
+        elapsed = g_get_monotonic_time() - start;
+        best = MIN(best, elapsed);
+    }
+
+    return best;
+}
+
+int main(int argc, char **argv){
+    struct {
+        const char *name;
+        GString *(*generate)(gsize size, GRand *rand);
+    } corpora[] = {
+        {"plain", plain_text},
+        {"markup", markup},
+        {"backslashes", backslashes}
+    };
+    gsize size = (gsize) (argc > 1 ? atoi(argv[1]) : DEFAULT_MB) << 20;
+    GRand *rand = g_rand_new_with_seed(42);
+    GString *corpus;
+    int i, found, failed = 0;
+
+    for (i=0; cases[i] != NULL; i++){
+        corpus = g_string_new(cases[i]);
+        if (compare(corpus) == -1){
+            printf("MISMATCH on [%s]\n", cases[i]);
+            failed = 1;
+        }
+        g_string_free(corpus, TRUE);
+    }
+
+    printf("%-12s %10s %10s %12s %12s\n",
+            "corpus", "MB", "commands", "scan MB/s", "fsm MB/s");
+
+    for (i=0; i<G_N_ELEMENTS(corpora); i++){
+        corpus = corpora[i].generate(size, rand);
+
+        if ((found = compare(corpus)) == -1){
+            printf("%-12s MISMATCH\n", corpora[i].name);
+            failed = 1;
+        } else {
+            printf("%-12s %10.1f %10d %12.1f %12.1f\n",
+                    corpora[i].name, (double) corpus->len / (1 << 20), found,
+                    megabytes_per_second(corpus->len,
+                        time_scanner(corpus, FALSE)),
+                    megabytes_per_second(corpus->len,
+                        time_scanner(corpus, TRUE)));
+        }
+
+        g_string_free(corpus, TRUE);
+    }
+
+    g_rand_free(rand);
+
+    return failed;
+}
@@ -0,0 +1,42 @@
+/*
+ * Just enough of libpurple to run the plugin's code outside of
+ * Pidgin: debug output is dropped, prefs are unset and the imgstore
+ * only hands out ids. The benchmarks link against this instead of
+ * libpurple.
+ */
+#include "pifo.h"
+
+static int last_image_id = 0;
+
+void purple_debug(PurpleDebugLevel level, const char *category,
+        const char *format, ...){
+}
+
+void purple_debug_info(const char *category, const char *format, ...){
+}
+
+void purple_debug_error(const char *category, const char *format, ...){
+}
+
+const char *purple_prefs_get_string(const char *name){
+    return NULL;
+}
+
+guint purple_prefs_connect_callback(void *handle, const char *name,
+        PurplePrefCallback cb, gpointer data){
+    return 0;
+}
+
+void purple_prefs_disconnect_by_handle(void *handle){
+}
+
+/* Takes ownership of data, like the real one */
+int purple_imgstore_add_with_id(gpointer data, size_t size,
+        const char *filename){
+    g_free(data);
+
+    return ++last_image_id;
+}
+
+void purple_imgstore_unref_by_id(int id){
+}
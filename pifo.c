@@ -34,6 +34,17 @@
 #include "pifo.h"
 #include "pifo_util.h"
 #include "pifo_generator.h"
+#include "pifo_job.h"
+#include "pifo_cache.h"
+#include "pifo_diskcache.h"
+#include "pifo_format.h"
+#include "pifo_worker.h"
+#include "pifo_spawn.h"
+#include "pifo_workspace.h"
+#include "pifo_imgreg.h"
+#include "pifo_message.h"
+#include "pifo_stats.h"
+#include "pifo_trace.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -48,12 +59,6 @@
 
 PurplePlugin *me;
 
-gboolean contains_work(const char *message){
-    if (strstr(message, INTRO))
-        return TRUE;
-    return FALSE;
-}
-
 void open_log(PurpleConversation *conv) {
 	conv->logs = g_list_append(NULL,
             purple_log_new(conv->type == PURPLE_CONV_TYPE_CHAT ? PURPLE_LOG_CHAT :
@@ -61,271 +66,14 @@ void open_log(PurpleConversation *conv) {
                 conv, time(NULL), NULL));
 }
 
-/*
- * Here is the FSM as dot
-   digraph fsm {
-       NORMAL -> BACKSLASH [label="\\"];
-       BACKSLASH -> NORMAL [label="[^(::alnum::|\\)]"];
-       BACKSLASH -> BACKSLASH [label="\\"];
-       BACKSLASH -> COMMAND [label="[::alnum::]"];
-       COMMAND -> BACKSLASH [label="\\"];
-       COMMAND -> NORMAL [label="[^(::alnum::|\\)]"];
-       COMMAND -> COMMAND [label="[::alnum::]"];
-       COMMAND -> ARGUMENT [label="{"];
-       ARGUMENT -> NORMAL [label="}"];
-   }
- */
-gboolean get_commands(const GString *buffer,
-        GPtrArray **cmds, GPtrArray **args){
-    GPtrArray *commands = g_ptr_array_new();
-    GPtrArray *arguments = g_ptr_array_new();
-
-    GString *cmd;
-    GString *arg;
-
-    enum state {
-        NORMAL, BACKSLASH, CMDNAME, ARGOPEN, TERM
-    };
-
-    int i;
-    int stackcnt = 0;
-    char current;
-    enum state state = NORMAL;
-
-    /* Implementation of command scanner as DFSM.
-     * We explicitly want to read the terminating
-     * character. I find this more intuitive... */
-    for (i=0; i<buffer->len + 1; i++){
-        current = buffer->str[i];
-        switch (state){
-            case NORMAL:
-                if (current == '\\'){
-                    state = BACKSLASH;
-                    cmd = g_string_new(NULL);
-                }
-                break;
-            case BACKSLASH:
-                if (current == '\\'){
-                    state == BACKSLASH;
-                } else if (g_ascii_isalnum(current)){
-                    state = CMDNAME;
-                    g_string_append_c(cmd, current);
-                } else {
-                    state = NORMAL;
-                    g_string_free(cmd, TRUE);
-                }
-                break;
-            case CMDNAME:
-                if (current == '\\'){
-                    state = BACKSLASH;
-                    g_string_free(cmd, TRUE);
-                    cmd = g_string_new(NULL);
-                } else if (g_ascii_isalnum(current)){
-                    state = CMDNAME;
-                    g_string_append_c(cmd, current);
-                } else if (current == '{'){
-                    stackcnt++;
-                    state = ARGOPEN;
-                    arg = g_string_new(NULL);
-                } else {
-                    state = NORMAL;
-                    g_string_free(cmd, TRUE);
-                }
-                break;
-            case ARGOPEN:
-                if (current == '\0'){
-                    g_string_free(cmd, TRUE);
-                    g_string_free(arg, TRUE);
-                    state = TERM;
-                } else {
-                    if (current == '{'){
-                        g_string_append_c(arg, current);
-                        stackcnt++;
-                    } else if (current == '}'){
-                        stackcnt--;
-
-                        if (stackcnt == 0){
-                            g_ptr_array_add(commands, cmd);
-                            g_ptr_array_add(arguments, arg);
-
-                            state = NORMAL;
-                        } else {
-                            g_string_append_c(arg, current);
-                        }
-                    } else {
-                        g_string_append_c(arg, current);
-                    }
-                }
-                break;
-            default:
-                break;
-        }
-    }
-
-#ifdef DEBUG
-    for (i=0; i<commands->len; i++){
-        cmd = g_ptr_array_index(commands, i);
-
-        printf("Salvaged command #%i = [%s]\n", i, cmd->str);
-    }
-
-    for (i=0; i<arguments->len; i++){
-        arg = g_ptr_array_index(arguments, i);
-
-        printf("Salvaged snippet #%i = [%s]\n", i, arg->str);
-    }
-#endif
-
-    if (commands->len > 0){
-        *cmds = commands;
-        *args = arguments;
-
-        return TRUE;
-    } else {
-        g_ptr_array_free(commands, TRUE);
-        g_ptr_array_free(arguments, TRUE);
-        *cmds = NULL;
-        *args = NULL;
-        return FALSE;
-    }
-}
-
-
-GString *replace_error(const GString *original,
-        const GString *command,
-        const GString *snippet,
-        const char * message){
-
-    GString *replacer = g_string_new(message);
-
-    GString *to_replace = g_string_new(INTRO);
-    char *new_msg;
-    GString *result;
-
-    g_string_append(to_replace, command->str);
-    g_string_append(to_replace, "{");
-    g_string_append(to_replace, snippet->str);
-    g_string_append(to_replace, "}");
-
-#ifdef DEBUG
-    printf("replace_error: %s with %s\n",
-            to_replace->str, replacer->str);
-#endif
-
-    new_msg = str_replace(original->str, to_replace->str, replacer->str);
-
-    g_string_free(replacer, TRUE);
-    g_string_free(to_replace, TRUE);
-
-    result = g_string_new(new_msg);
-    free(new_msg);
-
-#ifdef DEBUG
-    printf("result: %s\n", result->str);
-#endif
-
-    return result;
-}
-
-GString *replace(const GString *original,
-        const GString *command, const GString *snippet, int id){
-
-    GString *replacer = g_string_new(IMG_BEG);
-    GString *to_replace = g_string_new(INTRO);
-    char idbuffer[10];
-    char *new_msg;
-    GString *result;
-
-    g_string_append(to_replace, command->str);
-    g_string_append(to_replace, "{");
-    g_string_append(to_replace, snippet->str);
-    g_string_append(to_replace, "}");
-
-	sprintf(idbuffer, "%d\0", id);
-    g_string_append(replacer, idbuffer);
-    g_string_append(replacer, IMG_END);
-
-#ifdef DEBUG
-    printf("replace: %s with %s\n", to_replace->str, replacer->str);
-#endif
-
-    new_msg = str_replace(original->str, to_replace->str, replacer->str);
-
-    g_string_free(replacer, TRUE);
-    g_string_free(to_replace, TRUE);
-
-    result = g_string_new(new_msg);
-    free(new_msg);
-
-#ifdef DEBUG
-    printf("result: %s\n", result->str);
-#endif
-
-    return result;
-}
-
-
-/* Credit to http://stackoverflow.com/questions/779875/
- * what-is-the-function-to-replace-string-in-c*/
-char *str_replace(const char *orig, const char *rep, const char *with) {
-    const char *ins;    // the next insert point
-    char *result; // the return string
-    char *tmp;    // varies
-    int len_rep;  // length of rep
-    int len_with; // length of with
-    int len_front; // distance between rep and end of last rep
-    int count;    // number of replacements
-
-    if (!orig || !rep || !with)
-        return NULL;
-
-    len_rep = strlen(rep);
-    len_with = strlen(with);
-
-    /* count occurences of rep in orig */
-    ins = orig;
-    for (count = 0; tmp = strstr(ins, rep); ++count) {
-        ins = tmp + len_rep;
-    }
-
-    // first time through the loop, all the variable are set correctly
-    // from here on,
-    //    tmp points to the end of the result string
-    //    ins points to the next occurrence of rep in orig
-    //    orig points to the remainder of orig after "end of rep"
-    tmp = result = malloc(strlen(orig) + (len_with - len_rep) * count + 1);
-
-    if (!result)
-        return NULL;
-
-    while (count--) {
-        ins = strstr(orig, rep);
-        len_front = ins - orig;
-        tmp = strncpy(tmp, orig, len_front) + len_front;
-        tmp = strcpy(tmp, with) + len_with;
-        orig += len_front + len_rep; // move to next "end of rep"
-    }
-    strcpy(tmp, orig);
-    return result;
-}
-
-int load_image(const GString *resulting_png){
+/* Hands rendered png data over to the image registry, which takes
+ * ownership of it and keeps the image around for conv */
+int load_image(PurpleConversation *conv, const GString *command,
+        const GString *snippet, gchar *filedata, gsize size){
     int img_id = 0;
-    gchar *filedata;
-    gsize size;
-    GError *error;
 
-	if (!g_file_get_contents(resulting_png->str, &filedata, &size, &error)) {
-		purple_notify_error(me, "LaTeX",
-                "Error while reading the rendered markup [%s]",
-                error->message);
-		g_error_free(error);
-
-		return -1;
-	}
-
-	img_id = purple_imgstore_add_with_id(filedata,
-            MAX(1024, size), getfilename(resulting_png->str));
+	img_id = pifo_imgreg_add(conv, command->str, snippet->str,
+            filedata, size);
 
 	if (img_id == 0) {
 		purple_notify_error(me, "LaTeX",
@@ -337,129 +85,6 @@ int load_image(const GString *resulting_png){
     return img_id;
 }
 
-gboolean free_commands(const GPtrArray *commands){
-    int i;
-    GString *command;
-    for (i=0; i<commands->len; i++){
-        command = g_ptr_array_index(commands, i);
-        g_string_free(command, TRUE);
-    }
-
-    return TRUE;
-}
-
-gboolean free_snippets(const GPtrArray *snippets){
-    int i;
-    GString *snippet;
-    for (i=0; i<snippets->len; i++){
-        snippet = g_ptr_array_index(snippets, i);
-        g_string_free(snippet, TRUE);
-    }
-
-    return TRUE;
-}
-
-/* snippet is only vaild if it contains at least
-   one non-whitespace char */
-gboolean snippet_valid(const GString *snippet){
-     int i;
-     for (i=0; i<snippet->len; i++)
-	  if (! g_ascii_isspace (snippet->str[i]))
-	       return TRUE;
-
-     return FALSE;
-}
-
-GString *modify_message(const GString *message){
-    int image_id;
-    int i;
-
-    GString *snippet;
-    GString *command;
-    GString *picpath;
-    GString *old = g_string_new(message->str);
-    GString *new;
-
-    GPtrArray *snippets, *commands;
-    if (get_commands(message, &commands, &snippets) == FALSE){
-        purple_debug_info("PiFo",
-                "No commands in there! "
-                "Message not changed!\n");
-        return NULL;
-    }
-
-    for (i=0; i<commands->len; i++){
-        command = g_ptr_array_index(commands, i);
-        snippet = g_ptr_array_index(snippets, i);
-
-	if (!snippet_valid(snippet)){
-            purple_debug_info("PiFo",
-			      "Could not dispatch command\n",
-			      "Argument empty\n"); 
-
-            GString *error_msg = g_string_new(NULL);
-            g_string_append_printf(error_msg,
-                    "{PiFo: [%s] You have to provide an Argument!}",
-                    command->str);
-            new = replace_error(old, command, snippet, error_msg->str);
-
-            g_string_free(error_msg, TRUE);
-            g_string_free(old, TRUE);
-            old = new;
-
-        } else {
-
-	     picpath = dispatch_command(command, snippet);
-	     if (picpath == NULL){
-		  purple_debug_info("PiFo",
-				    "Could not dispatch command: [%s(%s,%s)]\n",
-				    "Command not found: ", command->str, snippet->str);
-
-		  GString *error_msg = g_string_new(NULL);
-		  g_string_append_printf(error_msg,
-					 "{PiFo: [%s] is not a valid command!}",
-					 command->str);
-		  new = replace_error(old, command, snippet, error_msg->str);
-
-		  g_string_free(error_msg, TRUE);
-		  g_string_free(old, TRUE);
-		  old = new;
-	     } else {
-		  image_id = load_image(picpath);
-
-		  if(image_id == -1){
-		       return NULL;
-		  }
-
-		  new = replace(old, command, snippet, image_id);
-
-		  unlink(picpath->str);
-		  g_string_free(old, TRUE);
-		  g_string_free(picpath, TRUE);
-
-		  old = new;
-	     }
-	}
-    }
-
-    purple_debug_info("PiFo",
-            "Changed message from [%s] to [%s]\n",
-            message->str, new->str);
-
-#ifdef DEBUG
-    printf("PiFo",
-            "Changed message from [%s] to [%s]\n",
-            message->str, new->str);
-#endif
-
-    free_snippets(snippets);
-    free_commands(commands);
-    g_ptr_array_free(snippets, TRUE);
-    g_ptr_array_free(commands, TRUE);
-
-    return new;
-}
-
 gboolean pidgin_latex_write(PurpleConversation *conv, 
         const char *partner, const char *message, 
         PurpleMessageFlags messFlag, const char *original){
@@ -539,6 +164,7 @@ gboolean message_receive(PurpleAccount *account,
 #endif
     GString *wrapper = g_string_new(unescaped);
     GString *modified;
+    gint64 traced, written;
     g_free(unescaped);
 
 	purple_debug_info("PiFo",
@@ -554,11 +180,17 @@ gboolean message_receive(PurpleAccount *account,
 		return FALSE;
 	}
 
-    modified = modify_message(wrapper);
+    traced = pifo_trace_start();
+    pifo_trace_message_begin();
+
+    modified = modify_message(conv, wrapper);
     if (modified == NULL){
         purple_debug_info("PiFo",
                 "Message could not be modified: [%s]\n",
                 *buffer);
+        g_string_free(wrapper, TRUE);
+        pifo_trace_span("message_receive", traced, conv->name);
+        pifo_trace_message_end();
         return FALSE;
     }
 
@@ -566,11 +198,16 @@ gboolean message_receive(PurpleAccount *account,
             "Modified message: [%s]\n",
             modified->str);
 
+    written = pifo_trace_start();
 	pidgin_latex_write(conv, who, modified->str, flags, *buffer);
+    pifo_trace_span("pidgin_latex_write", written, NULL);
 
     g_string_free(modified, TRUE);
     g_string_free(wrapper, TRUE);
 
+    pifo_trace_span("message_receive", traced, conv->name);
+    pifo_trace_message_end();
+
 	return TRUE;
 }
 
@@ -587,10 +224,191 @@ void message_send(PurpleConversation *conv, const char **buffer){
     return;
 }
 
+static void conversation_deleted(PurpleConversation *conv){
+    pifo_imgreg_release(conv);
+}
+
+static void cache_limit_changed(const char *name, PurplePrefType type,
+        gconstpointer val, gpointer data){
+    pifo_cache_set_limit((gsize) GPOINTER_TO_INT(val) * 1024);
+}
+
+static void disk_cache_limit_changed(const char *name, PurplePrefType type,
+        gconstpointer val, gpointer data){
+    pifo_diskcache_set_limit((gsize) GPOINTER_TO_INT(val) * 1024 * 1024);
+}
+
+static void update_limits(void){
+	struct pifo_limits limits;
+
+	limits.timeout_s = purple_prefs_get_int(PREF_TIMEOUT);
+	limits.cpu_s = purple_prefs_get_int(PREF_CPU_LIMIT);
+	limits.memory_mb = purple_prefs_get_int(PREF_MEMORY_LIMIT);
+	limits.nice = purple_prefs_get_int(PREF_NICE);
+	limits.ioprio = purple_prefs_get_int(PREF_IOPRIO);
+
+	pifo_spawn_set_limits(&limits);
+}
+
+static void limits_changed(const char *name, PurplePrefType type,
+        gconstpointer val, gpointer data){
+    update_limits();
+}
+
+static void update_image_budgets(void){
+	pifo_imgreg_set_budgets(
+		(gsize) purple_prefs_get_int(PREF_CONVERSATION_IMAGES) * 1024,
+		(gsize) purple_prefs_get_int(PREF_IMAGES) * 1024 * 1024);
+}
+
+static void image_budgets_changed(const char *name, PurplePrefType type,
+        gconstpointer val, gpointer data){
+    update_image_budgets();
+    pifo_imgreg_enforce_budgets();
+}
+
+static void update_stats(void){
+	gchar *path = g_build_filename(purple_user_dir(), "pifo",
+			"stats.json", NULL);
+
+	pifo_stats_set_enabled(purple_prefs_get_bool(PREF_STATS));
+	pifo_stats_set_dump(path, purple_prefs_get_bool(PREF_STATS)
+			? purple_prefs_get_int(PREF_STATS_DUMP) : 0);
+	g_free(path);
+}
+
+static void stats_changed(const char *name, PurplePrefType type,
+        gconstpointer val, gpointer data){
+    update_stats();
+}
+
+static void show_image_memory(PurplePluginAction *action){
+	GString *report = pifo_imgreg_report();
+
+	purple_notify_formatted(action->plugin, "PiFo", "Image memory",
+			"What the rendered images of each open conversation take up",
+			report->str, NULL, NULL);
+	g_string_free(report, TRUE);
+}
+
+static void show_stats(PurplePluginAction *action){
+	GString *report = pifo_stats_report();
+
+	purple_notify_formatted(action->plugin, "PiFo", "Render statistics",
+			"Where rendering spent its time since PiFo was loaded",
+			report->str, NULL, NULL);
+	g_string_free(report, TRUE);
+}
+
+static void trace_changed(const char *name, PurplePrefType type,
+        gconstpointer val, gpointer data){
+    pifo_trace_set_enabled(GPOINTER_TO_INT(val));
+}
+
+/* Writes what was traced so far into a file of its own, which
+ * chrome://tracing or ui.perfetto.dev can open */
+static void write_trace(PurplePluginAction *action){
+	GString *trace;
+	GError *error = NULL;
+	gchar *name, *path, *message;
+	GDateTime *now;
+
+	if (pifo_trace_count() == 0){
+		purple_notify_info(action->plugin, "PiFo",
+				"Nothing traced yet", "Set " PREF_TRACE " to true "
+				"and render the snippets again to trace them.");
+		return;
+	}
+
+	trace = pifo_trace_json();
+	now = g_date_time_new_now_local();
+	name = g_date_time_format(now, "trace-%Y%m%d-%H%M%S.json");
+	path = g_build_filename(purple_user_dir(), "pifo", name, NULL);
+	g_date_time_unref(now);
+
+	if (g_file_set_contents(path, trace->str, trace->len, &error)){
+		message = g_strdup_printf("Open [%s] in chrome://tracing or "
+				"ui.perfetto.dev", path);
+		purple_notify_info(action->plugin, "PiFo",
+				"Render trace written", message);
+	} else {
+		message = g_strdup_printf("Could not write [%s]: %s",
+				path, error->message);
+		purple_notify_error(action->plugin, "PiFo",
+				"Render trace not written", message);
+		g_error_free(error);
+	}
+
+	g_free(message);
+	g_free(path);
+	g_free(name);
+	g_string_free(trace, TRUE);
+}
+
+static GList *plugin_actions(PurplePlugin *plugin, gpointer context){
+	GList *actions = NULL;
+
+	actions = g_list_append(actions, purple_plugin_action_new(
+				"Image memory", show_image_memory));
+	actions = g_list_append(actions, purple_plugin_action_new(
+				"Render statistics", show_stats));
+	actions = g_list_append(actions, purple_plugin_action_new(
+				"Write render trace", write_trace));
+
+	return actions;
+}
+
 gboolean plugin_load(PurplePlugin *plugin){
 	void *conv_handle = purple_conversations_get_handle();
+	gchar *cache_dir, *format_dir;
 
 	me = plugin;
+	pifo_util_init();
+	pifo_stats_init();
+	update_stats();
+	pifo_trace_init();
+	pifo_trace_set_enabled(purple_prefs_get_bool(PREF_TRACE));
+	update_limits();
+	pifo_workspace_init();
+	pifo_generator_init(plugin);
+	pifo_cache_init((gsize) purple_prefs_get_int(PREF_MEMORY_CACHE) * 1024);
+	cache_dir = g_build_filename(purple_user_dir(), "pifo", "cache", NULL);
+	pifo_diskcache_init(cache_dir,
+			    (gsize) purple_prefs_get_int(PREF_DISK_CACHE) * 1024 * 1024);
+	g_free(cache_dir);
+	format_dir = g_build_filename(purple_user_dir(), "pifo", "fmt", NULL);
+	pifo_format_init(format_dir);
+	g_free(format_dir);
+	pifo_worker_init();
+	pifo_imgreg_init();
+	update_image_budgets();
+	pifo_job_init();
+
+	purple_prefs_connect_callback(plugin, PREF_MEMORY_CACHE,
+			      cache_limit_changed, NULL);
+	purple_prefs_connect_callback(plugin, PREF_DISK_CACHE,
+			      disk_cache_limit_changed, NULL);
+	purple_prefs_connect_callback(plugin, PREF_TIMEOUT,
+			      limits_changed, NULL);
+	purple_prefs_connect_callback(plugin, PREF_CPU_LIMIT,
+			      limits_changed, NULL);
+	purple_prefs_connect_callback(plugin, PREF_MEMORY_LIMIT,
+			      limits_changed, NULL);
+	purple_prefs_connect_callback(plugin, PREF_NICE,
+			      limits_changed, NULL);
+	purple_prefs_connect_callback(plugin, PREF_IOPRIO,
+			      limits_changed, NULL);
+	purple_prefs_connect_callback(plugin, PREF_CONVERSATION_IMAGES,
+			      image_budgets_changed, NULL);
+	purple_prefs_connect_callback(plugin, PREF_IMAGES,
+			      image_budgets_changed, NULL);
+	purple_prefs_connect_callback(plugin, PREF_STATS,
+			      stats_changed, NULL);
+	purple_prefs_connect_callback(plugin, PREF_STATS_DUMP,
+			      stats_changed, NULL);
+	purple_prefs_connect_callback(plugin, PREF_TRACE,
+			      trace_changed, NULL);
+
 	purple_signal_connect(conv_handle, "sending-im-msg",
 			      plugin, PURPLE_CALLBACK(message_send_im), NULL);
 
@@ -603,6 +421,9 @@ gboolean plugin_load(PurplePlugin *plugin){
 	purple_signal_connect(conv_handle, "writing-chat-msg",
 			      plugin, PURPLE_CALLBACK(message_receive), NULL);
 
+	purple_signal_connect(conv_handle, "deleting-conversation",
+			      plugin, PURPLE_CALLBACK(conversation_deleted), NULL);
+
 	purple_debug_info("LaTeX", "LaTeX loaded\n");
 
 	return TRUE;
@@ -622,6 +443,20 @@ gboolean plugin_unload(PurplePlugin * plugin){
 	purple_signal_disconnect(conv_handle,
             "writing-chat-msg", plugin,
             PURPLE_CALLBACK(message_receive));
+	purple_signal_disconnect(conv_handle,
+            "deleting-conversation", plugin,
+            PURPLE_CALLBACK(conversation_deleted));
+
+	pifo_job_shutdown();
+	pifo_imgreg_shutdown();
+	pifo_worker_shutdown();
+	pifo_generator_uninit(plugin);
+	pifo_diskcache_shutdown();
+	pifo_cache_shutdown();
+	pifo_format_shutdown();
+	pifo_workspace_shutdown();
+	pifo_stats_shutdown();
+	pifo_trace_shutdown();
 
 	me = NULL;
 	purple_debug_info("LaTeX", "LaTeX unloaded\n");
@@ -659,8 +494,8 @@ PurplePluginInfo info = {
 	NULL,                                   /**< destroy        */
 	NULL,                                   /**< ui_info        */
 	NULL,                                   /**< extra_info     */
-	NULL,
-	NULL,
+	NULL,                                   /**< prefs_info     */
+	plugin_actions,                         /**< actions        */
 	NULL,
 	NULL,
 	NULL,
@@ -668,7 +503,19 @@ PurplePluginInfo info = {
 };
 
  void init_plugin(PurplePlugin *plugin){
-    return;
+	purple_prefs_add_none(PREF_ROOT);
+	purple_prefs_add_int(PREF_MEMORY_CACHE, 8192);
+	purple_prefs_add_int(PREF_DISK_CACHE, 64);
+	purple_prefs_add_int(PREF_TIMEOUT, 20);
+	purple_prefs_add_int(PREF_CPU_LIMIT, 30);
+	purple_prefs_add_int(PREF_MEMORY_LIMIT, 1024);
+	purple_prefs_add_int(PREF_NICE, 10);
+	purple_prefs_add_int(PREF_IOPRIO, 7);
+	purple_prefs_add_int(PREF_CONVERSATION_IMAGES, 16384);
+	purple_prefs_add_int(PREF_IMAGES, 128);
+	purple_prefs_add_bool(PREF_STATS, FALSE);
+	purple_prefs_add_int(PREF_STATS_DUMP, 0);
+	purple_prefs_add_bool(PREF_TRACE, FALSE);
 }
 
 PURPLE_INIT_PLUGIN(pifo, init_plugin, info)
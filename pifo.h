@@ -68,22 +68,27 @@
 #define FILTER_GT "&gt;"
 #define FILTER_BR "<br>"
 
+#define PREF_ROOT "/plugins/gtk/pifo"
+#define PREF_MEMORY_CACHE PREF_ROOT "/memory_cache_kb"
+#define PREF_DISK_CACHE PREF_ROOT "/disk_cache_mb"
+#define PREF_TIMEOUT PREF_ROOT "/timeout_s"
+#define PREF_CPU_LIMIT PREF_ROOT "/cpu_limit_s"
+#define PREF_MEMORY_LIMIT PREF_ROOT "/memory_limit_mb"
+#define PREF_NICE PREF_ROOT "/nice"
+#define PREF_IOPRIO PREF_ROOT "/ioprio"
+#define PREF_CONVERSATION_IMAGES PREF_ROOT "/conversation_images_kb"
+#define PREF_IMAGES PREF_ROOT "/images_mb"
+#define PREF_STATS PREF_ROOT "/stats"
+#define PREF_STATS_DUMP PREF_ROOT "/stats_dump_s"
+#define PREF_TRACE PREF_ROOT "/trace"
+
 #define NB_BLACKLIST (42)
 #define BLACKLIST { "\\def", "\\let", "\\futurelet", "\\newcommand", "\\renewcommand", "\\else", "\\fi", "\\write", "\\input", "\\include", "\\chardef", "\\catcode", "\\makeatletter", "\\noexpand", "\\toksdef", "\\every", "\\errhelp", "\\errorstopmode", "\\scrollmode", "\\nonstopmode", "\\batchmode", "\\read", "\\csname", "\\newhelp", "\\relax", "\\afterground", "\\afterassignment", "\\expandafter", "\\noexpand", "\\special", "\\command", "\\loop", "\\repeat", "\\toks", "\\output", "\\line", "\\mathcode", "\\name", "\\item", "\\section", "\\mbox", "\\DeclareRobustCommand" }
 
- char *str_replace(const char *orig, const char *rep, const char *with);
- GString *modify_message(const GString *message);
  gboolean is_blacklisted(const char *message);
  void open_log(PurpleConversation *conv);
- gboolean contains_work(const char *message);
- gboolean get_commands(const GString *buffer, 
-         GPtrArray **cmds, GPtrArray **args);
- GString *replace(const GString *original, 
-        const GString *command, const GString *snippet, int id);
- int load_image(const GString *resulting_png);
- gboolean free_commands(const GPtrArray *commands);
- gboolean free_snippets(const GPtrArray *commands);
- GString *modify_message(const GString *message);
+ int load_image(PurpleConversation *conv, const GString *command,
+        const GString *snippet, gchar *filedata, gsize size);
  gboolean pidgin_latex_write(PurpleConversation *conv, 
         const char *nom, const char *message, 
         PurpleMessageFlags messFlag, const char *original);
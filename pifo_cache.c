@@ -0,0 +1,188 @@
+#include "pifo_cache.h"
+#include "pifo_generator.h"
+#include "pifo_util.h"
+#include "pifo.h"
+
+#include <string.h>
+
+struct cache_entry {
+    gchar *key;
+    GString *png;
+    gint64 cost_us;
+
+    /* GreedyDual-Size priority, the entry with the
+     * lowest one is the next to be evicted */
+    gdouble priority;
+    GSequenceIter *position;
+};
+
+static GHashTable *entries = NULL;
+static GSequence *by_priority = NULL;
+static gsize used_bytes = 0;
+static gsize limit_bytes = 0;
+
+/* Priority of the last evicted entry. It ages all other entries,
+ * so expensive images do not stay around forever once unused */
+static gdouble inflation = 0;
+
+G_LOCK_DEFINE_STATIC(cache);
+
+static gint compare_priority(gconstpointer a, gconstpointer b,
+        gpointer data){
+    const struct cache_entry *x = a, *y = b;
+
+    if (x->priority < y->priority)
+        return -1;
+    if (x->priority > y->priority)
+        return 1;
+    return 0;
+}
+
+static void free_entry(gpointer data){
+    struct cache_entry *entry = data;
+
+    g_free(entry->key);
+    g_string_free(entry->png, TRUE);
+    g_free(entry);
+}
+
+/* Cheap formulas are dropped long before a picture that took
+ * seconds to render, even if it is a lot larger */
+static void touch_entry(struct cache_entry *entry){
+    entry->priority = inflation
+        + (gdouble) MAX(entry->cost_us, 1) / MAX(entry->png->len, 1);
+
+    if (entry->position != NULL)
+        g_sequence_remove(entry->position);
+    entry->position = g_sequence_insert_sorted(by_priority, entry,
+            compare_priority, NULL);
+}
+
+static void evict(gsize needed){
+    GSequenceIter *first;
+    struct cache_entry *entry;
+
+    while (used_bytes + needed > limit_bytes
+            && g_sequence_get_length(by_priority) > 0){
+        first = g_sequence_get_begin_iter(by_priority);
+        entry = g_sequence_get(first);
+
+        inflation = entry->priority;
+        used_bytes -= entry->png->len;
+
+        g_sequence_remove(first);
+        entry->position = NULL;
+
+        pifo_debug_info("PiFo",
+                "Evicting [%s] from render cache\n", entry->key);
+        g_hash_table_remove(entries, entry->key);
+    }
+}
+
+void pifo_cache_init(gsize max_bytes){
+    G_LOCK(cache);
+    entries = g_hash_table_new_full(g_str_hash, g_str_equal,
+            NULL, free_entry);
+    by_priority = g_sequence_new(NULL);
+    used_bytes = 0;
+    limit_bytes = max_bytes;
+    inflation = 0;
+    G_UNLOCK(cache);
+}
+
+void pifo_cache_shutdown(void){
+    G_LOCK(cache);
+    if (by_priority != NULL){
+        g_sequence_free(by_priority);
+        by_priority = NULL;
+    }
+    if (entries != NULL){
+        g_hash_table_destroy(entries);
+        entries = NULL;
+    }
+    used_bytes = 0;
+    G_UNLOCK(cache);
+}
+
+void pifo_cache_set_limit(gsize max_bytes){
+    G_LOCK(cache);
+    limit_bytes = max_bytes;
+    if (entries != NULL)
+        evict(0);
+    G_UNLOCK(cache);
+}
+
+/* Hashes everything that ends up in the rendered image of backend */
+gchar *pifo_cache_key(const GString *command, const GString *snippet,
+        const struct mapping *backend){
+    GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA1);
+    const char *template = backend->template;
+    GString *fgcolor, *bgcolor;
+    gchar *key;
+
+    /* The terminating zeros keep the fields apart */
+    g_checksum_update(checksum, (const guchar *) command->str,
+            command->len + 1);
+    g_checksum_update(checksum, (const guchar *) snippet->str,
+            snippet->len + 1);
+    g_checksum_update(checksum, (const guchar *) (template ? template : ""),
+            (template ? strlen(template) : 0) + 1);
+
+    /* Other backends look the same in every theme */
+    if (backend->flags & PIFO_BACKEND_COLORED){
+        fgcolor = fgcolor_as_string();
+        bgcolor = bgcolor_as_string();
+        g_checksum_update(checksum, (const guchar *) fgcolor->str,
+                fgcolor->len + 1);
+        g_checksum_update(checksum, (const guchar *) bgcolor->str,
+                bgcolor->len + 1);
+        g_string_free(fgcolor, TRUE);
+        g_string_free(bgcolor, TRUE);
+    }
+
+    key = g_strdup(g_checksum_get_string(checksum));
+
+    g_checksum_free(checksum);
+
+    return key;
+}
+
+/* Returns a copy of the cached png or NULL */
+GString *pifo_cache_lookup(const char *key){
+    struct cache_entry *entry;
+    GString *result = NULL;
+
+    G_LOCK(cache);
+    if (entries != NULL
+            && (entry = g_hash_table_lookup(entries, key)) != NULL){
+        touch_entry(entry);
+        result = g_string_new_len(entry->png->str, entry->png->len);
+    }
+    G_UNLOCK(cache);
+
+    return result;
+}
+
+void pifo_cache_insert(const char *key, const GString *png,
+        gint64 cost_us){
+    struct cache_entry *entry;
+
+    G_LOCK(cache);
+    if (entries == NULL || png->len > limit_bytes
+            || g_hash_table_lookup(entries, key) != NULL){
+        G_UNLOCK(cache);
+        return;
+    }
+
+    evict(png->len);
+
+    entry = g_new0(struct cache_entry, 1);
+    entry->key = g_strdup(key);
+    entry->png = g_string_new_len(png->str, png->len);
+    entry->cost_us = cost_us;
+
+    touch_entry(entry);
+    g_hash_table_insert(entries, entry->key, entry);
+    used_bytes += png->len;
+    G_UNLOCK(cache);
+}
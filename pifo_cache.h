@@ -0,0 +1,22 @@
+#ifndef PIFO_CACHE
+#define PIFO_CACHE
+
+#include "pifo.h"
+
+/* In-memory cache of rendered images. Entries are keyed by a hash
+ * over everything that influences the image and are evicted by
+ * size and by how long they took to render (GreedyDual-Size) */
+
+void pifo_cache_init(gsize max_bytes);
+void pifo_cache_shutdown(void);
+void pifo_cache_set_limit(gsize max_bytes);
+
+struct mapping;
+
+gchar *pifo_cache_key(const GString *command, const GString *snippet,
+        const struct mapping *backend);
+GString *pifo_cache_lookup(const char *key);
+void pifo_cache_insert(const char *key, const GString *png,
+        gint64 cost_us);
+
+#endif
@@ -0,0 +1,502 @@
+#include "pifo_diskcache.h"
+#include "pifo_generator.h"
+#include "pifo_image.h"
+#include "pifo_util.h"
+#include "pifo.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define INDEX_MAGIC 0x4f464950
+#define INDEX_VERSION 1
+#define INDEX_SLOTS 8192
+#define KEY_SIZE 20
+
+/* Compaction kicks in above the limits and
+ * stops once this share of them is left */
+#define LOW_WATER 0.8
+#define MAX_LOAD 0.7
+
+enum slot_state {
+    SLOT_EMPTY, SLOT_USED, SLOT_DELETED
+};
+
+/* On-disk layout of the index file: one header, followed
+ * by INDEX_SLOTS slots of an open addressing hash table */
+struct index_slot {
+    guint8 key[KEY_SIZE];
+    guint32 state;
+    guint32 size;
+    guint32 cost_ms;
+    guint32 reserved;
+    guint64 last_used;
+};
+
+struct index_header {
+    guint32 magic;
+    guint32 version;
+    guint32 slots;
+    guint32 entries;
+    guint32 deleted;
+    guint32 reserved;
+    guint64 used_bytes;
+    guint64 clock;
+    guint8 fingerprint[KEY_SIZE];
+    guint8 padding[12];
+};
+
+/* Everything whose version changes the rendered images */
+static gchar *latex_version[] = { "latex", "--version", NULL };
+static gchar *pdflatex_version[] = { "pdflatex", "--version", NULL };
+static gchar *dvipng_version[] = { "dvipng", "--version", NULL };
+static gchar *dot_version[] = { "dot", "-V", NULL };
+static gchar *pandoc_version[] = { "pandoc", "--version", NULL };
+static gchar *convert_version[] = { "convert", "--version", NULL };
+static gchar *pdftops_version[] = { "pdftops", "-v", NULL };
+
+static gchar **toolchain[] = {
+    latex_version, pdflatex_version, dvipng_version, dot_version,
+    pandoc_version, convert_version, pdftops_version
+};
+
+static const char *templates[] = {
+    LATEX_MATH_TEMPLATE, LATEX_LST_TEMPLATE, LATEX_TIKZ_TEMPLATE
+};
+
+static gchar *cache_dir = NULL;
+static struct index_header *header = NULL;
+static struct index_slot *slots = NULL;
+static gsize mapped_size = 0;
+static gsize limit_bytes = 0;
+static gboolean ready = FALSE;
+static gboolean compacting = FALSE;
+static GThread *opener = NULL;
+static GThread *compactor = NULL;
+G_LOCK_DEFINE_STATIC(diskcache);
+
+static void disk_key(const char *key, guint8 *digest){
+    GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA1);
+    gsize length = KEY_SIZE;
+
+    g_checksum_update(checksum, header->fingerprint, KEY_SIZE);
+    g_checksum_update(checksum, (const guchar *) key, strlen(key));
+    g_checksum_get_digest(checksum, digest, &length);
+
+    g_checksum_free(checksum);
+}
+
+static gchar *image_path(const guint8 *key){
+    char name[KEY_SIZE * 2 + sizeof(".png")];
+    int i;
+
+    for (i=0; i<KEY_SIZE; i++){
+        sprintf(name + 2 * i, "%02x", key[i]);
+    }
+    strcpy(name + 2 * KEY_SIZE, ".png");
+
+    return g_build_filename(cache_dir, name, NULL);
+}
+
+/* Returns the slot holding key. If for_insert is set and key is
+ * not present, the slot key should be stored in is returned */
+static struct index_slot *find_slot(const guint8 *key,
+        gboolean for_insert){
+    struct index_slot *slot, *reusable = NULL;
+    guint32 start, i;
+
+    memcpy(&start, key, sizeof(start));
+
+    for (i=0; i<header->slots; i++){
+        slot = &slots[(start + i) & (header->slots - 1)];
+
+        if (slot->state == SLOT_EMPTY){
+            if (!for_insert)
+                return NULL;
+            return reusable ? reusable : slot;
+        }
+
+        if (slot->state == SLOT_DELETED){
+            if (reusable == NULL)
+                reusable = slot;
+            continue;
+        }
+
+        if (!memcmp(slot->key, key, KEY_SIZE))
+            return slot;
+    }
+
+    return for_insert ? reusable : NULL;
+}
+
+static void remove_slot(struct index_slot *slot){
+    header->used_bytes -= slot->size;
+    header->entries--;
+    header->deleted++;
+    slot->state = SLOT_DELETED;
+}
+
+static void fingerprint_toolchain(guint8 *digest){
+    GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA1);
+    gsize length = KEY_SIZE;
+    gchar *version;
+    int i;
+
+    for (i=0; i<G_N_ELEMENTS(toolchain); i++){
+        /* Tools that are not installed hash as empty output */
+        version = tool_version(toolchain[i]);
+
+        g_checksum_update(checksum, (const guchar *) toolchain[i][0], -1);
+        g_checksum_update(checksum, (const guchar *) version, -1);
+
+        g_free(version);
+    }
+
+    for (i=0; i<G_N_ELEMENTS(templates); i++){
+        g_checksum_update(checksum, (const guchar *) templates[i], -1);
+    }
+
+    /* So are the in-process renderers and what the images go
+     * through after any of them */
+    version = renderer_versions();
+    g_checksum_update(checksum, (const guchar *) version, -1);
+    g_free(version);
+
+    version = pifo_image_version();
+    g_checksum_update(checksum, (const guchar *) version, -1);
+    g_free(version);
+
+    g_checksum_get_digest(checksum, digest, &length);
+    g_checksum_free(checksum);
+}
+
+static void remove_images(void){
+    GDir *dir;
+    const gchar *name;
+    gchar *path;
+
+    if ((dir = g_dir_open(cache_dir, 0, NULL)) == NULL)
+        return;
+
+    while ((name = g_dir_read_name(dir)) != NULL){
+        if (!g_str_has_suffix(name, ".png"))
+            continue;
+
+        path = g_build_filename(cache_dir, name, NULL);
+        unlink(path);
+        g_free(path);
+    }
+
+    g_dir_close(dir);
+}
+
+static gboolean map_index(const guint8 *fingerprint){
+    struct stat info;
+    gchar *path;
+    void *map;
+    int fd;
+
+    mapped_size = sizeof(struct index_header)
+        + INDEX_SLOTS * sizeof(struct index_slot);
+
+    path = g_build_filename(cache_dir, "index", NULL);
+    fd = open(path, O_RDWR | O_CREAT, 0600);
+    g_free(path);
+
+    if (fd == -1){
+        pifo_debug_error("PiFo",
+                "Could not open disk cache index: [%s]\n",
+                strerror(errno));
+        return FALSE;
+    }
+
+    if (fstat(fd, &info) == -1 || info.st_size != mapped_size){
+        if (ftruncate(fd, 0) == -1 || ftruncate(fd, mapped_size) == -1){
+            close(fd);
+            return FALSE;
+        }
+    }
+
+    map = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED){
+        pifo_debug_error("PiFo",
+                "Could not map disk cache index: [%s]\n",
+                strerror(errno));
+        return FALSE;
+    }
+
+    header = map;
+    slots = (struct index_slot *) (header + 1);
+
+    if (header->magic != INDEX_MAGIC
+            || header->version != INDEX_VERSION
+            || header->slots != INDEX_SLOTS
+            || memcmp(header->fingerprint, fingerprint, KEY_SIZE)){
+        pifo_debug_info("PiFo",
+                "Toolchain changed, dropping disk cache\n");
+
+        remove_images();
+
+        memset(map, 0, mapped_size);
+        header->magic = INDEX_MAGIC;
+        header->version = INDEX_VERSION;
+        header->slots = INDEX_SLOTS;
+        memcpy(header->fingerprint, fingerprint, KEY_SIZE);
+    }
+
+    return TRUE;
+}
+
+/* The fingerprint needs all tools to be run once,
+ * so the index is opened off the main thread */
+static gpointer open_index(gpointer data){
+    guint8 fingerprint[KEY_SIZE];
+
+    fingerprint_toolchain(fingerprint);
+
+    G_LOCK(diskcache);
+    ready = map_index(fingerprint);
+    G_UNLOCK(diskcache);
+
+    return NULL;
+}
+
+static int compare_last_used(const void *a, const void *b){
+    const struct index_slot *x = a, *y = b;
+
+    if (x->last_used < y->last_used)
+        return -1;
+    return x->last_used > y->last_used;
+}
+
+/* Drops the least recently used images until the cache is below
+ * its low water marks and rebuilds the table without tombstones */
+static gpointer compact(gpointer data){
+    GPtrArray *victims = g_ptr_array_new();
+    struct index_slot *used, *slot;
+    guint32 count = 0, i;
+    guint64 target = limit_bytes * LOW_WATER;
+    guint32 max_entries = INDEX_SLOTS * MAX_LOAD * LOW_WATER;
+
+    G_LOCK(diskcache);
+    if (!ready){
+        compacting = FALSE;
+        G_UNLOCK(diskcache);
+        g_ptr_array_free(victims, TRUE);
+        return NULL;
+    }
+
+    used = g_new(struct index_slot, header->entries + 1);
+    for (i=0; i<header->slots; i++){
+        if (slots[i].state == SLOT_USED)
+            used[count++] = slots[i];
+    }
+    qsort(used, count, sizeof(struct index_slot), compare_last_used);
+
+    for (i=0; i<count && (header->used_bytes > target
+                || count - i > max_entries); i++){
+        g_ptr_array_add(victims, image_path(used[i].key));
+        header->used_bytes -= used[i].size;
+    }
+
+    memset(slots, 0, header->slots * sizeof(struct index_slot));
+    header->entries = 0;
+    header->deleted = 0;
+
+    for (; i<count; i++){
+        slot = find_slot(used[i].key, TRUE);
+        *slot = used[i];
+        header->entries++;
+    }
+
+    pifo_debug_info("PiFo",
+            "Disk cache compacted: %u images dropped, %u kept\n",
+            victims->len, header->entries);
+    G_UNLOCK(diskcache);
+
+    g_free(used);
+
+    for (i=0; i<victims->len; i++){
+        unlink(g_ptr_array_index(victims, i));
+        g_free(g_ptr_array_index(victims, i));
+    }
+    g_ptr_array_free(victims, TRUE);
+
+    G_LOCK(diskcache);
+    compacting = FALSE;
+    G_UNLOCK(diskcache);
+
+    return NULL;
+}
+
+/* Has to be called with the lock held */
+static void compact_if_needed(void){
+    if (compacting)
+        return;
+
+    if (header->used_bytes <= limit_bytes
+            && header->entries + header->deleted <= INDEX_SLOTS * MAX_LOAD)
+        return;
+
+    /* The previous compaction is done, it does not
+     * take the lock anymore once compacting is unset */
+    if (compactor != NULL)
+        g_thread_join(compactor);
+
+    compacting = TRUE;
+    compactor = g_thread_new("pifo-compact", compact, NULL);
+}
+
+void pifo_diskcache_init(const char *directory, gsize max_bytes){
+    cache_dir = g_strdup(directory);
+    limit_bytes = max_bytes;
+
+    if (g_mkdir_with_parents(cache_dir, 0700) == -1){
+        purple_debug_error("PiFo",
+                "Could not create disk cache [%s]: [%s]\n",
+                cache_dir, strerror(errno));
+        return;
+    }
+
+    opener = g_thread_new("pifo-diskcache", open_index, NULL);
+}
+
+void pifo_diskcache_shutdown(void){
+    GThread *running;
+
+    if (opener != NULL){
+        g_thread_join(opener);
+        opener = NULL;
+    }
+
+    G_LOCK(diskcache);
+    ready = FALSE;
+    running = compactor;
+    compactor = NULL;
+    G_UNLOCK(diskcache);
+
+    if (running != NULL)
+        g_thread_join(running);
+
+    if (header != NULL){
+        msync(header, mapped_size, MS_ASYNC);
+        munmap(header, mapped_size);
+        header = NULL;
+        slots = NULL;
+    }
+
+    g_free(cache_dir);
+    cache_dir = NULL;
+}
+
+void pifo_diskcache_set_limit(gsize max_bytes){
+    G_LOCK(diskcache);
+    limit_bytes = max_bytes;
+    if (ready)
+        compact_if_needed();
+    G_UNLOCK(diskcache);
+}
+
+/* Returns the cached png or NULL. cost_us is set to the time
+ * it took to render the image in the first place */
+GString *pifo_diskcache_lookup(const char *key, gint64 *cost_us){
+    struct index_slot *slot;
+    guint8 digest[KEY_SIZE];
+    GString *result = NULL;
+    gchar *path, *data;
+    gsize size;
+
+    G_LOCK(diskcache);
+    if (!ready){
+        G_UNLOCK(diskcache);
+        return NULL;
+    }
+
+    disk_key(key, digest);
+    if ((slot = find_slot(digest, FALSE)) == NULL){
+        G_UNLOCK(diskcache);
+        return NULL;
+    }
+
+    slot->last_used = ++header->clock;
+    if (cost_us)
+        *cost_us = (gint64) slot->cost_ms * 1000;
+    path = image_path(digest);
+    G_UNLOCK(diskcache);
+
+    if (g_file_get_contents(path, &data, &size, NULL)){
+        result = g_string_new_len(data, size);
+        g_free(data);
+    } else {
+        /* Somebody cleaned up behind our back */
+        G_LOCK(diskcache);
+        if (ready && (slot = find_slot(digest, FALSE)) != NULL)
+            remove_slot(slot);
+        G_UNLOCK(diskcache);
+    }
+
+    g_free(path);
+
+    return result;
+}
+
+void pifo_diskcache_insert(const char *key, const GString *png,
+        gint64 cost_us){
+    struct index_slot *slot;
+    guint8 digest[KEY_SIZE];
+    GError *error = NULL;
+    gchar *path;
+
+    G_LOCK(diskcache);
+    if (!ready || png->len > limit_bytes){
+        G_UNLOCK(diskcache);
+        return;
+    }
+
+    disk_key(key, digest);
+    slot = find_slot(digest, TRUE);
+    if (slot == NULL || slot->state == SLOT_USED){
+        G_UNLOCK(diskcache);
+        return;
+    }
+    path = image_path(digest);
+    G_UNLOCK(diskcache);
+
+    /* Written to a temporary file and renamed, so a
+     * crash never leaves half an image behind */
+    if (!g_file_set_contents(path, png->str, png->len, &error)){
+        pifo_debug_error("PiFo",
+                "Could not write [%s] to disk cache: [%s]\n",
+                path, error->message);
+        g_error_free(error);
+        g_free(path);
+        return;
+    }
+    g_free(path);
+
+    G_LOCK(diskcache);
+    if (ready && (slot = find_slot(digest, TRUE)) != NULL
+            && slot->state != SLOT_USED){
+        if (slot->state == SLOT_DELETED)
+            header->deleted--;
+
+        memcpy(slot->key, digest, KEY_SIZE);
+        slot->state = SLOT_USED;
+        slot->size = png->len;
+        slot->cost_ms = MIN(cost_us / 1000, G_MAXINT);
+        slot->last_used = ++header->clock;
+
+        header->entries++;
+        header->used_bytes += png->len;
+
+        compact_if_needed();
+    }
+    G_UNLOCK(diskcache);
+}
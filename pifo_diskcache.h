@@ -0,0 +1,20 @@
+#ifndef PIFO_DISKCACHE
+#define PIFO_DISKCACHE
+
+#include "pifo.h"
+
+/* Persistent cache of rendered images below the purple user dir.
+ * The images are plain files, their index is a memory-mapped open
+ * addressing hash table, so a lookup never scans the directory.
+ * Everything is invalidated once the toolchain fingerprint
+ * (versions of the external tools, templates) changes. */
+
+void pifo_diskcache_init(const char *directory, gsize max_bytes);
+void pifo_diskcache_shutdown(void);
+void pifo_diskcache_set_limit(gsize max_bytes);
+
+GString *pifo_diskcache_lookup(const char *key, gint64 *cost_us);
+void pifo_diskcache_insert(const char *key, const GString *png,
+        gint64 cost_us);
+
+#endif
@@ -0,0 +1,267 @@
+#include "pifo_format.h"
+#include "pifo_util.h"
+#include "pifo.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+
+static gchar *format_dir = NULL;
+
+/* Formats whose preamble could not be dumped. Those templates
+ * are compiled the slow way, instead of failing again and again */
+static GHashTable *failed = NULL;
+/* Formats some thread is dumping right now. The lock is not held
+ * while the engine runs, threads that want the same format wait
+ * on dumped instead, all others go on */
+static GHashTable *dumping = NULL;
+static GCond dumped;
+/* Engine -> its --version output. A format only loads into the
+ * engine that dumped it, so the version goes into its name */
+static GHashTable *versions = NULL;
+G_LOCK_DEFINE_STATIC(formats);
+
+/* Removes the formats of older preambles of the same template */
+static void remove_stale_formats(const char *dir_path, const char *name,
+        const char *keep){
+    GDir *dir;
+    const gchar *entry;
+    gchar *prefix, *path;
+
+    if ((dir = g_dir_open(dir_path, 0, NULL)) == NULL)
+        return;
+
+    prefix = g_strdup_printf("%s-", name);
+
+    while ((entry = g_dir_read_name(dir)) != NULL){
+        if (!g_str_has_prefix(entry, prefix)
+                || !g_str_has_suffix(entry, ".fmt")
+                || !strncmp(entry, keep, strlen(keep)))
+            continue;
+
+        path = g_build_filename(dir_path, entry, NULL);
+        unlink(path);
+        g_free(path);
+    }
+
+    g_free(prefix);
+    g_dir_close(dir);
+}
+
+/* Runs the engine in ini mode on top of its own format. The
+ * preamble is followed by \dump, which writes jobname.fmt into dir */
+static gboolean dump_format(const char *dir, const char *jobname,
+        const char *engine, const char *preamble){
+    GError *error = NULL;
+    gboolean returnval = FALSE;
+    gchar *content = g_strconcat(preamble, "\n\\dump\n", NULL);
+    gchar *tmpjob = g_strdup_printf("%s.tmp", jobname);
+    gchar *texpath = g_strdup_printf("%s/%s.tex", dir, tmpjob);
+    gchar *tmpfmt = g_strdup_printf("%s/%s.fmt", dir, tmpjob);
+    gchar *tmplog = g_strdup_printf("%s/%s.log", dir, tmpjob);
+    gchar *fmtpath = g_strdup_printf("%s/%s.fmt", dir, jobname);
+    gchar *outdir = g_strdup_printf("-output-directory=%s", dir);
+    gchar *jobopt = g_strdup_printf("-jobname=%s", tmpjob);
+    gchar *parent = g_strdup_printf("&%s", engine);
+
+    char * const iniopts[] = {
+        (char *) engine, "-ini",
+        "--no-shell-escape",
+        "--interaction=nonstopmode",
+        outdir, jobopt, parent, texpath, NULL
+    };
+
+    if (!g_file_set_contents(texpath, content, -1, &error)){
+        pifo_debug_error("PiFo",
+                "Could not write preamble of [%s]: [%s]\n",
+                jobname, error->message);
+        g_error_free(error);
+        goto out;
+    }
+
+    if (execute(dir, engine, iniopts) != 0){
+        pifo_debug_error("PiFo",
+                "Could not dump format [%s]\n", jobname);
+        goto out;
+    }
+
+    /* Renamed into place, so nobody ever picks up half a format */
+    if (rename(tmpfmt, fmtpath) == -1){
+        pifo_debug_error("PiFo",
+                "Could not store format [%s]: [%s]\n",
+                jobname, strerror(errno));
+        goto out;
+    }
+
+    returnval = TRUE;
+
+out:
+    unlink(texpath);
+    unlink(tmpfmt);
+    unlink(tmplog);
+
+    g_free(content);
+    g_free(tmpjob);
+    g_free(texpath);
+    g_free(tmpfmt);
+    g_free(tmplog);
+    g_free(fmtpath);
+    g_free(outdir);
+    g_free(jobopt);
+    g_free(parent);
+
+    return returnval;
+}
+
+void pifo_format_init(const char *directory){
+    G_LOCK(formats);
+    format_dir = g_strdup(directory);
+    failed = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    dumping = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    versions = g_hash_table_new_full(g_str_hash, g_str_equal,
+            g_free, g_free);
+
+    if (g_mkdir_with_parents(format_dir, 0700) == -1){
+        purple_debug_error("PiFo",
+                "Could not create format directory [%s]: [%s]\n",
+                format_dir, strerror(errno));
+        g_free(format_dir);
+        format_dir = NULL;
+    }
+    G_UNLOCK(formats);
+}
+
+void pifo_format_shutdown(void){
+    G_LOCK(formats);
+    g_free(format_dir);
+    format_dir = NULL;
+    if (failed != NULL){
+        g_hash_table_destroy(failed);
+        failed = NULL;
+    }
+    if (dumping != NULL){
+        g_hash_table_destroy(dumping);
+        dumping = NULL;
+    }
+    if (versions != NULL){
+        g_hash_table_destroy(versions);
+        versions = NULL;
+    }
+    G_UNLOCK(formats);
+}
+
+/* Asks the engine for its version once, without holding the lock */
+static gchar *engine_version(const char *engine){
+    gchar *version;
+
+    G_LOCK(formats);
+    version = versions ? g_strdup(g_hash_table_lookup(versions, engine))
+        : NULL;
+    G_UNLOCK(formats);
+
+    if (version != NULL)
+        return version;
+
+    char * const cmd[] = { (char *) engine, "--version", NULL };
+    version = tool_version(cmd);
+
+    G_LOCK(formats);
+    if (versions != NULL && !g_hash_table_lookup(versions, engine))
+        g_hash_table_insert(versions, g_strdup(engine), g_strdup(version));
+    G_UNLOCK(formats);
+
+    return version;
+}
+
+/* Returns the path of the format (without its suffix, as the -fmt
+ * option wants it) holding preamble, dumping it first if needed.
+ * Returns NULL if there is no such format and none can be made,
+ * in which case the full template has to be compiled. */
+gchar *pifo_format_lookup(const char *name, const char *engine,
+        const char *preamble){
+    GChecksum *checksum;
+    gchar *jobname, *dir, *base, *fmtpath;
+    gchar *version = engine_version(engine);
+    gchar *result = NULL;
+
+    checksum = g_checksum_new(G_CHECKSUM_SHA1);
+    g_checksum_update(checksum, (const guchar *) engine, strlen(engine) + 1);
+    g_checksum_update(checksum, (const guchar *) version, strlen(version) + 1);
+    g_checksum_update(checksum, (const guchar *) preamble, -1);
+    jobname = g_strdup_printf("%s-%.16s", name,
+            g_checksum_get_string(checksum));
+    g_checksum_free(checksum);
+    g_free(version);
+
+    G_LOCK(formats);
+    while (format_dir != NULL && g_hash_table_lookup(dumping, jobname))
+        g_cond_wait(&dumped, &G_LOCK_NAME(formats));
+
+    if (format_dir == NULL || g_hash_table_lookup(failed, jobname)){
+        G_UNLOCK(formats);
+        g_free(jobname);
+        return NULL;
+    }
+
+    base = g_build_filename(format_dir, jobname, NULL);
+    fmtpath = g_strdup_printf("%s.fmt", base);
+
+    if (g_file_test(fmtpath, G_FILE_TEST_EXISTS)){
+        G_UNLOCK(formats);
+        g_free(fmtpath);
+        g_free(jobname);
+        return base;
+    }
+
+    g_hash_table_insert(dumping, g_strdup(jobname), GINT_TO_POINTER(TRUE));
+    dir = g_strdup(format_dir);
+    G_UNLOCK(formats);
+
+    pifo_debug_info("PiFo",
+            "Dumping format [%s]\n", jobname);
+
+    if (dump_format(dir, jobname, engine, preamble)){
+        remove_stale_formats(dir, name, jobname);
+        result = base;
+    } else {
+        g_free(base);
+    }
+
+    G_LOCK(formats);
+    if (dumping != NULL){
+        g_hash_table_remove(dumping, jobname);
+        if (result == NULL)
+            g_hash_table_insert(failed, g_strdup(jobname),
+                    GINT_TO_POINTER(TRUE));
+    }
+    g_cond_broadcast(&dumped);
+    G_UNLOCK(formats);
+
+    g_free(dir);
+    g_free(fmtpath);
+    g_free(jobname);
+
+    return result;
+}
+
+/* Throws away a format the engine could not load, e.g. because TeX
+ * was updated behind our back. Its template is compiled the slow way
+ * from now on, the next session dumps it again */
+void pifo_format_reject(const char *format){
+    gchar *fmtpath = g_strdup_printf("%s.fmt", format);
+    gchar *jobname = g_path_get_basename(format);
+
+    pifo_debug_error("PiFo",
+            "Format [%s] could not be loaded, removing it\n", jobname);
+
+    G_LOCK(formats);
+    unlink(fmtpath);
+    if (failed != NULL)
+        g_hash_table_replace(failed, jobname, GINT_TO_POINTER(TRUE));
+    else
+        g_free(jobname);
+    G_UNLOCK(formats);
+
+    g_free(fmtpath);
+}
@@ -0,0 +1,20 @@
+#ifndef PIFO_FORMAT
+#define PIFO_FORMAT
+
+#include "pifo.h"
+
+/* Precompiled TeX formats. The preamble of a template is dumped
+ * into a .fmt file once, so every later render only has to
+ * compile the document body. Formats are named after a hash of
+ * their preamble and the engine version, and get rebuilt whenever
+ * either changes, e.g. because the conversation colors were
+ * changed or TeX was updated. */
+
+void pifo_format_init(const char *directory);
+void pifo_format_shutdown(void);
+
+gchar *pifo_format_lookup(const char *name, const char *engine,
+        const char *preamble);
+void pifo_format_reject(const char *format);
+
+#endif
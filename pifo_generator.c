@@ -1,272 +1,1245 @@
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "pifo_generator.h"
+#include "pifo_cache.h"
+#include "pifo_diskcache.h"
+#include "pifo_format.h"
+#include "pifo_worker.h"
+#include "pifo_spawn.h"
+#include "pifo_workspace.h"
+#include "pifo_image.h"
+#include "pifo_stats.h"
+#include "pifo_trace.h"
 #include "pifo_util.h"
 #include "pifo.h"
 
+#ifdef HAVE_LIBGVC
+#include <gvc.h>
+#endif
+
+#ifdef HAVE_LIBRSVG
+#include <librsvg/rsvg.h>
+#endif
+
+#ifdef HAVE_POPPLER
+#include <poppler.h>
+#endif
+
+#if defined(HAVE_LIBRSVG) || defined(HAVE_POPPLER)
+#include <cairo.h>
+#endif
+
 #define DEBUG
 #define FOO "fnord";
 
 
 extern PurplePlugin *me;
 
-/* commandstring -> function mapping */
+/* Most backends only differ in what they may be asked to do */
+#define BACKEND_DEFAULT (PIFO_BACKEND_CACHEABLE | PIFO_BACKEND_THREADSAFE)
+#define BACKEND_LATEX (BACKEND_DEFAULT | PIFO_BACKEND_BATCHABLE \
+        | PIFO_BACKEND_COLORED)
+
+/* commandstring -> function mapping, the built-in backends */
 static const struct mapping commandmap[] = {
     /* source highlighting commands */
-    {"ada", (gboolean (*)(const GString *c, const GString *s, void **r))
-     generate_latex_listing},
-    {"haskell", (gboolean (*)(const GString *c, const GString *s, void **r))
-     generate_latex_listing},
-    {"bash", (gboolean (*)(const GString *c, const GString *s, void **r))
-     generate_latex_listing},
-    {"awk", (gboolean (*)(const GString *c, const GString *s, void **r))
-     generate_latex_listing},
-    {"c", (gboolean (*)(const GString *c, const GString *s, void **r))
-     generate_latex_listing},
-    {"cpluscplus", (gboolean (*)(const GString *c, const GString *s, void **r))
-     generate_latex_listing},
-    {"html", (gboolean (*)(const GString *c, const GString *s, void **r))
-     generate_latex_listing},
-    {"lua", (gboolean (*)(const GString *c, const GString *s, void **r))
-     generate_latex_listing},
-    {"make", (gboolean (*)(const GString *c, const GString *s, void **r))
-     generate_latex_listing},
-    {"octave", (gboolean (*)(const GString *c, const GString *s, void **r))
-     generate_latex_listing},
-    {"perl", (gboolean (*)(const GString *c, const GString *s, void **r))
-     generate_latex_listing},
-    {"python", (gboolean (*)(const GString *c, const GString *s, void **r))
-     generate_latex_listing},
-    {"ruby", (gboolean (*)(const GString *c, const GString *s, void **r))
-     generate_latex_listing},
-    {"vhdl", (gboolean (*)(const GString *c, const GString *s, void **r))
-     generate_latex_listing},
-    {"verilo", (gboolean (*)(const GString *c, const GString *s, void **r))
-     generate_latex_listing},
-    {"xml", (gboolean (*)(const GString *c, const GString *s, void **r))
-     generate_latex_listing},
-    {"latex", (gboolean (*)(const GString *c, const GString *s, void **r))
-     generate_latex_listing},
+    {"ada", generate_latex_listing,
+     LATEX_LST_TEMPLATE, "listing",
+     BACKEND_LATEX, PIFO_COST_MODERATE},
+    {"haskell", generate_latex_listing,
+     LATEX_LST_TEMPLATE, "listing",
+     BACKEND_LATEX, PIFO_COST_MODERATE},
+    {"bash", generate_latex_listing,
+     LATEX_LST_TEMPLATE, "listing",
+     BACKEND_LATEX, PIFO_COST_MODERATE},
+    {"awk", generate_latex_listing,
+     LATEX_LST_TEMPLATE, "listing",
+     BACKEND_LATEX, PIFO_COST_MODERATE},
+    {"c", generate_latex_listing,
+     LATEX_LST_TEMPLATE, "listing",
+     BACKEND_LATEX, PIFO_COST_MODERATE},
+    {"cpluscplus", generate_latex_listing,
+     LATEX_LST_TEMPLATE, "listing",
+     BACKEND_LATEX, PIFO_COST_MODERATE},
+    {"html", generate_latex_listing,
+     LATEX_LST_TEMPLATE, "listing",
+     BACKEND_LATEX, PIFO_COST_MODERATE},
+    {"lua", generate_latex_listing,
+     LATEX_LST_TEMPLATE, "listing",
+     BACKEND_LATEX, PIFO_COST_MODERATE},
+    {"make", generate_latex_listing,
+     LATEX_LST_TEMPLATE, "listing",
+     BACKEND_LATEX, PIFO_COST_MODERATE},
+    {"octave", generate_latex_listing,
+     LATEX_LST_TEMPLATE, "listing",
+     BACKEND_LATEX, PIFO_COST_MODERATE},
+    {"perl", generate_latex_listing,
+     LATEX_LST_TEMPLATE, "listing",
+     BACKEND_LATEX, PIFO_COST_MODERATE},
+    {"python", generate_latex_listing,
+     LATEX_LST_TEMPLATE, "listing",
+     BACKEND_LATEX, PIFO_COST_MODERATE},
+    {"ruby", generate_latex_listing,
+     LATEX_LST_TEMPLATE, "listing",
+     BACKEND_LATEX, PIFO_COST_MODERATE},
+    {"vhdl", generate_latex_listing,
+     LATEX_LST_TEMPLATE, "listing",
+     BACKEND_LATEX, PIFO_COST_MODERATE},
+    {"verilo", generate_latex_listing,
+     LATEX_LST_TEMPLATE, "listing",
+     BACKEND_LATEX, PIFO_COST_MODERATE},
+    {"xml", generate_latex_listing,
+     LATEX_LST_TEMPLATE, "listing",
+     BACKEND_LATEX, PIFO_COST_MODERATE},
+    {"latex", generate_latex_listing,
+     LATEX_LST_TEMPLATE, "listing",
+     BACKEND_LATEX, PIFO_COST_MODERATE},
 
     /* graphviz command */
-    {"dot", (gboolean (*)(const GString *c, const GString *s, void **r))
-     generate_graphviz_png},
+    {"dot", generate_graphviz_png,
+     NULL, NULL,
+     BACKEND_DEFAULT, PIFO_COST_CHEAP,
+#ifdef HAVE_LIBGVC
+     render_graphviz_png
+#else
+     NULL
+#endif
+    },
 
     /* formula typesetting */
-    {"formula", (gboolean (*)(const GString *c, const GString *s, void **r))
-     generate_latex_formula},
+    {"formula", generate_latex_formula,
+     LATEX_MATH_TEMPLATE, "math",
+     BACKEND_LATEX, PIFO_COST_CHEAP},
 
     /* markdown support per pandoc */
-    {"markdown", (gboolean (*)(const GString *c, const GString *s, void **r))
-     generate_markdown},
+    {"markdown", generate_markdown,
+     NULL, NULL,
+     BACKEND_DEFAULT, PIFO_COST_EXPENSIVE},
+
+    {"tikz", generate_tikz_png,
+     LATEX_TIKZ_TEMPLATE, NULL,
+     BACKEND_DEFAULT, PIFO_COST_EXPENSIVE},
+
+    {"svg", generate_svg_png,
+     NULL, NULL,
+     BACKEND_DEFAULT, PIFO_COST_CHEAP,
+#ifdef HAVE_LIBRSVG
+     render_svg_png
+#else
+     NULL
+#endif
+    }
+};
+
+/* Command name -> struct mapping, for the built-in backends and
+ * whatever got registered at runtime */
+static GHashTable *backends = NULL;
+/* struct mapping -> how many renders are using it right now. A
+ * backend is only unregistered once nobody does, which is
+ * signalled on released */
+static GHashTable *busy = NULL;
+static GCond released;
+G_LOCK_DEFINE_STATIC(backends);
+/* The backend a render in this thread is using, and how often it
+ * acquired it, so unregistering it from there does not wait on
+ * the caller itself */
+static GPrivate held = G_PRIVATE_INIT(NULL);
+static GPrivate held_count = G_PRIVATE_INIT(NULL);
+
+/* Backends that are not thread safe take turns */
+G_LOCK_DEFINE_STATIC(serial_backends);
+
+
+#ifdef HAVE_LIBGVC
+/* Larger graphs are left to dot, which can be killed if
+ * laying them out takes too long */
+#define GRAPHVIZ_INPROCESS_MAX (16 * 1024)
+
+/* Graphviz is not thread safe, everything using it holds the lock.
+ * The context keeps the loaded plugins between renders */
+static GVC_t *gvc = NULL;
+G_LOCK_DEFINE_STATIC(graphviz);
+#endif
 
-    {"tikz", (gboolean (*)(const GString *c, const GString *s, void **r))
-     generate_tikz_png},
+#ifdef HAVE_LIBRSVG
+/* Same resolution convert -density 300 rendered at */
+#define SVG_DPI 300.0
+#define SVG_MAX_SIZE 4096
+#endif
+
+/* libpurple linkifies every URL in the message, including the
+ * namespaces in the svg code. This turns them back into text */
+#define SVG_LINK_PATTERN "\"<A HREF=\"[^\"]*\">(https?://[^<]*)</A>\""
+
+/* Cold engines are told to call their output like this, which is
+ * the base name setup_files() hands out */
+#define LATEX_JOBNAME "pifo"
+
+#ifdef HAVE_POPPLER
+/* Same resolution convert -density 300 rendered the eps at */
+#define PDF_DPI 300.0
+/* The page is searched for the picture at this resolution first */
+#define PDF_PREVIEW_DPI 72.0
+#endif
 
-    {"svg", (gboolean (*)(const GString *c, const GString *s, void **r))
-     generate_svg_png}
+/* TikZ libraries and what gives away that a picture uses them.
+ * Loading all of them takes longer than most pictures, so only
+ * the ones a picture seems to need are loaded. Most libraries
+ * bring keys and shapes, whose names would also match ordinary
+ * node text like "state of the art", so those are only looked
+ * for inside [options]. Commands and syntax are looked for in the
+ * whole picture. */
+struct tikz_library {
+    const char *name;
+    const char *code[4];
+    const char *options[4];
 };
 
+static const struct tikz_library tikz_libraries[] = {
+    {"calc", {"($", NULL}, {NULL}},
+    {"positioning", {NULL}, {"=of ", "= of ", NULL}},
+    {"intersections", {NULL}, {"name path", "name intersections", NULL}},
+    {"quotes", {NULL}, {"\"", NULL}},
+    {"angles", {"{angle", "{ angle", "{right angle", NULL}, {NULL}},
+    {"automata", {NULL}, {"state", "initial", "accepting", NULL}},
+    {"backgrounds", {NULL}, {"background", "framed", NULL}},
+    {"bending", {NULL}, {"flex", "bending", NULL}},
+    {"calendar", {"\\calendar", NULL}, {NULL}},
+    {"chains", {"\\chainin", NULL}, {"chain", NULL}},
+    {"circuits", {NULL}, {"circuit", NULL}},
+    {"curvilinear", {"\\pgfsetcurvilinear", NULL}, {NULL}},
+    {"datavisualization", {"\\datavisualization", NULL}, {NULL}},
+    {"decorations", {NULL}, {"decorat", NULL}},
+    {"er", {NULL}, {"entity", "relationship", "attribute", NULL}},
+    {"fadings", {"\\tikzfading", NULL}, {"fading", NULL}},
+    {"fit", {NULL}, {"fit=", "fit =", NULL}},
+    {"folding", {NULL}, {"folding", "dodecahedron", NULL}},
+    {"fpu", {NULL}, {"fpu", NULL}},
+    {"fixedpointarithmetic", {NULL}, {"fixed point", NULL}},
+    {"graphs", {"\\graph", NULL}, {NULL}},
+    {"lindenmayersystems", {"\\pgfdeclarelindenmayersystem", NULL},
+        {"l-system", NULL}},
+    {"math", {"\\tikzmath", NULL}, {NULL}},
+    {"matrix", {NULL}, {"matrix of", NULL}},
+    {"mindmap", {NULL}, {"mindmap", "concept", NULL}},
+    {"patterns", {NULL}, {"pattern", NULL}},
+    {"petri", {NULL}, {"place", "transition", "token", NULL}},
+    {"plotmarks", {NULL}, {"mark=", "mark =", NULL}},
+    {"scopes", {"{[", "{ [", NULL}, {NULL}},
+    {"shadings", {NULL}, {"shading", NULL}},
+    {"shadows", {NULL}, {"shadow", NULL}},
+    {"spy", {"\\spy", NULL}, {"spy", NULL}},
+    {"through", {NULL}, {"through", NULL}},
+    {"trees", {"edge from parent", NULL}, {"grow", "level distance", NULL}},
+    {"turtle", {NULL}, {"turtle", NULL}}
+};
 
-GString *fgcolor_as_string(void){
-    GString *result = g_string_new(NULL);
+/* Library sets that get a precompiled format of their own. A
+ * picture is compiled with the smallest one holding everything
+ * it needs; pictures that need more are compiled without one */
+static const char * const tikz_variants[] = {
+    "",
+    "calc,positioning",
+    "calc,positioning,fit,backgrounds",
+    "calc,intersections,angles,quotes",
+    "automata,positioning",
+    "trees,mindmap,shadows"
+};
+
+#define TIKZ_VARIANTS G_N_ELEMENTS(tikz_variants)
+
+static guint64 tikz_variant_masks[TIKZ_VARIANTS];
+
+/* The conversation colors are read from the prefs on the main
+ * thread and handed to the render threads as plain strings */
+static gchar *fgcolor = NULL;
+static gchar *bgcolor = NULL;
+G_LOCK_DEFINE_STATIC(colors);
+
+static gchar *color_from_pref(const char *pref, const char *fallback){
     int rgb;
-    char const *pidgin_fgcolor;
+    char const *pidgin_color = purple_prefs_get_string(pref);
+
+    if (pidgin_color == NULL || !strcmp(pidgin_color, "")) {
+        return g_strdup(fallback);
+    }
+
+    rgb = strtol(pidgin_color + 1, NULL, 16);
+    return g_strdup_printf("%d,%d,%d",
+                           rgb >> 16, (rgb >> 8) & 0xff, rgb & 0xff);
+}
+
+static void colors_changed(const char *name, PurplePrefType type,
+                           gconstpointer val, gpointer data){
     /* Gather some information about the current pidgin settings
      * so that we can populate the latex template file appropriately */
-    if (!strcmp(purple_prefs_get_string("/pidgin/conversations/fgcolor"), "")) {
-        g_string_append(result, "0,0,0");
-    } else {
-        pidgin_fgcolor = purple_prefs_get_string("/pidgin/conversations/fgcolor");
-        rgb = strtol(pidgin_fgcolor + 1, NULL, 16);
-        g_string_append_printf(result, "%d,%d,%d",
-                               rgb >> 16, (rgb >> 8) & 0xff, rgb & 0xff);
+    gchar *fg = color_from_pref("/pidgin/conversations/fgcolor", "0,0,0");
+    gchar *bg = color_from_pref("/pidgin/conversations/bgcolor",
+                                "255,255,255");
+
+    G_LOCK(colors);
+    g_free(fgcolor);
+    g_free(bgcolor);
+    fgcolor = fg;
+    bgcolor = bg;
+    G_UNLOCK(colors);
+}
+
+static guint64 tikz_library_mask(const char *names){
+    gchar **list = g_strsplit(names, ",", -1);
+    guint64 mask = 0;
+    int i, j;
+
+    for (i=0; list[i] != NULL; i++){
+        for (j=0; j<G_N_ELEMENTS(tikz_libraries); j++){
+            if (!strcmp(list[i], tikz_libraries[j].name))
+                mask |= G_GUINT64_CONSTANT(1) << j;
+        }
+    }
+
+    g_strfreev(list);
+
+    return mask;
+}
+
+void pifo_generator_init(void *handle){
+    int i;
+
+    colors_changed(NULL, 0, NULL, NULL);
+
+    for (i=0; i<TIKZ_VARIANTS; i++){
+        tikz_variant_masks[i] = tikz_library_mask(tikz_variants[i]);
     }
 
+    G_LOCK(backends);
+    backends = g_hash_table_new(g_str_hash, g_str_equal);
+    busy = g_hash_table_new(g_direct_hash, g_direct_equal);
+    G_UNLOCK(backends);
+
+    for (i=0; i<G_N_ELEMENTS(commandmap); i++){
+        pifo_generator_register(&commandmap[i]);
+    }
+
+    purple_prefs_connect_callback(handle,
+            "/pidgin/conversations/fgcolor", colors_changed, NULL);
+    purple_prefs_connect_callback(handle,
+            "/pidgin/conversations/bgcolor", colors_changed, NULL);
+}
+
+void pifo_generator_uninit(void *handle){
+    purple_prefs_disconnect_by_handle(handle);
+
+    G_LOCK(backends);
+    g_hash_table_destroy(backends);
+    g_hash_table_destroy(busy);
+    backends = NULL;
+    busy = NULL;
+    G_UNLOCK(backends);
+
+#ifdef HAVE_LIBGVC
+    G_LOCK(graphviz);
+    if (gvc != NULL){
+        gvFreeContext(gvc);
+        gvc = NULL;
+    }
+    G_UNLOCK(graphviz);
+#endif
+
+    G_LOCK(colors);
+    g_free(fgcolor);
+    g_free(bgcolor);
+    fgcolor = NULL;
+    bgcolor = NULL;
+    G_UNLOCK(colors);
+}
+
+GString *fgcolor_as_string(void){
+    GString *result;
+
+    G_LOCK(colors);
+    result = g_string_new(fgcolor ? fgcolor : "0,0,0");
+    G_UNLOCK(colors);
+
     return result;
 }
 
-GString *bgcolor_as_string(){
-    GString *result = g_string_new(NULL);
-    int rgb;
-    char const *pidgin_bgcolor;
+GString *bgcolor_as_string(void){
+    GString *result;
+
+    G_LOCK(colors);
+    result = g_string_new(bgcolor ? bgcolor : "255,255,255");
+    G_UNLOCK(colors);
+
+    return result;
+}
+
+/* The libraries the in-process renderers draw with, one per line.
+ * Their images change with them just like with the tools */
+gchar *renderer_versions(void){
+    GString *versions = g_string_new(NULL);
+
+#ifdef HAVE_LIBGVC
+    G_LOCK(graphviz);
+    if (gvc == NULL)
+        gvc = gvContext();
+    g_string_append_printf(versions, "gvc %s\n", gvcVersion(gvc));
+    G_UNLOCK(graphviz);
+#endif
+
+#ifdef HAVE_LIBRSVG
+    g_string_append_printf(versions, "librsvg %u.%u.%u\n",
+            rsvg_major_version, rsvg_minor_version, rsvg_micro_version);
+#endif
+
+#ifdef HAVE_POPPLER
+    g_string_append_printf(versions, "poppler %s\n",
+            poppler_get_version());
+#endif
+
+#if defined(HAVE_LIBRSVG) || defined(HAVE_POPPLER)
+    g_string_append_printf(versions, "cairo %s\n",
+            cairo_version_string());
+#endif
+
+    return g_string_free(versions, FALSE);
+}
+
+/* Makes backend available as \command{}. The struct, and whatever it
+ * points to, has to stay around until it is unregistered again, so
+ * other plugins can add backends of their own. Returns FALSE if the
+ * command is taken. */
+gboolean pifo_generator_register(const struct mapping *backend){
+    gboolean registered = FALSE;
+
+    if (backend->handler == NULL && backend->render == NULL)
+        return FALSE;
+
+    /* Batches are compiled with the templates of the built-in ones */
+    if ((backend->flags & PIFO_BACKEND_BATCHABLE)
+            && (backend->batch == NULL
+                || (strcmp(backend->batch, "math")
+                    && strcmp(backend->batch, "listing")))){
+        purple_debug_error("LaTeX",
+                           "Backend [%s] has no batch template\n",
+                           backend->command);
+        return FALSE;
+    }
+
+    G_LOCK(backends);
+    if (backends != NULL
+            && !g_hash_table_contains(backends, backend->command)){
+        g_hash_table_insert(backends, (gpointer) backend->command,
+                            (gpointer) backend);
+        registered = TRUE;
+    }
+    G_UNLOCK(backends);
+
+    if (!registered){
+        purple_debug_error("LaTeX",
+                           "Command [%s] is already taken\n",
+                           backend->command);
+    }
+
+    return registered;
+}
+
+/* No new jobs get the backend once this returns. Renders that are
+ * already using it are waited for, so the struct, and whatever it
+ * points to, may be freed afterwards. Must not be called from a
+ * render, which could end up waiting for itself. A render of the
+ * backend itself that does anyway only unregisters it and returns
+ * without waiting */
+void pifo_generator_unregister(const struct mapping *backend){
+    gboolean own = g_private_get(&held) == backend;
+
+    if (own){
+        purple_debug_error("LaTeX",
+                           "Backend [%s] unregistered from its own "
+                           "render\n", backend->command);
+    }
+
+    G_LOCK(backends);
+    if (backends != NULL
+            && g_hash_table_lookup(backends, backend->command) == backend)
+        g_hash_table_remove(backends, backend->command);
 
-    if (!strcmp(purple_prefs_get_string("/pidgin/conversations/bgcolor"), "")) {
-        g_string_append(result, "255,255,255");
+    while (!own && busy != NULL && g_hash_table_lookup(busy, backend) != NULL)
+        g_cond_wait(&released, &G_LOCK_NAME(backends));
+    G_UNLOCK(backends);
+}
+
+/* Looks up the backend of command and keeps it registered until
+ * release_backend(), so its functions and strings can be used */
+static const struct mapping *acquire_backend(const GString *command){
+    const struct mapping *found = NULL;
+
+    G_LOCK(backends);
+    if (backends != NULL
+            && (found = g_hash_table_lookup(backends, command->str)) != NULL)
+        g_hash_table_insert(busy, (gpointer) found, GINT_TO_POINTER(
+                    GPOINTER_TO_INT(g_hash_table_lookup(busy, found)) + 1));
+    G_UNLOCK(backends);
+
+    if (found != NULL && (g_private_get(&held) == NULL
+                || g_private_get(&held) == found)){
+        g_private_set(&held, (gpointer) found);
+        g_private_set(&held_count, GINT_TO_POINTER(
+                    GPOINTER_TO_INT(g_private_get(&held_count)) + 1));
+    }
+
+    return found;
+}
+
+static void release_backend(const struct mapping *backend){
+    int users;
+
+    if (g_private_get(&held) == backend){
+        users = GPOINTER_TO_INT(g_private_get(&held_count)) - 1;
+        g_private_set(&held_count, GINT_TO_POINTER(users));
+        if (users == 0)
+            g_private_set(&held, NULL);
+    }
+
+    G_LOCK(backends);
+    if (busy != NULL){
+        users = GPOINTER_TO_INT(g_hash_table_lookup(busy, backend)) - 1;
+        if (users > 0)
+            g_hash_table_insert(busy, (gpointer) backend,
+                    GINT_TO_POINTER(users));
+        else
+            g_hash_table_remove(busy, backend);
+    }
+    g_cond_broadcast(&released);
+    G_UNLOCK(backends);
+}
+
+/* Copies the backend of command into backend. Its flags and cost
+ * stay valid, but the backend may be unregistered at any time after,
+ * so whatever it points to is only used under acquire_backend().
+ * The batch is the exception, it is one of our own strings */
+gboolean find_backend(const GString *command, struct mapping *backend){
+    const struct mapping *found = NULL;
+
+    G_LOCK(backends);
+    if (backends != NULL
+            && (found = g_hash_table_lookup(backends, command->str)) != NULL){
+        *backend = *found;
+        if (found->batch != NULL)
+            backend->batch = strcmp(found->batch, "math") ? "listing" : "math";
+    }
+    G_UNLOCK(backends);
+
+    return found != NULL;
+}
+
+gboolean is_command(const GString *command){
+    struct mapping backend;
+
+    return find_backend(command, &backend);
+}
+
+/* Appends a template to source. If the preamble is available as
+ * precompiled format, the path of the format is returned, which
+ * compile_document() then compiles only the body with. Templates
+ * without a name never get a format. */
+static gchar *write_template(GString *source, const char *name,
+                             const char *engine, const char *preamble,
+                             const char *body){
+    gint64 started = pifo_stats_start();
+    gchar *format = name ? pifo_format_lookup(name, engine, preamble)
+        : NULL;
+
+    /* The whole document is still needed if the format turns
+     * out to be unusable */
+    g_string_append(source, preamble);
+    g_string_append(source, body);
+
+    pifo_stats_stage(PIFO_STAGE_TEMPLATE, started);
+
+    return format;
+}
+
+/* Compiles source with a fresh engine, which reads it from its
+ * stdin instead of a file: like the warm workers, it gets "\relax"
+ * as its first line and asks the terminal (our pipe, so it has to
+ * run in scrollmode) for the rest. The output and the log still
+ * end up in workspace, named after LATEX_JOBNAME */
+static int run_engine(const char *workspace, const char *engine,
+                      const char *format, const GString *source){
+    gchar *fmtopt = format ? g_strdup_printf("-fmt=%s", format) : NULL;
+    int exitcode;
+
+    /* Make sure that latex cannot do shell escape, even
+     * if the local default config says so! */
+    char * const opts[] = {
+        (char *) engine,
+        "--no-shell-escape",
+        "--interaction=scrollmode",
+        "-jobname=" LATEX_JOBNAME,
+        fmtopt ? fmtopt : "\\relax",
+        fmtopt ? "\\relax" : NULL, NULL
+    };
+
+    exitcode = execute_pipe(workspace, engine, opts, source, NULL);
+    g_free(fmtopt);
+
+    return exitcode;
+}
+
+/* Compiles the template in source with engine. With a format only
+ * body is compiled, by a warm worker if there is one, which hands
+ * its output (of type suffix) over to output and its log to log.
+ * A format the engine cannot load, e.g. one an older TeX dumped, is
+ * thrown away and the whole source compiled once more without it.
+ * Returns the exit code of the engine */
+static int compile_document(const char *workspace, const char *engine,
+                            const char *format, const GString *source,
+                            const char *body, const char *suffix,
+                            const GString *output, const GString *log){
+    GString *input;
+    gchar *logpath;
+    int exitcode;
+
+    if (format == NULL)
+        return run_engine(workspace, engine, NULL, source);
+
+    exitcode = pifo_worker_compile(engine, format, body, suffix,
+            output, log);
+    if (exitcode != -1)
+        return exitcode;
+
+    /* An engine that cannot load its format stops before it
+     * opens the log */
+    logpath = g_build_filename(workspace, LATEX_JOBNAME ".log", NULL);
+    unlink(logpath);
+
+    input = g_string_new(body);
+    exitcode = run_engine(workspace, engine, format, input);
+    g_string_free(input, TRUE);
+
+    if (exitcode > 0 && !g_file_test(logpath, G_FILE_TEST_EXISTS)){
+        pifo_format_reject(format);
+        exitcode = run_engine(workspace, engine, NULL, source);
+    }
+
+    g_free(logpath);
+
+    return exitcode;
+}
+
+/* Runs a tool that reads input from stdin and writes the png to
+ * stdout. Returns TRUE if it did, with the image in png */
+static gboolean run_png_filter(const char *workspace, char * const cmd[],
+                               const GString *input, GString **png){
+    if (execute_pipe(workspace, cmd[0], cmd, input, png) != 0
+            || *png == NULL)
+        return FALSE;
+
+    if ((*png)->len == 0){
+        g_string_free(*png, TRUE);
+        *png = NULL;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static GString *lookup_caches(const char *key, const GString *command){
+    GString *result;
+    gint64 cost;
+
+    if ((result = pifo_cache_lookup(key)) != NULL){
+        pifo_debug_info("LaTeX",
+                        "Render cache hit for [%s]\n",
+                        command->str);
+        pifo_stats_count(PIFO_COUNT_CACHE_HIT);
+        return result;
+    }
+
+    if ((result = pifo_diskcache_lookup(key, &cost)) != NULL){
+        pifo_debug_info("LaTeX",
+                        "Disk cache hit for [%s]\n",
+                        command->str);
+        pifo_cache_insert(key, result, cost);
+        pifo_stats_count(PIFO_COUNT_DISK_CACHE_HIT);
+        return result;
+    }
+
+    pifo_stats_count(PIFO_COUNT_CACHE_MISS);
+
+    return NULL;
+}
+
+static void store_caches(const char *key, const GString *png, gint64 cost){
+    pifo_cache_insert(key, png, cost);
+    pifo_diskcache_insert(key, png, cost);
+}
+
+/* Reads an image a tool could only write into a file and
+ * removes the file */
+static GString *read_png(const char *path){
+    GString *result = NULL;
+    GError *error = NULL;
+    gchar *data;
+    gsize size;
+
+    if (!g_file_get_contents(path, &data, &size, &error)){
+        pifo_debug_error("LaTeX",
+                         "Error while reading the rendered markup [%s]\n",
+                         error->message);
+        g_error_free(error);
     } else {
-        pidgin_bgcolor = purple_prefs_get_string("/pidgin/conversations/bgcolor");
-        rgb = strtol(pidgin_bgcolor + 1, NULL, 16);
-        g_string_append_printf(result, "%d,%d,%d",
-                               rgb >> 16, (rgb >> 8) & 0xff, rgb & 0xff);
+        result = g_string_new_len(data, size);
+        g_free(data);
     }
 
+    unlink(path);
+
     return result;
 }
 
-/* Used to parse the command and trigger appropriate compilier runs */
-GString *dispatch_command(const GString *command, const GString *snippet){
+/* What the tools wrote besides the image itself is dropped, so the
+ * same snippet always ends up as the same bytes */
+static GString *strip_png(GString *png){
+    g_string_truncate(png,
+            pifo_image_strip_png((guchar *) png->str, png->len));
+
+    return png;
+}
+
+/* Bytes the png optimization saved so far */
+static gsize saved_bytes = 0;
+G_LOCK_DEFINE_STATIC(saved_bytes);
+
+/* Every rendered png passes through here before it is cached,
+ * whichever backend it came from */
+static GString *optimize_png(GString *png){
+    GString *optimized;
+    gint64 started = g_get_monotonic_time();
+    gsize saved;
+
+    if ((optimized = pifo_image_optimize_png(png)) == NULL)
+        return png;
+
+    G_LOCK(saved_bytes);
+    saved = saved_bytes += png->len - optimized->len;
+    G_UNLOCK(saved_bytes);
+
+    pifo_debug_info("LaTeX",
+                    "Shrunk png from %lu to %lu bytes in %" G_GINT64_FORMAT
+                    " us, %lu bytes saved so far\n",
+                    (unsigned long) png->len, (unsigned long) optimized->len,
+                    g_get_monotonic_time() - started, (unsigned long) saved);
+
+    g_string_free(png, TRUE);
+
+    return optimized;
+}
+
+/* The cache key of a snippet, or NULL if its backend is gone */
+static gchar *cache_key(const GString *command, const GString *snippet){
+    const struct mapping *backend;
+    gchar *key;
+
+    if ((backend = acquire_backend(command)) == NULL)
+        return NULL;
+
+    key = pifo_cache_key(command, snippet, backend);
+    release_backend(backend);
+
+    return key;
+}
+
+/* The image of snippet if the memory cache has it, or NULL. Cheap
+ * enough for the main thread, the disk cache and everything else are
+ * left to dispatch_command() in a render thread */
+GString *lookup_render(const GString *command, const GString *snippet){
+    struct mapping backend;
     GString *result;
-    int i;
+    gchar *key;
 
-    for (i=0; i<sizeof(commandmap)/sizeof(struct mapping); i++){
-        if (!strcmp(command->str, commandmap[i].command)){
-            purple_debug_info("LaTeX",
-                              "Running backend for [%s]\n",
-                              command->str);
+    if (!find_backend(command, &backend)
+            || !(backend.flags & PIFO_BACKEND_CACHEABLE)
+            || (key = cache_key(command, snippet)) == NULL)
+        return NULL;
 
-            if (commandmap[i].handler(snippet, command, (void **) &result)){
-                return result;
-            } else {
-                return NULL;
-            }
+    if ((result = pifo_cache_lookup(key)) != NULL)
+        pifo_stats_count(PIFO_COUNT_CACHE_HIT);
+    g_free(key);
+
+    return result;
+}
+
+/* Runs the backend of command, after looking in the caches unless
+ * the caller already did and missed */
+static GString *render_command(const GString *command,
+        const GString *snippet, gboolean looked_up){
+    const struct mapping *backend;
+    GString *result = NULL;
+    gchar *key = NULL, *workspace;
+    gboolean serial;
+    gint64 started, traced = pifo_trace_start(), generated;
+
+    if ((backend = acquire_backend(command)) == NULL){
+        return NULL;
+    }
+
+    if (backend->flags & PIFO_BACKEND_CACHEABLE){
+        key = pifo_cache_key(command, snippet, backend);
+        if (!looked_up && (result = lookup_caches(key, command)) != NULL){
+            g_free(key);
+            release_backend(backend);
+            pifo_trace_span("dispatch_command", traced, "cache hit");
+            return result;
         }
     }
 
-    return NULL;
+    pifo_debug_info("LaTeX",
+                    "Running backend for [%s]\n",
+                    command->str);
+
+    serial = !(backend->flags & PIFO_BACKEND_THREADSAFE);
+    if (serial)
+        G_LOCK(serial_backends);
+
+    started = g_get_monotonic_time();
+    generated = pifo_trace_start();
+    if (backend->render != NULL){
+        result = backend->render(snippet, command);
+    }
+
+    if (result == NULL && backend->handler != NULL
+            && (workspace = pifo_workspace_acquire()) != NULL){
+        if (backend->handler(snippet, command, workspace, &result))
+            result = strip_png(result);
+        else
+            result = NULL;
+        pifo_workspace_release(workspace);
+    }
+    pifo_trace_span("generator", generated, command->str);
+
+    if (serial)
+        G_UNLOCK(serial_backends);
+    release_backend(backend);
+
+    if (result != NULL){
+        result = optimize_png(result);
+    }
+
+    pifo_stats_backend(command->str, started, result != NULL);
+
+    if (result != NULL && key != NULL){
+        store_caches(key, result, g_get_monotonic_time() - started);
+    }
+    g_free(key);
+
+    pifo_trace_span("dispatch_command", traced, command->str);
+
+    return result;
 }
 
-gboolean generate_latex_listing(const GString *listing,
-                                const GString *language, GString **filename){
+/* Used to parse the command and trigger appropriate compilier runs.
+ * Returns the rendered png, or NULL if the backend failed */
+GString *dispatch_command(const GString *command, const GString *snippet){
+    return render_command(command, snippet, FALSE);
+}
 
-    FILE *transcript_file;
-    char *listing_temp = listing->str;
-    gboolean returnval = TRUE;
+/* Name of the batch the command may be compiled in together
+ * with others of the same name, or NULL */
+const char *batch_kind(const GString *command){
+    struct mapping backend;
+
+    if (!find_backend(command, &backend)
+            || !(backend.flags & PIFO_BACKEND_BATCHABLE))
+        return NULL;
+
+    return backend.batch;
+}
 
+/* How expensive a render of command is expected to be */
+enum pifo_cost backend_cost(const GString *command){
+    struct mapping backend;
+
+    if (!find_backend(command, &backend))
+        return PIFO_COST_CHEAP;
+
+    return backend.cost;
+}
+
+/* Goes through the log of a batch and marks every snippet
+ * that caused an error. Errors outside of any snippet (or
+ * a missing end marker) fail the whole batch */
+static gboolean check_batch_log(const char *logpath, gboolean *failed,
+                                int count){
+    gchar *log, **lines;
+    int current = -1, i;
+    gboolean complete = FALSE;
+
+    if (!g_file_get_contents(logpath, &log, NULL, NULL))
+        return FALSE;
+
+    lines = g_strsplit(log, "\n", -1);
+    g_free(log);
+
+    for (i=0; lines[i] != NULL && !complete; i++){
+        if (g_str_has_prefix(lines[i], BATCH_MARK)){
+            if (!strcmp(lines[i] + strlen(BATCH_MARK), "end"))
+                complete = TRUE;
+            else
+                current = atoi(lines[i] + strlen(BATCH_MARK));
+        } else if (g_str_has_prefix(lines[i], "! ")){
+            if (current < 0 || current >= count){
+                g_strfreev(lines);
+                return FALSE;
+            }
+            failed[current] = TRUE;
+        }
+    }
+
+    g_strfreev(lines);
+
+    return complete;
+}
+
+/* Compiles all snippets into one document, one page per snippet,
+ * and turns it into one png per page in a single dvipng run.
+ * Snippets that cannot be told apart from the errors they cause
+ * are left NULL in results */
+static void generate_latex_batch(const char *kind,
+                                 const char *workspace,
+                                 const GPtrArray *commands,
+                                 const GPtrArray *snippets,
+                                 GString **results){
+    GString *source = g_string_new(NULL);
     GString *fgcolor = fgcolor_as_string(),
         *bgcolor = bgcolor_as_string();
     GString *texfilepath, *dvifilepath,
         *pngfilepath, *auxfilepath, *logfilepath;
+    GString *body = g_string_new(NULL);
+    GString *pagepattern, *pagepath;
+    gchar *preamble, *format = NULL;
+    gboolean *failed = g_new0(gboolean, commands->len);
+    int exitcode = -1, pages = 0, i;
 
-    setup_files(&texfilepath, &dvifilepath,
+    setup_files(workspace, &texfilepath, &dvifilepath,
                 &pngfilepath, &auxfilepath, &logfilepath);
 
-    purple_debug_info("LaTex",
-                      "Using [%s] as latex file\n",
-                      texfilepath->str);
-
-    if (!chtempdir(texfilepath)){
-        returnval = FALSE;
-        goto out;
+    /* dvipng replaces %d by the page number */
+    pagepattern = g_string_new(pngfilepath->str);
+    g_string_truncate(pagepattern, pagepattern->len - strlen(".png"));
+    pagepath = g_string_new(pagepattern->str);
+    g_string_append(pagepattern, "-%d.png");
+
+    if (!strcmp(kind, "math")){
+        preamble = g_strdup_printf(LATEX_MATH_PREAMBLE,
+                fgcolor->str, bgcolor->str);
+        g_string_append(body, LATEX_MATH_BATCH_BEGIN);
+        for (i=0; i<commands->len; i++){
+            g_string_append_printf(body, LATEX_MATH_PAGE, i,
+                    ((GString *) g_ptr_array_index(snippets, i))->str);
+        }
+    } else {
+        preamble = g_strdup_printf(LATEX_LST_PREAMBLE,
+                fgcolor->str, bgcolor->str,
+                "none", "5", "none");
+        g_string_append(body, LATEX_LST_BATCH_BEGIN);
+        for (i=0; i<commands->len; i++){
+            g_string_append_printf(body, LATEX_LST_PAGE, i,
+                    ((GString *) g_ptr_array_index(commands, i))->str,
+                    ((GString *) g_ptr_array_index(snippets, i))->str);
+        }
     }
+    g_string_append(body, LATEX_BATCH_END);
 
-    if (!(transcript_file = fopen(texfilepath->str, "w"))){
-        returnval = FALSE;
+    format = write_template(source, kind, "latex", preamble, body->str);
+
+    /* One png per page, so dvipng has to write files */
+    char * const dvipngopts[] = {
+        "dvipng", "-Q", "10", "-T", "tight",
+        "-o", pagepattern->str, dvifilepath->str, NULL
+    };
+
+    exitcode = compile_document(workspace, "latex", format, source,
+            body->str, "dvi", dvifilepath, logfilepath);
+
+    /* A broken snippet makes latex fail, the others are still fine */
+    if (!g_file_test(dvifilepath->str, G_FILE_TEST_EXISTS)
+            || !check_batch_log(logfilepath->str, failed, commands->len)
+            || execute(workspace, "dvipng", dvipngopts) != 0){
+        pifo_debug_info("LaTeX",
+                        "Batch of %u snippets failed\n", commands->len);
         goto out;
     }
 
-    purple_debug_info("LaTeX",
-                      "Using [%s] as foreground and [%s] as background\n",
-                      fgcolor->str, bgcolor->str);
+    /* Count the pages, if some snippet did not produce exactly
+     * one page they cannot be mapped back to the snippets */
+    g_string_printf(pagepath, pagepattern->str, 1);
+    while (g_file_test(pagepath->str, G_FILE_TEST_EXISTS)){
+        pages++;
+        g_string_printf(pagepath, pagepattern->str, pages + 1);
+    }
 
-#ifdef DEBUG
-    printf("transcript_file: " LATEX_LST_TEMPLATE "\n",
-           fgcolor->str, bgcolor->str,
-           "none", "5", "none", language->str,
-           listing_temp);
-#endif
-    /* Generate latex template file */
-    fprintf(transcript_file, LATEX_LST_TEMPLATE,
-            fgcolor->str, bgcolor->str,
-            "none", "5", "none", language->str,
-            listing_temp);
-    fclose(transcript_file);
+    if (pages != commands->len){
+        pifo_debug_info("LaTeX",
+                        "Batch of %u snippets produced %d pages\n",
+                        commands->len, pages);
+    }
 
-    if (render_latex(pngfilepath, texfilepath, dvifilepath) == TRUE){
-        *filename = pngfilepath;
-    } else {
-        purple_debug_info("LaTeX",
-                          "Image creation exited with failure\n");
-        returnval = FALSE;
-        g_string_free(pngfilepath, TRUE);
-        *filename = NULL;
+    for (i=0; i<pages && pages == commands->len; i++){
+        g_string_printf(pagepath, pagepattern->str, i + 1);
+        if (!failed[i] && (results[i] = read_png(pagepath->str)) != NULL){
+            results[i] = strip_png(results[i]);
+        }
     }
 
  out:
-    unlink(texfilepath->str);
-    unlink(dvifilepath->str);
-    unlink(auxfilepath->str);
-    unlink(logfilepath->str);
-
     g_string_free(texfilepath, TRUE);
+    g_string_free(dvifilepath, TRUE);
+    g_string_free(pngfilepath, TRUE);
     g_string_free(auxfilepath, TRUE);
     g_string_free(logfilepath, TRUE);
-    g_string_free(dvifilepath, TRUE);
-
-    return returnval;
+    g_string_free(pagepattern, TRUE);
+    g_string_free(pagepath, TRUE);
+    g_string_free(fgcolor, TRUE);
+    g_string_free(bgcolor, TRUE);
+    g_string_free(body, TRUE);
+    g_string_free(source, TRUE);
+    g_free(preamble);
+    g_free(format);
+    g_free(failed);
 }
 
-gboolean generate_graphviz_png(const GString *dotcode,
-                               const GString *command,
-                               GString **filename){
-    *filename = NULL;
+/* Renders a whole batch of snippets at once. Cached snippets are
+ * taken from the caches, the others are compiled together if
+ * they share a template. Snippets that fail in the batch are
+ * rendered on their own again, so a broken snippet only fails
+ * itself. results gets the png (or NULL) for every snippet and
+ * timed_out tells which of them were stopped for their deadline. */
+void dispatch_batch(const GPtrArray *commands, const GPtrArray *snippets,
+                    GString **results, gboolean *timed_out){
+    struct mapping backend;
+    const char *kind = NULL;
+    GPtrArray *miss_commands = g_ptr_array_new();
+    GPtrArray *miss_snippets = g_ptr_array_new();
+    GArray *misses = g_array_new(FALSE, FALSE, sizeof(int));
+    gchar **keys = g_new0(gchar *, commands->len);
+    GString **rendered;
+    GString *command, *snippet;
+    gchar *workspace;
+    gboolean same_kind = TRUE, complete;
+    gint64 started, cost;
+    gchar batch_name[32];
+    gint64 traced = pifo_trace_start();
+    int i, j;
+
+    for (i=0; i<commands->len; i++){
+        command = g_ptr_array_index(commands, i);
+        snippet = g_ptr_array_index(snippets, i);
+        results[i] = NULL;
+        timed_out[i] = FALSE;
+
+        if (!find_backend(command, &backend))
+            continue;
+
+        if (backend.flags & PIFO_BACKEND_CACHEABLE){
+            keys[i] = cache_key(command, snippet);
+            if (keys[i] != NULL
+                    && (results[i] = lookup_caches(keys[i], command)) != NULL)
+                continue;
+        }
 
-    FILE *dotfile;
-    gboolean returnval = TRUE;
-    gboolean exec;
-    GString *tmpfile = get_unique_tmppath();
-    GString *pngfile = g_string_new(tmpfile->str);
-    g_string_append(pngfile, ".png");
+        if (!(backend.flags & PIFO_BACKEND_BATCHABLE)
+                || (kind != NULL && strcmp(kind, backend.batch)))
+            same_kind = FALSE;
+        kind = backend.batch;
 
-    if (!chtempdir(tmpfile)){
-        returnval = FALSE;
-        goto out;
+        g_ptr_array_add(miss_commands, command);
+        g_ptr_array_add(miss_snippets, snippet);
+        g_array_append_val(misses, i);
     }
 
-    if (!(dotfile = fopen(tmpfile->str, "w"))){
-        purple_notify_error(me, "PiFo",
-                            "Error while trying to render graphviz file",
-                            "Error opening file!");
+    rendered = g_new0(GString *, misses->len);
+
+    if (misses->len > 1 && same_kind
+            && (workspace = pifo_workspace_acquire()) != NULL){
+        pifo_debug_info("LaTeX",
+                        "Compiling %u [%s] snippets as one batch\n",
+                        misses->len, kind);
+
+        started = g_get_monotonic_time();
+        generate_latex_batch(kind, workspace,
+                miss_commands, miss_snippets, rendered);
+        cost = (g_get_monotonic_time() - started) / misses->len;
+        pifo_workspace_release(workspace);
+
+        /* Snippets missing from the batch are rerun alone below,
+         * the batch itself only counts as rendered without them */
+        complete = TRUE;
+        for (j=0; j<misses->len; j++){
+            if (rendered[j] == NULL)
+                complete = FALSE;
+        }
+
+        g_snprintf(batch_name, sizeof(batch_name), "%s batch", kind);
+        pifo_stats_backend(batch_name, started, complete);
+        pifo_trace_span("generator", started, batch_name);
 
-        return FALSE;
+        /* The snippets to blame are found by running them alone */
+        pifo_spawn_timed_out();
+
+        for (j=0; j<misses->len; j++){
+            i = g_array_index(misses, int, j);
+            if (rendered[j] != NULL)
+                rendered[j] = optimize_png(rendered[j]);
+            if (rendered[j] != NULL && keys[i] != NULL)
+                store_caches(keys[i], rendered[j], cost);
+        }
     }
 
-    fprintf(dotfile, "%s", dotcode->str);
-    fclose(dotfile);
+    for (j=0; j<misses->len; j++){
+        i = g_array_index(misses, int, j);
+        if (rendered[j] != NULL){
+            results[i] = rendered[j];
+        } else {
+            /* The caches were looked in above already */
+            results[i] = render_command(g_ptr_array_index(commands, i),
+                    g_ptr_array_index(snippets, i), TRUE);
+            timed_out[i] = pifo_spawn_timed_out();
+        }
+    }
 
-    char * const dotopts[] = {
-        "dot", "-O",
-        "-T", "png",
-        tmpfile->str, NULL
-    };
+    for (i=0; i<commands->len; i++){
+        g_free(keys[i]);
+    }
+    g_free(keys);
+    g_free(rendered);
+    g_array_free(misses, TRUE);
+    g_ptr_array_free(miss_commands, TRUE);
+    g_ptr_array_free(miss_snippets, TRUE);
+
+    pifo_trace_span("dispatch_batch", traced, NULL);
+}
+
+gboolean generate_latex_listing(const GString *listing,
+                                const GString *language,
+                                const char *workspace,
+                                GString **png){
+
+    char *listing_temp = listing->str;
+    gboolean returnval = TRUE;
+    gchar *preamble = NULL, *body = NULL, *format = NULL;
+    GString *source = g_string_new(NULL);
+
+    GString *fgcolor = fgcolor_as_string(),
+        *bgcolor = bgcolor_as_string();
+
+    pifo_debug_info("LaTeX",
+                      "Using [%s] as foreground and [%s] as background\n",
+                      fgcolor->str, bgcolor->str);
+
+    preamble = g_strdup_printf(LATEX_LST_PREAMBLE,
+            fgcolor->str, bgcolor->str,
+            "none", "5", "none");
+    body = g_strdup_printf(LATEX_LST_BODY,
+            language->str, listing_temp);
 
 #ifdef DEBUG
-    printf("generate_graphivz_png(): tmpfile: [%s]\npngfile: [%s]\n",
-           tmpfile->str, pngfile->str);
+    printf("transcript_file: %s%s\n", preamble, body);
 #endif
+    /* Generate latex template */
+    format = write_template(source, "listing", "latex",
+            preamble, body);
 
-    exec = execute("dot", dotopts);
+    if (!render_latex(workspace, source, format, body, png)){
+        pifo_debug_info("LaTeX",
+                          "Image creation exited with failure\n");
+        returnval = FALSE;
+    }
+
+    g_string_free(source, TRUE);
+    g_free(preamble);
+    g_free(body);
+    g_free(format);
 
-    if (exec != 0){
-        purple_debug_info("PiFo",
+    return returnval;
+}
+
+gboolean generate_graphviz_png(const GString *dotcode,
+                               const GString *command,
+                               const char *workspace,
+                               GString **png){
+    char * const dotopts[] = {
+        "dot", "-T", "png", NULL
+    };
+
+    /* dot reads the graph from stdin and writes the png to stdout */
+    if (!run_png_filter(workspace, dotopts, dotcode, png)){
+        pifo_debug_info("PiFo",
                           "Could not render dot code!\n");
-        *filename = NULL;
-        returnval = FALSE;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+#ifdef HAVE_LIBGVC
+/* Lays out and renders the graph in process. The png never
+ * touches the disk and no dot has to be started for it */
+GString *render_graphviz_png(const GString *dotcode,
+                             const GString *command){
+    Agraph_t *graph;
+    char *data = NULL;
+    unsigned int length = 0;
+    GString *result = NULL;
+
+    if (dotcode->len > GRAPHVIZ_INPROCESS_MAX)
+        return NULL;
+
+    G_LOCK(graphviz);
+    if (gvc == NULL)
+        gvc = gvContext();
+
+    if ((graph = agmemread(dotcode->str)) == NULL){
+        pifo_debug_info("PiFo",
+                          "Could not parse dot code!\n");
         goto out;
     }
 
-    *filename = pngfile;
-    returnval = TRUE;
-    goto out;
+    if (gvLayout(gvc, graph, "dot") == 0){
+        if (gvRenderData(gvc, graph, "png", &data, &length) == 0){
+            result = g_string_new_len(data, length);
+        } else {
+            pifo_debug_info("PiFo",
+                              "Could not render dot code!\n");
+        }
+        gvFreeRenderData(data);
+        gvFreeLayout(gvc, graph);
+    }
+
+    agclose(graph);
 
  out:
-    unlink(tmpfile->str);
-    g_string_free(tmpfile, TRUE);
+    G_UNLOCK(graphviz);
 
-    return returnval;
+    return result;
 }
+#endif
 
-gboolean setup_files(GString **tex,
+/* Names the files of a LaTeX run. They all share the same
+ * base name, which is fine as the workspace is ours alone */
+gboolean setup_files(const char *workspace, GString **tex,
                      GString **dvi, GString **png,
                      GString **aux, GString **log){
 
-    GString *tmpfilepath;
-    tmpfilepath = get_unique_tmppath();
+    gchar *base = g_build_filename(workspace, LATEX_JOBNAME, NULL);
 
-    *tex = g_string_new(tmpfilepath->str);
-    *dvi = g_string_new(tmpfilepath->str);
-    *png = g_string_new(tmpfilepath->str);
-    *aux = g_string_new(tmpfilepath->str);
-    *log = g_string_new(tmpfilepath->str);
+    *tex = g_string_new(base);
+    *dvi = g_string_new(base);
+    *png = g_string_new(base);
+    *aux = g_string_new(base);
+    *log = g_string_new(base);
 
     g_string_append(*tex, ".tex");
     g_string_append(*dvi, ".dvi");
@@ -274,262 +1247,521 @@ gboolean setup_files(GString **tex,
     g_string_append(*log, ".log");
     g_string_append(*aux, ".aux");
 
-    //TODO!!
-//    g_string_free(tmpfilepath, TRUE);
+    g_free(base);
 
     return TRUE;
 }
 
-gboolean chtempdir(const GString *path){
-    g_assert (path != NULL);
+#if defined(HAVE_LIBRSVG) || defined(HAVE_POPPLER)
+static cairo_status_t append_png(void *closure, const unsigned char *data,
+                                 unsigned int length){
+    g_string_append_len(closure, (const gchar *) data, length);
+
+    return CAIRO_STATUS_SUCCESS;
+}
+#endif
+
+#ifdef HAVE_POPPLER
+static cairo_surface_t *render_pdf_area(PopplerPage *page, double scale,
+                                        double x, double y,
+                                        int width, int height){
+    cairo_surface_t *surface;
+    cairo_t *cr;
+
+    surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+            width, height);
+    cr = cairo_create(surface);
 
-    char *dirname_temp = getdirname(path->str);
-    if (dirname_temp == NULL){
+    /* The eps came out on white as well */
+    cairo_set_source_rgb(cr, 1, 1, 1);
+    cairo_paint(cr);
+
+    cairo_scale(cr, scale, scale);
+    cairo_translate(cr, -x, -y);
+    poppler_page_render(page, cr);
+
+    cairo_destroy(cr);
+    cairo_surface_flush(surface);
+
+    return surface;
+}
+
+/* Rasterizes the first page of the pdf in process and crops it to
+ * the picture. A whole page at full resolution would be tens of
+ * megabytes, so the picture is looked for in a small preview and
+ * only its area gets rendered at full resolution. */
+static gboolean rasterize_pdf(const GString *pdffilepath, GString **png){
+    PopplerDocument *document;
+    PopplerPage *page = NULL;
+    cairo_surface_t *surface, *trimmed;
+    GError *error = NULL;
+    gboolean returnval = FALSE;
+    gchar *uri;
+    double page_width, page_height;
+    double preview_scale = PDF_PREVIEW_DPI / 72.0;
+    double scale = PDF_DPI / 72.0;
+    double left, top;
+    int x, y, width, height;
+
+    if ((uri = g_filename_to_uri(pdffilepath->str, NULL, &error)) == NULL
+            || (document = poppler_document_new_from_file(uri, NULL,
+                    &error)) == NULL){
+        pifo_debug_info("PiFo",
+                "Could not open [%s]: [%s]\n",
+                pdffilepath->str, error->message);
+        g_error_free(error);
+        g_free(uri);
         return FALSE;
     }
+    g_free(uri);
 
-    if (chdir(dirname_temp) == -1){
-        g_free(dirname_temp);
-        return FALSE;
+    if ((page = poppler_document_get_page(document, 0)) == NULL)
+        goto out;
+
+    poppler_page_get_size(page, &page_width, &page_height);
+
+    surface = render_pdf_area(page, preview_scale, 0, 0,
+            (int) (page_width * preview_scale + 0.5),
+            (int) (page_height * preview_scale + 0.5));
+    returnval = pifo_image_trim(cairo_image_surface_get_data(surface),
+            cairo_image_surface_get_width(surface),
+            cairo_image_surface_get_height(surface),
+            cairo_image_surface_get_stride(surface),
+            &x, &y, &width, &height);
+    cairo_surface_destroy(surface);
+
+    if (!returnval){
+        pifo_debug_info("PiFo", "Tikz picture is empty\n");
+        goto out;
     }
 
-    g_free(dirname_temp);
+    /* One preview pixel of margin, for what got rounded away */
+    left = MAX(x - 1, 0) / preview_scale;
+    top = MAX(y - 1, 0) / preview_scale;
+    width = (int) ((width + 2) / preview_scale * scale + 0.5);
+    height = (int) ((height + 2) / preview_scale * scale + 0.5);
 
-    return TRUE;
+    surface = render_pdf_area(page, scale, left, top, width, height);
+
+    if (!pifo_image_trim(cairo_image_surface_get_data(surface),
+                width, height, cairo_image_surface_get_stride(surface),
+                &x, &y, &width, &height)){
+        x = y = 0;
+    }
+
+    trimmed = cairo_image_surface_create_for_data(
+            cairo_image_surface_get_data(surface)
+            + y * cairo_image_surface_get_stride(surface) + x * 4,
+            CAIRO_FORMAT_ARGB32, width, height,
+            cairo_image_surface_get_stride(surface));
+
+    *png = g_string_new(NULL);
+    returnval = cairo_surface_write_to_png_stream(trimmed, append_png, *png)
+        == CAIRO_STATUS_SUCCESS;
+    if (!returnval){
+        g_string_free(*png, TRUE);
+        *png = NULL;
+    }
+
+    cairo_surface_destroy(trimmed);
+    cairo_surface_destroy(surface);
+
+ out:
+    if (page != NULL)
+        g_object_unref(page);
+    g_object_unref(document);
+
+    return returnval;
 }
+#endif
 
-gboolean render_latex_pdf_to_png(const GString *pngfilepath,
-        const GString *texfilepath, const GString *epsfilepath,
-        const GString *pdffilepath){
+gboolean render_latex_pdf_to_png(const char *workspace,
+        const GString *source, const GString *pdffilepath,
+        const char *format, const char *body, GString **png){
 
-    int exec;
+    int exitcode;
+    GString *eps = NULL;
+    gboolean exec;
+    /* Workers leave their log where cold engines do */
+    GString *logfilepath = g_string_new(workspace);
 
-    char * const pdflatex[] = {
-        "pdflatex", "--no-shell-escape",
-        "--interaction=nonstopmode",
-        texfilepath->str, NULL
-    };
+    g_string_append(logfilepath, G_DIR_SEPARATOR_S LATEX_JOBNAME ".log");
 
+    /* pdftops and convert hand the picture on through pipes */
     char * const pdftops[] = {
         "pdftops", "-eps",
-        pdffilepath->str, NULL
+        pdffilepath->str, "-", NULL
     };
 
     char * const convert[] = {
         "convert", "-trim",
         "-density", "300",
-        epsfilepath->str, pngfilepath->str, NULL
+        "eps:-", "png:-", NULL
     };
 
-    exec = (execute("pdflatex", pdflatex) == 0) &&
-           (execute("pdftops", pdftops) == 0) &&
-           (execute("convert", convert) == 0);
+    *png = NULL;
+
+    exitcode = compile_document(workspace, "pdflatex", format, source,
+            body, "pdf", pdffilepath, logfilepath);
+
+    g_string_free(logfilepath, TRUE);
+
+#ifdef HAVE_POPPLER
+    /* Leaves pdflatex as the only process of the picture */
+    if (exitcode == 0 && rasterize_pdf(pdffilepath, png))
+        return TRUE;
+#endif
+
+    exec = (exitcode == 0) &&
+           (execute_pipe(workspace, "pdftops", pdftops, NULL, &eps) == 0) &&
+           run_png_filter(workspace, convert, eps, png);
+
+    if (eps != NULL)
+        g_string_free(eps, TRUE);
 
     if (!exec){
-        purple_debug_info("PiFo",
+        pifo_debug_info("PiFo",
                 "Could not render file [%s]\n",
-                texfilepath->str);
+                pdffilepath->str);
         return FALSE;
     }
 
     return TRUE;
 }
 
-gboolean render_svg_to_png(const GString *pngfile, const GString *svgfile){
-    int exec;
+/* Undoes what libpurple did to the URLs in the svg code */
+static gchar *unlink_svg(const GString *svg_code){
+    static GRegex *links = NULL;
 
-    char * const convert[] = {
-        "convert", "-trim",
-        "-density", "300",
-        svgfile->str,
-        pngfile->str, NULL
-    };
+    if (g_once_init_enter(&links)){
+        g_once_init_leave(&links,
+                g_regex_new(SVG_LINK_PATTERN, G_REGEX_OPTIMIZE, 0, NULL));
+    }
 
-    /* Disgusting hack because fucking libpurple
-       automatically linkifies every "http://somewhat"
-       string that gets into the conversation window. Html unescape
-       OF COURSE does not take care of that...
-       I hate libpurple! */
-    char * const sed[] = {
-         "sed", "-i"
-         "-e",
-         "s/\\\"<A HREF=\\\".*\\\">\\(http:\\/\\/.*\\)<\\/A>\\\"/\\\"\\1\\\"/g",
-         svgfile->str,
-	 NULL
-    };
+    return g_regex_replace(links, svg_code->str, svg_code->len, 0,
+            "\"\\1\"", 0, NULL);
+}
 
-    #ifdef DEBUG
-    printf("Sed Argument: [%s]\n", sed[3]);
-    #endif
+#ifdef HAVE_LIBRSVG
+/* Rasterizes the svg in process and trims the pixels, instead of
+ * running convert on it */
+GString *render_svg_png(const GString *svg_code,
+                        const GString *command){
+    RsvgHandle *handle;
+    RsvgDimensionData size;
+    cairo_surface_t *surface, *trimmed;
+    cairo_t *cr;
+    GError *error = NULL;
+    GString *result = NULL;
+    gchar *svg;
+    double scale = SVG_DPI / 96.0;
+    int width, height, x, y, trimmed_width, trimmed_height;
+
+    if ((svg = unlink_svg(svg_code)) == NULL)
+        return NULL;
+
+    handle = rsvg_handle_new_from_data((const guint8 *) svg,
+            strlen(svg), &error);
+    g_free(svg);
+
+    if (handle == NULL){
+        pifo_debug_info("PiFo",
+                "Could not parse svg code: [%s]\n",
+                error->message);
+        g_error_free(error);
+        return NULL;
+    }
 
-    exec = (execute("sed", sed) == 0) &&
-	   (execute("convert", convert) == 0);
+    rsvg_handle_get_dimensions(handle, &size);
+    width = (int) (size.width * scale + 0.5);
+    height = (int) (size.height * scale + 0.5);
 
-    if (!exec){
-        purple_debug_info("PiFo",
-                "Could not render file [%s]\n",
-                svgfile->str);
-        return FALSE;
+    if (width <= 0 || height <= 0
+            || width > SVG_MAX_SIZE || height > SVG_MAX_SIZE){
+        pifo_debug_info("PiFo",
+                "Svg size %dx%d is out of bounds\n", width, height);
+        g_object_unref(handle);
+        return NULL;
     }
 
-    return TRUE;
-}
+    surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+            width, height);
+    cr = cairo_create(surface);
+    cairo_scale(cr, scale, scale);
 
-gboolean generate_svg_png(const GString *svg_code,
-        const GString *command,
-        GString **filename_png){
+    if (!rsvg_handle_render_cairo(handle, cr)){
+        pifo_debug_info("PiFo",
+                "Could not render svg code!\n");
+        goto out;
+    }
 
-    FILE *svgfile;
-    gboolean returnval = TRUE;
+    cairo_surface_flush(surface);
 
-    GString *svgfilepath, *pngfilepath;
+    if (!pifo_image_trim(cairo_image_surface_get_data(surface),
+                width, height, cairo_image_surface_get_stride(surface),
+                &x, &y, &trimmed_width, &trimmed_height)){
+        x = y = 0;
+        trimmed_width = width;
+        trimmed_height = height;
+    }
 
-    GString *tmpfilepath;
-    tmpfilepath = get_unique_tmppath();
+    /* The trimmed image shares the pixels of the full one */
+    trimmed = cairo_image_surface_create_for_data(
+            cairo_image_surface_get_data(surface)
+            + y * cairo_image_surface_get_stride(surface) + x * 4,
+            CAIRO_FORMAT_ARGB32, trimmed_width, trimmed_height,
+            cairo_image_surface_get_stride(surface));
+
+    result = g_string_new(NULL);
+    if (cairo_surface_write_to_png_stream(trimmed, append_png, result)
+            != CAIRO_STATUS_SUCCESS){
+        g_string_free(result, TRUE);
+        result = NULL;
+    }
 
-    pngfilepath = g_string_new(tmpfilepath->str);
-    svgfilepath = g_string_new(tmpfilepath->str);
+    cairo_surface_destroy(trimmed);
 
-    g_string_free(tmpfilepath, TRUE);
+ out:
+    cairo_destroy(cr);
+    cairo_surface_destroy(surface);
+    g_object_unref(handle);
 
-    g_string_append(pngfilepath, ".png");
-    g_string_append(svgfilepath, ".svg");
+    return result;
+}
+#endif
 
-    purple_debug_info("PiFo",
-                      "Using [%s] as svg file\n",
-                      svgfilepath->str);
+gboolean generate_svg_png(const GString *svg_code,
+        const GString *command,
+        const char *workspace,
+        GString **png){
 
-    if (!chtempdir(svgfilepath)){
-        returnval = FALSE;
-        goto out;
-    }
+    gboolean returnval = TRUE;
+    GString *svg;
+    gchar *unlinked;
 
-    if (!(svgfile = fopen(svgfilepath->str, "w"))){
-        returnval = FALSE;
-        goto out;
-    }
+    char * const convert[] = {
+        "convert", "-trim",
+        "-density", "300",
+        "svg:-", "png:-", NULL
+    };
+
+    if ((unlinked = unlink_svg(svg_code)) == NULL)
+        return FALSE;
+    svg = g_string_new(unlinked);
+    g_free(unlinked);
 
 #ifdef DEBUG
-    printf("Transcript file: %s\n", svgfilepath->str);
+    printf("Svg code: %s\n", svg->str);
 #endif
 
-    /* Generate svg file */
-    fprintf(svgfile, "%s", svg_code->str);
-    fclose(svgfile);
-
-    if (render_svg_to_png(pngfilepath, svgfilepath) == TRUE){
-        *filename_png = pngfilepath;
-    } else {
-        purple_debug_info("PiFo",
+    if (!run_png_filter(workspace, convert, svg, png)){
+        pifo_debug_info("PiFo",
                           "Image creation exited with failure\n");
         returnval = FALSE;
-        g_string_free(pngfilepath, TRUE);
-        *filename_png = NULL;
     }
 
-out:
-    unlink(svgfilepath->str);
-
-    g_string_free(svgfilepath, TRUE);
+    g_string_free(svg, TRUE);
 
     return returnval;
-    return TRUE;
 }
 
-gboolean generate_tikz_png(const GString *tikz_code,
-        const GString *command,
-        GString **filename_png){
+/* Everything inside [options] of the picture, nested ones included */
+static GString *tikz_options(const GString *tikz_code){
+    GString *options = g_string_new(NULL);
+    int depth = 0;
+    gsize i;
 
-    FILE *tikz_texfile;
-    gboolean returnval = TRUE;
+    for (i=0; i<tikz_code->len; i++){
+        if (tikz_code->str[i] == '[' && depth++ == 0){
+            g_string_append_c(options, ',');
+            continue;
+        }
+        if (tikz_code->str[i] == ']' && depth > 0 && --depth == 0)
+            continue;
+        if (depth > 0)
+            g_string_append_c(options, tikz_code->str[i]);
+    }
 
-    GString *texfilepath, *pdffilepath,
-            *auxfilepath, *logfilepath,
-            *epsfilepath, *pngfilepath;
+    return options;
+}
 
-    GString *tmpfilepath;
-    tmpfilepath = get_unique_tmppath();
+static gboolean tikz_matches(const char *text, const char * const *patterns){
+    for (; *patterns != NULL; patterns++){
+        if (strstr(text, *patterns))
+            return TRUE;
+    }
 
-    epsfilepath = g_string_new(tmpfilepath->str);
-    texfilepath = g_string_new(tmpfilepath->str);
-    pdffilepath = g_string_new(tmpfilepath->str);
-    pngfilepath = g_string_new(tmpfilepath->str);
-    auxfilepath = g_string_new(tmpfilepath->str);
-    logfilepath = g_string_new(tmpfilepath->str);
+    return FALSE;
+}
 
-    g_string_free(tmpfilepath, TRUE);
+/* Guesses which libraries the picture needs */
+static guint64 tikz_needed_libraries(const GString *tikz_code){
+    GString *options = tikz_options(tikz_code);
+    guint64 mask = 0;
+    int i;
 
-    g_string_append(epsfilepath, ".eps");
-    g_string_append(texfilepath, ".tex");
-    g_string_append(pdffilepath, ".pdf");
-    g_string_append(pngfilepath, ".png");
-    g_string_append(logfilepath, ".log");
-    g_string_append(auxfilepath, ".aux");
+    for (i=0; i<G_N_ELEMENTS(tikz_libraries); i++){
+        if (tikz_matches(tikz_code->str, tikz_libraries[i].code)
+                || tikz_matches(options->str, tikz_libraries[i].options))
+            mask |= G_GUINT64_CONSTANT(1) << i;
+    }
 
-    purple_debug_info("PiFo",
-                      "Using [%s] as latex-tikz file\n",
-                      texfilepath->str);
+    g_string_free(options, TRUE);
 
-    if (!chtempdir(texfilepath)){
-        returnval = FALSE;
-        goto out;
+    return mask;
+}
+
+/* Builds the \usetikzlibrary line for the picture and names the
+ * format it can be compiled with, if any */
+static gchar *tikz_libraries_for(const GString *tikz_code, gchar **name){
+    guint64 needed = tikz_needed_libraries(tikz_code);
+    GString *names;
+    gchar *line;
+    int best = -1, i;
+
+    for (i=0; i<TIKZ_VARIANTS; i++){
+        if ((needed & ~tikz_variant_masks[i]) == 0
+                && (best == -1 || strlen(tikz_variants[i])
+                    < strlen(tikz_variants[best])))
+            best = i;
     }
 
-    if (!(tikz_texfile = fopen(texfilepath->str, "w"))){
-        returnval = FALSE;
-        goto out;
+    if (best != -1){
+        *name = g_strdup_printf("tikz%d", best);
+        needed = tikz_variant_masks[best];
+    } else {
+        *name = NULL;
+    }
+
+    if (needed == 0)
+        return g_strdup("");
+
+    names = g_string_new(NULL);
+    for (i=0; i<G_N_ELEMENTS(tikz_libraries); i++){
+        if (needed & (G_GUINT64_CONSTANT(1) << i)){
+            g_string_append_printf(names, "%s%s",
+                    names->len ? "," : "", tikz_libraries[i].name);
+        }
     }
 
+    line = g_strdup_printf(LATEX_TIKZ_LIBRARIES, names->str);
+    g_string_free(names, TRUE);
+
+    return line;
+}
+
+static gboolean compile_tikz(const char *workspace, const char *name,
+                             const char *libraries, const char *body,
+                             GString **png){
+    gboolean returnval = TRUE;
+    gchar *preamble, *format = NULL;
+    GString *source = g_string_new(NULL);
+
+    gchar *tmpfilepath = g_build_filename(workspace,
+            LATEX_JOBNAME ".pdf", NULL);
+    GString *pdffilepath = g_string_new(tmpfilepath);
+
+    g_free(tmpfilepath);
+
+    preamble = g_strdup_printf(LATEX_TIKZ_PREAMBLE, libraries);
+
+    pifo_debug_info("PiFo",
+                      "Compiling latex-tikz into [%s] with [%s]\n",
+                      pdffilepath->str, libraries);
+
 #ifdef DEBUG
-    printf("Transcript_file: " LATEX_TIKZ_TEMPLATE "\n",
-            tikz_code->str);
+    printf("Transcript_file: %s%s\n", preamble, body);
 #endif
 
-    /* Generate latex template file */
-    fprintf(tikz_texfile, LATEX_TIKZ_TEMPLATE, tikz_code->str);
-   fclose(tikz_texfile);
+    /* Generate latex template */
+    format = write_template(source, name, "pdflatex",
+            preamble, body);
 
-   if (render_latex_pdf_to_png(pngfilepath,
-               texfilepath, epsfilepath,
-               pdffilepath) == TRUE){
-       *filename_png = pngfilepath;
-   } else {
-       purple_debug_info("PiFo",
+   if (!render_latex_pdf_to_png(workspace, source, pdffilepath,
+               format, body, png)){
+       pifo_debug_info("PiFo",
                          "Image creation exited with failure\n");
        returnval = FALSE;
-       g_string_free(pngfilepath, TRUE);
-       *filename_png = NULL;
    }
 
-out:
-   unlink(texfilepath->str);
-   unlink(pdffilepath->str);
-   unlink(auxfilepath->str);
-   unlink(logfilepath->str);
-   unlink(epsfilepath->str);
-
-   g_string_free(epsfilepath, TRUE);
-   g_string_free(texfilepath, TRUE);
-   g_string_free(auxfilepath, TRUE);
-   g_string_free(logfilepath, TRUE);
    g_string_free(pdffilepath, TRUE);
+   g_string_free(source, TRUE);
+
+   g_free(preamble);
+   g_free(format);
 
    return returnval;
-   return TRUE;
 }
 
-gboolean render_latex(const GString *pngfilepath,
-                     const GString *texfilepath, const GString *dvifilepath){
-   gboolean exec_ok;
-    /* Make sure that latex cannot do shell escape, even
-     * if the local default config says so! */
-    char * const latexopts[] = {
-        "latex",
-        "--no-shell-escape",
-        "--interaction=nonstopmode",
-        texfilepath->str, NULL
+/* Whether the log of the last compile says that some key, style or
+ * shape is unknown, which is what a library that was not loaded
+ * looks like */
+static gboolean tikz_missed_library(const char *workspace){
+    static const char * const symptoms[] = {
+        "I do not know the key",
+        "Unknown shape",
+        "undefined style",
+        "Unknown arrow tip kind"
     };
+    gchar *logpath = g_build_filename(workspace, LATEX_JOBNAME ".log", NULL);
+    gchar *log;
+    gboolean missed = FALSE;
+    int i;
+
+    if (g_file_get_contents(logpath, &log, NULL, NULL)){
+        for (i=0; i<G_N_ELEMENTS(symptoms) && !missed; i++)
+            missed = strstr(log, symptoms[i]) != NULL;
+        g_free(log);
+    }
+
+    g_free(logpath);
+
+    return missed;
+}
+
+gboolean generate_tikz_png(const GString *tikz_code,
+        const GString *command,
+        const char *workspace,
+        GString **png){
+
+    gboolean returnval;
+    gchar *body, *name, *libraries;
+
+    body = g_strdup_printf(LATEX_TIKZ_BODY, tikz_code->str);
+    libraries = tikz_libraries_for(tikz_code, &name);
+
+    returnval = compile_tikz(workspace, name, libraries, body,
+            png);
+
+    /* Maybe the guess missed a library. Anything else, from a
+     * typo to a picture that ran out of time, would fail again */
+    if (!returnval && !pifo_spawn_peek_timed_out()
+            && tikz_missed_library(workspace)){
+        g_free(libraries);
+        libraries = g_strdup_printf(LATEX_TIKZ_LIBRARIES,
+                LATEX_TIKZ_ALL_LIBRARIES);
+        returnval = compile_tikz(workspace, "tikz-all", libraries, body,
+                png);
+    }
+
+    g_free(body);
+    g_free(name);
+    g_free(libraries);
+
+    return returnval;
+}
+
+gboolean render_latex(const char *workspace, const GString *source,
+                     const char *format, const char *body, GString **png){
+   gboolean exec_ok;
+   int exitcode;
+   GString *texfilepath, *dvifilepath,
+       *pngfilepath, *auxfilepath, *logfilepath;
 
+    setup_files(workspace, &texfilepath, &dvifilepath,
+                &pngfilepath, &auxfilepath, &logfilepath);
+
+    /* dvipng cannot write to stdout, its png is read back */
     char * const dvipngopts[] = {
         "dvipng", "-Q", "10", "-T",
         "tight", "--follow", "-o",
@@ -537,11 +1769,21 @@ gboolean render_latex(const GString *pngfilepath,
     };
 
     /* Start Latex and dvipng */
-    exec_ok = (execute("latex", latexopts) == 0) &&
-        (execute("dvipng", dvipngopts) == 0);
+    exitcode = compile_document(workspace, "latex", format, source,
+            body, "dvi", dvifilepath, NULL);
+
+    exec_ok = (exitcode == 0) &&
+        (execute(workspace, "dvipng", dvipngopts) == 0) &&
+        (*png = read_png(pngfilepath->str)) != NULL;
+
+    g_string_free(texfilepath, TRUE);
+    g_string_free(dvifilepath, TRUE);
+    g_string_free(pngfilepath, TRUE);
+    g_string_free(auxfilepath, TRUE);
+    g_string_free(logfilepath, TRUE);
 
     if (!exec_ok){
-        purple_debug_info("LaTeX",
+        pifo_debug_info("LaTeX",
                           "Could not render latex string!\n");
         return FALSE;
     }
@@ -551,169 +1793,88 @@ gboolean render_latex(const GString *pngfilepath,
 
 gboolean generate_latex_formula(const GString *formula,
                                 const GString *command,
-                                GString **filename_png){
-    FILE *transcript_file;
+                                const char *workspace,
+                                GString **png){
     gboolean returnval = TRUE;
+    gchar *preamble, *body, *format = NULL;
+    GString *source = g_string_new(NULL);
 
     GString *fgcolor = fgcolor_as_string(),
         *bgcolor = bgcolor_as_string();
 
-    GString *texfilepath, *dvifilepath,
-        *pngfilepath, *auxfilepath, *logfilepath;
-
-    setup_files(&texfilepath, &dvifilepath,
-                &pngfilepath, &auxfilepath, &logfilepath);
+    preamble = g_strdup_printf(LATEX_MATH_PREAMBLE,
+            fgcolor->str, bgcolor->str);
+    body = g_strdup_printf(LATEX_MATH_BODY, formula->str);
 
-    if (!chtempdir(texfilepath)){
-        returnval = FALSE;
-        goto out;
-    }
+    /* Generate latex template */
+    format = write_template(source, "math", "latex",
+            preamble, body);
 
-    if (!(transcript_file = fopen(texfilepath->str, "w"))){
-        purple_notify_error(me, "LaTeX",
-                            "Error while trying to transcript LaTeX!",
-                            "Error opening file!");
-        returnval = FALSE;
-        goto out;
-    }
-
-    /* Generate latex template file */
-    fprintf(transcript_file, LATEX_MATH_TEMPLATE,
-            fgcolor->str, bgcolor->str, formula->str);
-    fclose(transcript_file);
-
-
-    if (render_latex(pngfilepath, texfilepath, dvifilepath) == TRUE){
-        *filename_png = pngfilepath;
-    } else {
-        purple_debug_info("LaTeX",
+    if (!render_latex(workspace, source, format, body, png)){
+        pifo_debug_info("LaTeX",
                           "Image creation exited with failure status\n");
         returnval = FALSE;
-        g_string_free(pngfilepath, TRUE);
     }
 
-    goto out;
-
- out:
-    unlink(texfilepath->str);
-    unlink(dvifilepath->str);
-    unlink(auxfilepath->str);
-    unlink(logfilepath->str);
-
-    g_string_free(texfilepath, TRUE);
-    g_string_free(auxfilepath, TRUE);
-    g_string_free(logfilepath, TRUE);
-    g_string_free(dvifilepath, TRUE);
+    g_string_free(source, TRUE);
+    g_free(preamble);
+    g_free(body);
+    g_free(format);
 
     return returnval;
 }
 
-gboolean render_markdown (const GString *markdownfilepath,
-                          const GString *texfilepath){
-    g_assert (markdownfilepath != NULL);
-    g_assert (texfilepath != NULL);
+/* pandoc reads the markdown from stdin and writes the latex
+ * document to stdout */
+gboolean render_markdown (const char *workspace,
+                          const GString *markdown,
+                          GString **tex){
+    g_assert (markdown != NULL);
+    g_assert (tex != NULL);
 
-    //  pandoc finds the right in/output types
-    //  based on the file suffix
     char * const pandoc_options[] = {
         "pandoc",
-        "--self-contained",
-        markdownfilepath->str,
-        "-o",
-        texfilepath->str,
+        "--from=markdown",
+        "--to=latex",
+        "--standalone",
         NULL
     };
 
-    return execute("pandoc", pandoc_options) == 0;
+    return execute_pipe(workspace, "pandoc", pandoc_options,
+            markdown, tex) == 0;
 }
 
 gboolean generate_markdown(const GString *markdown_text,
                           const GString *command,
-                          GString **filename_png){
+                          const char *workspace,
+                          GString **png){
     g_assert (markdown_text != NULL);
     g_assert (command != NULL);
-    g_assert (*filename_png != NULL);
-
-    // file to hold markdown_text
-    FILE *markdownfile = NULL;
 
     gboolean everything_ok = TRUE;
-    gboolean conversion_to_tex_worked = FALSE;
-    gboolean conversion_to_png_worked = FALSE;
+    GString *markdown, *tex = NULL;
 
-    // latex files
-    GString *texfilepath, *dvifilepath,
-        *pngfilepath, *auxfilepath, *logfilepath,
-        // pandoc files
-        *tmpfilepath, *markdownfilepath = NULL;
-
-    // TODO: should preapre a list of paths
-    setup_files(&texfilepath, &dvifilepath,
-                &pngfilepath, &auxfilepath, &logfilepath);
-
-    tmpfilepath = get_unique_tmppath();
-    markdownfilepath = g_string_new(tmpfilepath->str);
-    g_string_append(markdownfilepath, ".md");
-
-    #ifdef DEBUG
-    printf ("pandoc temp files: %s %s %s %s %s %s %s",
-            texfilepath->str, dvifilepath->str, pngfilepath->str,
-            auxfilepath->str, logfilepath->str,
-            markdownfilepath->str);
-    #endif
-
-    if (!chtempdir(texfilepath)){
-        everything_ok = FALSE;
-        goto cleanup;
-    }
-
-    if (!(markdownfile = fopen(markdownfilepath->str, "w"))){
-        purple_notify_error(me, "Pandoc",
-                            "Error while trying to convert via pandoc!",
-                            "Error opening file!");
-        everything_ok = FALSE;
-        goto cleanup;
-    }
-
-    /* Generate markdown file */
-    // WORKAROUND: append this to surpress page numbering
+    // WORKAROUND: prepend this to surpress page numbering
     //  because the resulting png would be huge
-    fprintf(markdownfile, "\\pagenumbering{gobble}\n");
-    fprintf(markdownfile, markdown_text->str);
-    fclose(markdownfile);
-
-    conversion_to_tex_worked = render_markdown (markdownfilepath, texfilepath);
+    markdown = g_string_new("\\pagenumbering{gobble}\n");
+    g_string_append_len(markdown, markdown_text->str, markdown_text->len);
 
-    if (conversion_to_tex_worked){
-        conversion_to_png_worked =
-            render_latex(pngfilepath, texfilepath, dvifilepath);
-    } else {
+    if (!render_markdown(workspace, markdown, &tex)){
         everything_ok = FALSE;
         goto cleanup;
     }
 
-    if (conversion_to_png_worked){
-        *filename_png = pngfilepath;
-    } else {
-        purple_debug_info("Pandoc",
+    if (!render_latex(workspace, tex, NULL, NULL, png)){
+        pifo_debug_info("Pandoc",
                           "Image creation exited with failure status\n");
         everything_ok = FALSE;
-        g_string_free(pngfilepath, TRUE);
         goto cleanup;
     }
 
  cleanup:
-    unlink(texfilepath->str);
-    unlink(dvifilepath->str);
-    unlink(auxfilepath->str);
-    unlink(logfilepath->str);
-    unlink(markdownfilepath->str);
-
-    g_string_free(texfilepath, TRUE);
-    g_string_free(auxfilepath, TRUE);
-    g_string_free(logfilepath, TRUE);
-    g_string_free(dvifilepath, TRUE);
-    g_string_free(markdownfilepath, TRUE);
+    g_string_free(markdown, TRUE);
+    if (tex != NULL)
+        g_string_free(tex, TRUE);
 
     return everything_ok;
 }
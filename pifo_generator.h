@@ -3,68 +3,136 @@
 
 #include "pifo.h"
 
+/* Renders snippet with the tools in workspace and returns the
+ * png in png. Tools get their input over stdin and hand the image
+ * back over stdout where they can, so the workspace only holds
+ * what a tool cannot stream */
+typedef gboolean (*backend_handler)(const GString *snippet,
+        const GString *command,
+        const char *workspace,
+        GString **png);
+
+/* What the engine may do with a backend */
+/* The same snippet always gives the same image */
+#define PIFO_BACKEND_CACHEABLE  (1 << 0)
+/* Snippets of the same batch can be compiled in one run */
+#define PIFO_BACKEND_BATCHABLE  (1 << 1)
+/* May run in several render threads at once */
+#define PIFO_BACKEND_THREADSAFE (1 << 2)
+/* The image depends on the conversation colors */
+#define PIFO_BACKEND_COLORED    (1 << 3)
+
+/* Roughly how long a render takes. Cheaper ones are started
+ * first, so a formula does not wait for a tikz picture */
+enum pifo_cost {
+    PIFO_COST_CHEAP,
+    PIFO_COST_MODERATE,
+    PIFO_COST_EXPENSIVE
+};
+
 struct mapping {
     const char *command;
-    gboolean (*handler)(const GString *string,
-            const GString *command,
-            void **returnval);
+    backend_handler handler;
+    /* Template the snippet gets embedded into, if any */
+    const char *template;
+    /* Batch the snippets are compiled in, "math" or "listing" */
+    const char *batch;
+    int flags;
+    enum pifo_cost cost;
+    /* Renders straight into memory, without any files or tools.
+     * May return NULL to fall back to the handler */
+    GString *(*render)(const GString *string, const GString *command);
 };
 
-gboolean setup_files(GString **tex,
+/* All generators write their files into workspace, a directory
+ * of their own the tools are run in (see pifo_workspace.c) */
+gboolean setup_files(const char *workspace, GString **tex,
        GString **dvi, GString **png,
        GString **aux, GString **log);
 
 gboolean generate_svg_png(const GString *svg_code,
-        const GString *command, GString **filename_png);
+        const GString *command, const char *workspace,
+        GString **png);
 
 gboolean generate_latex_listing(const GString *listing,
-        const GString *language, GString **filename);
+        const GString *language, const char *workspace,
+        GString **png);
 
 gboolean generate_graphviz_png(const GString *dotcode,
-        const GString *command,
-        GString **filename);
+        const GString *command, const char *workspace,
+        GString **png);
+
+#ifdef HAVE_LIBRSVG
+GString *render_svg_png(const GString *svg_code,
+        const GString *command);
+#endif
+
+#ifdef HAVE_LIBGVC
+GString *render_graphviz_png(const GString *dotcode,
+        const GString *command);
+#endif
 
 gboolean generate_latex_formula(const GString *formula,
-        const GString *command,
-        GString **filename_png);
+        const GString *command, const char *workspace,
+        GString **png);
 
-gboolean render_latex(const GString *pngfilepath,
-        const GString *texfilepath, const GString *dvifilepath);
+gboolean render_latex(const char *workspace, const GString *source,
+        const char *format, const char *body, GString **png);
 
 gboolean generate_markdown(const GString *markdown_text,
                            const GString *command,
-                           GString **filename_png);
+                           const char *workspace,
+                           GString **png);
 
-gboolean render_markdown (const GString *markdownfilepath,
-                          const GString *texfilepath);
+gboolean render_markdown (const char *workspace,
+                          const GString *markdown,
+                          GString **tex);
 
-gboolean render_latex_pdf_to_png(const GString *pngfilepath, 
-        const GString *texfilepath, const GString *epsfilepath,
-        const GString *pdffilepath);
+gboolean render_latex_pdf_to_png(const char *workspace,
+        const GString *source, const GString *pdffilepath,
+        const char *format, const char *body, GString **png);
 
 gboolean generate_tikz_png(const GString *tikz_code,
-        const GString *command,
-        GString **filename_png);
-
-gboolean chtempdir(const GString *path);
+        const GString *command, const char *workspace,
+        GString **png);
+
+void pifo_generator_init(void *handle);
+void pifo_generator_uninit(void *handle);
+gboolean pifo_generator_register(const struct mapping *backend);
+void pifo_generator_unregister(const struct mapping *backend);
+gboolean find_backend(const GString *command, struct mapping *backend);
+gboolean is_command(const GString *command);
+GString *lookup_render(const GString *command, const GString *snippet);
 GString *dispatch_command(const GString *command, const GString *snippet);
+const char *batch_kind(const GString *command);
+enum pifo_cost backend_cost(const GString *command);
+void dispatch_batch(const GPtrArray *commands, const GPtrArray *snippets,
+                    GString **results, gboolean *timed_out);
 GString *fgcolor_as_string(void);
 GString *bgcolor_as_string(void);
+gchar *renderer_versions(void);
 
-#define LATEX_MATH_TEMPLATE \
+/* Each template is split into the preamble, which gets dumped
+ * into a format file (see pifo_format.c), and the body that is
+ * compiled for every single snippet */
+#define LATEX_MATH_PREAMBLE \
     "\\documentclass[12pt]{article}\\usepackage{color}"  \
     "\\usepackage[dvips]{graphicx}\\usepackage{amsmath}" \
     "\\usepackage{amssymb}\\usepackage[utf8]{inputenc}"  \
     "\\pagestyle{empty}" \
     "\\definecolor{fgcolor}{RGB}" "{%s}" \
-    "\\definecolor{bgcolor}{RGB}" "{%s}" \
+    "\\definecolor{bgcolor}{RGB}" "{%s}"
+
+#define LATEX_MATH_BODY \
     "\\begin{document}\\pagecolor{bgcolor}\\color{fgcolor}" \
     "\\begin{gather*}" \
         "%s" \
     "\\end{gather*}" \
     "\\end{document}"
 
-#define LATEX_LST_TEMPLATE \
+#define LATEX_MATH_TEMPLATE LATEX_MATH_PREAMBLE LATEX_MATH_BODY
+
+#define LATEX_LST_PREAMBLE \
     "\\documentclass[12pt]{article}" \
     "\\usepackage{color}" \
     "\\usepackage{listings}" \
@@ -75,7 +143,6 @@ GString *bgcolor_as_string(void);
     "\\lstset{tabsize=%s}"\
     "\\lstset{breaklines=false,breakatwhitespace=false}"\
     "\\lstset{frame=%s}" \
-    "\\lstset{language=%s}" \
     "\\definecolor{comment}{RGB}{102,0,102}" \
     "\\definecolor{keyword}{RGB}{0,100,100}" \
     "\\definecolor{identifier}{RGB}{0,11,0}" \
@@ -85,8 +152,11 @@ GString *bgcolor_as_string(void);
     "    identifierstyle=\\color{identifier}," \
     "    keywordstyle=\\color{keyword}," \
     "    commentstyle=\\color{comment}," \
-    "    stringstyle=\\itshape\\color{string}}" \
+    "    stringstyle=\\itshape\\color{string}}"
+
+#define LATEX_LST_BODY \
     "\\begin{document}" \
+    "\\lstset{language=%s}" \
     "\\pagenumbering{gobble}" \
     "\\pagecolor{bgcolor}\\color{fgcolor} " \
     "\\begin{lstlisting}\n" \
@@ -94,11 +164,60 @@ GString *bgcolor_as_string(void);
     "\n\\end{lstlisting}" \
     "\\end{document}"
 
-#define LATEX_TIKZ_TEMPLATE \
+#define LATEX_LST_TEMPLATE LATEX_LST_PREAMBLE LATEX_LST_BODY
+
+/* Batches put every snippet on its own page of one document. The
+ * marker in front of each page tells which snippet caused the
+ * errors that follow it in the log */
+#define BATCH_MARK "PIFO-PAGE "
+
+#define LATEX_MATH_BATCH_BEGIN \
+    "\\begin{document}\\pagecolor{bgcolor}\\color{fgcolor}\n"
+
+#define LATEX_MATH_PAGE \
+    "\\typeout{" BATCH_MARK "%d}" \
+    "\\begin{gather*}" \
+        "%s" \
+    "\\end{gather*}" \
+    "\\newpage\n"
+
+#define LATEX_LST_BATCH_BEGIN \
+    "\\begin{document}" \
+    "\\pagenumbering{gobble}" \
+    "\\pagecolor{bgcolor}\\color{fgcolor}\n"
+
+#define LATEX_LST_PAGE \
+    "\\typeout{" BATCH_MARK "%d}" \
+    "\\lstset{language=%s}" \
+    "\\begin{lstlisting}\n" \
+        "%s" \
+    "\n\\end{lstlisting}" \
+    "\\newpage\n"
+
+#define LATEX_BATCH_END \
+    "\\typeout{" BATCH_MARK "end}" \
+    "\\end{document}"
+
+/* The %s is the \usetikzlibrary line, see tikz_libraries */
+#define LATEX_TIKZ_PREAMBLE \
     "\\documentclass{article}" \
     "\\usepackage{color}" \
     "\\usepackage{tikz}" \
-    "\\usetikzlibrary{babel,scopes,intersections,calc,bending,positioning,quotes,graphs,fadings,decorations,angles,automata,babel,backgrounds,calc,calendar,chains,circuits,er,external,external,external,fadings,fadings,external,fadings,fit,fixedpointarithmetic,fpu,lindenmayersystems,math,matrix,mindmap,folding,patterns,petri,plothandlers,plotmarks,profiler,shadings,shadows,spy,topaths,through,trees,turtle,datavisualization,intersections,curvilinear}" \
+    "%s"
+
+#define LATEX_TIKZ_LIBRARIES "\\usetikzlibrary{%s}"
+
+/* What every picture used to get, for pictures that
+ * fail with only the libraries they seem to need */
+#define LATEX_TIKZ_ALL_LIBRARIES \
+    "babel,scopes,intersections,calc,bending,positioning,quotes," \
+    "graphs,fadings,decorations,angles,automata,backgrounds," \
+    "calendar,chains,circuits,er,external,fit,fixedpointarithmetic," \
+    "fpu,lindenmayersystems,math,matrix,mindmap,folding,patterns," \
+    "petri,plothandlers,plotmarks,profiler,shadings,shadows,spy," \
+    "topaths,through,trees,turtle,datavisualization,curvilinear"
+
+#define LATEX_TIKZ_BODY \
     "\\begin{document}" \
     "\\pagenumbering{gobble}" \
     "\\begin{tikzpicture}" \
@@ -106,4 +225,6 @@ GString *bgcolor_as_string(void);
     "\\end{tikzpicture}" \
     "\\end{document}"
 
+#define LATEX_TIKZ_TEMPLATE LATEX_TIKZ_PREAMBLE LATEX_TIKZ_BODY
+
 #endif
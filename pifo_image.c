@@ -0,0 +1,429 @@
+#include "pifo_image.h"
+#include "pifo.h"
+
+#include <string.h>
+
+#ifdef HAVE_LIBPNG
+#include <png.h>
+#endif
+
+static guint32 pixel_at(const guchar *pixels, int stride, int x, int y){
+    return ((const guint32 *) (pixels + (gsize) y * stride))[x];
+}
+
+static gboolean row_is(const guchar *pixels, int stride, int y,
+        int from, int to, guint32 background){
+    int x;
+
+    for (x=from; x<to; x++){
+        if (pixel_at(pixels, stride, x, y) != background)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean column_is(const guchar *pixels, int stride, int x,
+        int from, int to, guint32 background){
+    int y;
+
+    for (y=from; y<to; y++){
+        if (pixel_at(pixels, stride, x, y) != background)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Finds the smallest rectangle holding everything that is not the
+ * background, which is taken from the top left corner, like
+ * convert -trim does. Returns FALSE if the image is nothing but
+ * background, in which case the rectangle is left alone. */
+gboolean pifo_image_trim(const guchar *pixels, int width, int height,
+        int stride, int *x, int *y, int *trimmed_width,
+        int *trimmed_height){
+    guint32 background;
+    int top = 0, bottom = height, left = 0, right = width;
+
+    if (width <= 0 || height <= 0)
+        return FALSE;
+
+    background = pixel_at(pixels, stride, 0, 0);
+
+    while (top < bottom
+            && row_is(pixels, stride, top, 0, width, background))
+        top++;
+
+    if (top == bottom)
+        return FALSE;
+
+    while (row_is(pixels, stride, bottom - 1, 0, width, background))
+        bottom--;
+
+    while (column_is(pixels, stride, left, top, bottom, background))
+        left++;
+
+    while (column_is(pixels, stride, right - 1, top, bottom, background))
+        right--;
+
+    *x = left;
+    *y = top;
+    *trimmed_width = right - left;
+    *trimmed_height = bottom - top;
+
+    return TRUE;
+}
+
+static const guchar png_signature[8] = {
+    0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+};
+
+/* Length, type and crc around the data of every chunk */
+#define CHUNK_OVERHEAD 12
+
+static guint32 chunk_length(const guchar *chunk){
+    return (guint32) chunk[0] << 24 | (guint32) chunk[1] << 16
+        | (guint32) chunk[2] << 8 | chunk[3];
+}
+
+/* Chunks that only carry text and timestamps */
+static gboolean is_metadata(const guchar *chunk){
+    return !memcmp(chunk + 4, "tIME", 4) || !memcmp(chunk + 4, "tEXt", 4)
+        || !memcmp(chunk + 4, "zTXt", 4) || !memcmp(chunk + 4, "iTXt", 4);
+}
+
+/* Removes the metadata chunks from a png. convert writes the time
+ * of the render in there, so two renders of the same snippet would
+ * never be byte identical. Works in place and returns the new size.
+ * Anything that does not look like a png is left alone. */
+gsize pifo_image_strip_png(guchar *data, gsize size){
+    gsize in, out;
+    guint32 length;
+
+    if (size < sizeof(png_signature)
+            || memcmp(data, png_signature, sizeof(png_signature)))
+        return size;
+
+    /* Only touch it if every chunk is where it should be */
+    for (in = sizeof(png_signature); in < size;
+            in += chunk_length(data + in) + CHUNK_OVERHEAD){
+        if (size - in < CHUNK_OVERHEAD
+                || chunk_length(data + in) > size - in - CHUNK_OVERHEAD)
+            return size;
+    }
+
+    for (in = out = sizeof(png_signature); in < size;
+            in += length + CHUNK_OVERHEAD){
+        length = chunk_length(data + in);
+        if (is_metadata(data + in))
+            continue;
+
+        if (in != out)
+            memmove(data + out, data + in, length + CHUNK_OVERHEAD);
+        out += length + CHUNK_OVERHEAD;
+    }
+
+    return out;
+}
+
+#ifdef HAVE_LIBPNG
+/* Larger images are compressed faster rather than smaller */
+#define THOROUGH_PIXELS_MAX (1024 * 1024)
+
+/* Larger images are kept as rendered */
+#define OPTIMIZE_PIXELS_MAX (4 * 1024 * 1024)
+
+/* Open addressing, with room to spare for 256 colors */
+#define PALETTE_SLOTS 1024
+
+struct palette {
+    guint32 colors[256];
+    int count;
+    guint32 keys[PALETTE_SLOTS];
+    gint16 index[PALETTE_SLOTS];
+};
+
+/* How the image is written, in the cheapest form that holds it */
+struct png_layout {
+    int color_type;
+    int bit_depth;
+    int filters;
+};
+
+static int palette_slot(const struct palette *palette, guint32 color){
+    int slot = (color * 2654435761u) >> 22;
+
+    while (palette->index[slot] != -1 && palette->keys[slot] != color)
+        slot = (slot + 1) & (PALETTE_SLOTS - 1);
+
+    return slot;
+}
+
+/* RGBA bytes in memory, whatever the byte order of the machine */
+static guint32 rgba_at(const guchar *pixels, gsize i){
+    guint32 color;
+
+    memcpy(&color, pixels + 4 * i, 4);
+
+    return color;
+}
+
+/* Collects the colors of the image, gives up once there are more
+ * than 256. Translucent colors go first, so tRNS can be short. */
+static gboolean collect_palette(const guchar *pixels, gsize count,
+        struct palette *palette){
+    guint32 sorted[256];
+    const guchar *rgba;
+    guint32 color;
+    int slot, i, n = 0;
+    gsize pixel;
+
+    palette->count = 0;
+    memset(palette->index, -1, sizeof(palette->index));
+
+    for (pixel=0; pixel<count; pixel++){
+        color = rgba_at(pixels, pixel);
+        slot = palette_slot(palette, color);
+        if (palette->index[slot] != -1)
+            continue;
+
+        if (palette->count == 256)
+            return FALSE;
+
+        palette->keys[slot] = color;
+        palette->index[slot] = palette->count;
+        palette->colors[palette->count++] = color;
+    }
+
+    for (i=0; i<palette->count; i++){
+        rgba = (const guchar *) &palette->colors[i];
+        if (rgba[3] != 255)
+            sorted[n++] = palette->colors[i];
+    }
+    for (i=0; i<palette->count; i++){
+        rgba = (const guchar *) &palette->colors[i];
+        if (rgba[3] == 255)
+            sorted[n++] = palette->colors[i];
+    }
+
+    for (i=0; i<palette->count; i++){
+        palette->colors[i] = sorted[i];
+        palette->index[palette_slot(palette, sorted[i])] = i;
+    }
+
+    return TRUE;
+}
+
+static void choose_layout(const guchar *pixels, gsize count,
+        struct palette *palette, struct png_layout *layout){
+    gboolean gray = TRUE, opaque = TRUE, indexed;
+    const guchar *p;
+    gsize i;
+
+    for (i=0, p=pixels; i<count && (gray || opaque); i++, p+=4){
+        gray = gray && p[0] == p[1] && p[1] == p[2];
+        opaque = opaque && p[3] == 255;
+    }
+
+    indexed = collect_palette(pixels, count, palette);
+
+    /* Gray compresses better than palette indices, unless the
+     * palette is small enough to pack several pixels in a byte */
+    if (indexed && !(gray && opaque && palette->count > 16)){
+        layout->color_type = PNG_COLOR_TYPE_PALETTE;
+        layout->bit_depth = palette->count <= 2 ? 1
+            : palette->count <= 4 ? 2 : palette->count <= 16 ? 4 : 8;
+    } else if (gray){
+        layout->color_type = opaque ? PNG_COLOR_TYPE_GRAY
+            : PNG_COLOR_TYPE_GRAY_ALPHA;
+        layout->bit_depth = 8;
+    } else {
+        layout->color_type = opaque ? PNG_COLOR_TYPE_RGB
+            : PNG_COLOR_TYPE_RGB_ALPHA;
+        layout->bit_depth = 8;
+    }
+
+    /* Filters only pay off on real samples */
+    layout->filters = layout->color_type == PNG_COLOR_TYPE_PALETTE
+        ? PNG_FILTER_NONE : PNG_ALL_FILTERS;
+}
+
+/* Converts one row of RGBA pixels into the layout */
+static void pack_row(const guchar *pixels, int width,
+        const struct palette *palette, const struct png_layout *layout,
+        guchar *row){
+    int x, bits, shift;
+
+    switch (layout->color_type){
+        case PNG_COLOR_TYPE_PALETTE:
+            bits = layout->bit_depth;
+            memset(row, 0, (width * bits + 7) / 8);
+            for (x=0; x<width; x++){
+                shift = 8 - bits - (x * bits) % 8;
+                row[x * bits / 8] |= palette->index[
+                    palette_slot(palette, rgba_at(pixels, x))] << shift;
+            }
+            break;
+        case PNG_COLOR_TYPE_GRAY:
+            for (x=0; x<width; x++)
+                row[x] = pixels[4 * x];
+            break;
+        case PNG_COLOR_TYPE_GRAY_ALPHA:
+            for (x=0; x<width; x++){
+                row[2 * x] = pixels[4 * x];
+                row[2 * x + 1] = pixels[4 * x + 3];
+            }
+            break;
+        case PNG_COLOR_TYPE_RGB:
+            for (x=0; x<width; x++)
+                memcpy(row + 3 * x, pixels + 4 * x, 3);
+            break;
+        default:
+            memcpy(row, pixels, 4 * width);
+            break;
+    }
+}
+
+static void append_png_data(png_structp png, png_bytep data, png_size_t size){
+    g_string_append_len(png_get_io_ptr(png), (const gchar *) data, size);
+}
+
+static void flush_png_data(png_structp png){
+}
+
+static GString *encode_png(const guchar *pixels, int width, int height,
+        struct palette *palette, const struct png_layout *layout){
+    GString *result = g_string_new(NULL);
+    guchar *row = g_malloc(4 * (gsize) width);
+    png_color colors[256];
+    png_byte alpha[256];
+    png_structp png;
+    png_infop info = NULL;
+    const guchar *rgba;
+    int translucent = 0, i;
+
+    png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (png == NULL || (info = png_create_info_struct(png)) == NULL)
+        goto fail;
+
+    if (setjmp(png_jmpbuf(png)))
+        goto fail;
+
+    png_set_write_fn(png, result, append_png_data, flush_png_data);
+    png_set_IHDR(png, info, width, height, layout->bit_depth,
+            layout->color_type, PNG_INTERLACE_NONE,
+            PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+
+    if (layout->color_type == PNG_COLOR_TYPE_PALETTE){
+        for (i=0; i<palette->count; i++){
+            rgba = (const guchar *) &palette->colors[i];
+            colors[i].red = rgba[0];
+            colors[i].green = rgba[1];
+            colors[i].blue = rgba[2];
+            if ((alpha[i] = rgba[3]) != 255)
+                translucent = i + 1;
+        }
+        png_set_PLTE(png, info, colors, palette->count);
+        if (translucent > 0)
+            png_set_tRNS(png, info, alpha, translucent, NULL);
+    }
+
+    png_set_filter(png, PNG_FILTER_TYPE_BASE, layout->filters);
+    png_set_compression_mem_level(png, 9);
+    png_set_compression_level(png,
+            (gsize) width * height <= THOROUGH_PIXELS_MAX ? 9 : 6);
+
+    png_write_info(png, info);
+    for (i=0; i<height; i++){
+        pack_row(pixels + (gsize) i * width * 4, width, palette, layout, row);
+        png_write_row(png, row);
+    }
+    png_write_end(png, info);
+
+    png_destroy_write_struct(&png, &info);
+    g_free(row);
+
+    return result;
+
+fail:
+    png_destroy_write_struct(&png, info ? &info : NULL);
+    g_free(row);
+    g_string_free(result, TRUE);
+
+    return NULL;
+}
+
+/* Rewrites a png with as few bytes per pixel as it takes, as a
+ * palette or gray image where the colors allow it, and with filters
+ * and compression picked for size. dvipng and convert write plain
+ * RGB(A), even for a formula in two colors. Returns NULL if the
+ * image cannot be made any smaller. */
+GString *pifo_image_optimize_png(const GString *png){
+    png_image image;
+    struct palette *palette;
+    struct png_layout layout;
+    GString *result = NULL;
+    guchar *pixels;
+
+    memset(&image, 0, sizeof(image));
+    image.version = PNG_IMAGE_VERSION;
+
+    if (!png_image_begin_read_from_memory(&image, png->str, png->len))
+        return NULL;
+
+    /* Samples with 16 bits would lose precision */
+    if (image.format & PNG_FORMAT_FLAG_LINEAR){
+        png_image_free(&image);
+        return NULL;
+    }
+
+    if ((gsize) image.width * image.height > OPTIMIZE_PIXELS_MAX){
+        png_image_free(&image);
+        return NULL;
+    }
+
+    image.format = PNG_FORMAT_RGBA;
+    pixels = g_try_malloc(PNG_IMAGE_SIZE(image));
+    if (!pixels){
+        png_image_free(&image);
+        return NULL;
+    }
+    palette = g_new(struct palette, 1);
+
+    if (png_image_finish_read(&image, NULL, pixels, 0, NULL)){
+        choose_layout(pixels, (gsize) image.width * image.height,
+                palette, &layout);
+        result = encode_png(pixels, image.width, image.height,
+                palette, &layout);
+    }
+
+    if (result != NULL && result->len >= png->len){
+        g_string_free(result, TRUE);
+        result = NULL;
+    }
+
+    png_image_free(&image);
+    g_free(palette);
+    g_free(pixels);
+
+    return result;
+}
+#else
+GString *pifo_image_optimize_png(const GString *png){
+    return NULL;
+}
+#endif
+
+/* Bump whenever pifo_image_optimize_png() or pifo_image_trim()
+ * would turn the same input into a different image */
+#define OPTIMIZER_REVISION 1
+
+/* For the disk cache fingerprint */
+gchar *pifo_image_version(void){
+#ifdef HAVE_LIBPNG
+    return g_strdup_printf("optimizer %d libpng %s\n",
+            OPTIMIZER_REVISION, png_get_libpng_ver(NULL));
+#else
+    return g_strdup_printf("optimizer %d\n", OPTIMIZER_REVISION);
+#endif
+}
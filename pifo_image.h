@@ -0,0 +1,20 @@
+#ifndef PIFO_IMAGE
+#define PIFO_IMAGE
+
+#include "pifo.h"
+
+/* Operations on raw pixel buffers of the in-process renderers.
+ * Pixels are 32 bit words (cairo's ARGB32), rows are stride
+ * bytes apart. */
+
+gboolean pifo_image_trim(const guchar *pixels, int width, int height,
+        int stride, int *x, int *y, int *trimmed_width,
+        int *trimmed_height);
+
+/* Operations on encoded png files */
+
+gsize pifo_image_strip_png(guchar *data, gsize size);
+GString *pifo_image_optimize_png(const GString *png);
+gchar *pifo_image_version(void);
+
+#endif
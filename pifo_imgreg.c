@@ -0,0 +1,351 @@
+#include "pifo_imgreg.h"
+#include "pifo_job.h"
+#include "pifo_stats.h"
+#include "pifo.h"
+
+#include <string.h>
+
+struct registered_image {
+    int id;
+    gchar *checksum;
+    guint refs;
+    gsize size;
+};
+
+/* A message showing an image */
+struct image_reference {
+    PurpleConversation *conv;
+    int id;
+    gchar *command;
+    gchar *snippet;
+    /* What the message costs: the png and its decoded pixels */
+    gsize bytes;
+    /* Position in all_references */
+    GList *link;
+};
+
+struct conversation_images {
+    /* struct image_reference, oldest first. Images that got unloaded
+     * or are no longer shown are forgotten */
+    GQueue references;
+    gsize bytes;
+    /* How many were unloaded, for the report */
+    guint unloaded;
+};
+
+/* png checksum -> struct registered_image, which it owns */
+static GHashTable *by_checksum = NULL;
+/* imgstore id -> struct registered_image */
+static GHashTable *by_id = NULL;
+/* Conversation -> struct conversation_images */
+static GHashTable *by_conversation = NULL;
+/* The references of all conversations, oldest first */
+static GQueue all_references = G_QUEUE_INIT;
+static gsize total_bytes = 0;
+
+/* 0 for no limit */
+static gsize conversation_budget = 0;
+static gsize total_budget = 0;
+
+static void free_image(gpointer data){
+    struct registered_image *image = data;
+
+    g_free(image->checksum);
+    g_free(image);
+}
+
+static void free_reference(struct image_reference *reference){
+    g_free(reference->command);
+    g_free(reference->snippet);
+    g_free(reference);
+}
+
+static void free_conversation_images(gpointer data){
+    struct conversation_images *images = data;
+    struct image_reference *reference;
+
+    while ((reference = g_queue_pop_head(&images->references)) != NULL){
+        g_queue_delete_link(&all_references, reference->link);
+        free_reference(reference);
+    }
+    g_free(images);
+}
+
+static void unref_image(int id){
+    struct registered_image *image;
+
+    image = g_hash_table_lookup(by_id, GINT_TO_POINTER(id));
+    if (image == NULL || --image->refs > 0)
+        return;
+
+    purple_debug_info("PiFo",
+            "Dropping image [%d] from the imgstore\n", id);
+
+    purple_imgstore_unref_by_id(id);
+    g_hash_table_remove(by_id, GINT_TO_POINTER(id));
+    g_hash_table_remove(by_checksum, image->checksum);
+}
+
+/* Size of the pixels the png decodes to, from its header */
+static gsize decoded_size(const guchar *data, gsize size){
+    guint32 width, height;
+
+    if (size < 24 || memcmp(data + 12, "IHDR", 4))
+        return 0;
+
+    width = (guint32) data[16] << 24 | (guint32) data[17] << 16
+        | (guint32) data[18] << 8 | data[19];
+    height = (guint32) data[20] << 24 | (guint32) data[21] << 16
+        | (guint32) data[22] << 8 | data[23];
+
+    return (gsize) width * height * 4;
+}
+
+void pifo_imgreg_init(void){
+    by_checksum = g_hash_table_new_full(g_str_hash, g_str_equal,
+            NULL, free_image);
+    by_id = g_hash_table_new(g_direct_hash, g_direct_equal);
+    by_conversation = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+            NULL, free_conversation_images);
+}
+
+/* Drops our references. The conversations still on screen hold
+ * references of their own on the images they show */
+void pifo_imgreg_shutdown(void){
+    GHashTableIter iter;
+    struct registered_image *image;
+
+    g_hash_table_iter_init(&iter, by_checksum);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &image)){
+        purple_imgstore_unref_by_id(image->id);
+    }
+
+    g_hash_table_destroy(by_conversation);
+    g_hash_table_destroy(by_id);
+    g_hash_table_destroy(by_checksum);
+    by_conversation = by_id = by_checksum = NULL;
+    total_bytes = 0;
+}
+
+void pifo_imgreg_set_budgets(gsize conversation_bytes, gsize total_bytes){
+    conversation_budget = conversation_bytes;
+    total_budget = total_bytes;
+}
+
+/* Returns the imgstore id of the png in data, which is stored if
+ * it is not in there yet, and takes a reference on it for the
+ * message in conv that shows it. Takes ownership of data. Returns
+ * 0 if the image could not be stored. */
+int pifo_imgreg_add(PurpleConversation *conv, const char *command,
+        const char *snippet, gchar *data, gsize size){
+    struct registered_image *image;
+    struct conversation_images *images;
+    struct image_reference *reference;
+    gchar *checksum;
+    int id;
+
+    checksum = g_compute_checksum_for_data(G_CHECKSUM_SHA256,
+            (const guchar *) data, size);
+
+    if ((image = g_hash_table_lookup(by_checksum, checksum)) != NULL){
+        g_free(checksum);
+        g_free(data);
+    } else {
+        /* The imgstore takes ownership of data */
+        if ((id = purple_imgstore_add_with_id(data, size, "pifo.png")) == 0){
+            g_free(checksum);
+            return 0;
+        }
+
+        image = g_new0(struct registered_image, 1);
+        image->id = id;
+        image->checksum = checksum;
+        image->size = size + decoded_size((const guchar *) data, size);
+        g_hash_table_insert(by_checksum, image->checksum, image);
+        g_hash_table_insert(by_id, GINT_TO_POINTER(id), image);
+    }
+
+    image->refs++;
+
+    if ((images = g_hash_table_lookup(by_conversation, conv)) == NULL){
+        images = g_new0(struct conversation_images, 1);
+        g_queue_init(&images->references);
+        g_hash_table_insert(by_conversation, conv, images);
+    }
+
+    reference = g_new0(struct image_reference, 1);
+    reference->conv = conv;
+    reference->id = image->id;
+    reference->command = g_strdup(command);
+    reference->snippet = g_strdup(snippet);
+    reference->bytes = image->size;
+
+    g_queue_push_tail(&images->references, reference);
+    g_queue_push_tail(&all_references, reference);
+    reference->link = all_references.tail;
+    images->bytes += reference->bytes;
+    total_bytes += reference->bytes;
+    pifo_stats_gauge(PIFO_GAUGE_IMAGE_BYTES, total_bytes);
+
+    return image->id;
+}
+
+static gboolean over_budget(const struct conversation_images *images){
+    return (conversation_budget > 0 && images->bytes > conversation_budget)
+        || (total_budget > 0 && total_bytes > total_budget);
+}
+
+static gboolean any_over_budget(void){
+    GHashTableIter iter;
+    struct conversation_images *images;
+
+    g_hash_table_iter_init(&iter, by_conversation);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &images)){
+        if (over_budget(images))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* Forgets every reference of the conversation to the image and gives
+ * back what they held. Returns how many there were */
+static guint forget_image(struct conversation_images *images, int id){
+    struct image_reference *reference;
+    GList *link, *next;
+    guint forgotten = 0;
+
+    for (link = images->references.head; link != NULL; link = next){
+        next = link->next;
+        reference = link->data;
+        if (reference->id != id)
+            continue;
+
+        images->bytes -= reference->bytes;
+        total_bytes -= reference->bytes;
+        unref_image(reference->id);
+
+        g_queue_delete_link(&all_references, reference->link);
+        g_queue_delete_link(&images->references, link);
+        free_reference(reference);
+        forgotten++;
+    }
+    pifo_stats_gauge(PIFO_GAUGE_IMAGE_BYTES, total_bytes);
+
+    return forgotten;
+}
+
+/* Unloads an image from every message of the conversation that
+ * shows it, unless one of them is on screen. Images no message
+ * shows anymore are only forgotten */
+static void unload(struct image_reference *reference){
+    struct conversation_images *images;
+    PurpleConversation *conv = reference->conv;
+    int id = reference->id;
+
+    images = g_hash_table_lookup(by_conversation, conv);
+
+    switch (pifo_job_unload_image(conv, id,
+                reference->command, reference->snippet)){
+    case PIFO_UNLOAD_VISIBLE:
+        return;
+    case PIFO_UNLOAD_DONE:
+        purple_debug_info("PiFo",
+                "Unloaded image [%d] of [%s]\n", id, conv->name);
+        images->unloaded += forget_image(images, id);
+        break;
+    case PIFO_UNLOAD_GONE:
+        purple_debug_info("PiFo",
+                "Image [%d] of [%s] is no longer shown\n", id, conv->name);
+        forget_image(images, id);
+        break;
+    }
+}
+
+/* Unloads the oldest images that are off screen until every
+ * conversation, and all of them together, are within budget */
+void pifo_imgreg_enforce_budgets(void){
+    struct conversation_images *images;
+    struct image_reference *reference, *other;
+    GList *link, *next;
+
+    if (by_conversation == NULL || !any_over_budget())
+        return;
+
+    for (link = all_references.head; link != NULL; link = next){
+        reference = link->data;
+
+        /* Unloading drops the other references of the conversation
+         * to the same image too, so the next one is looked for
+         * among the others */
+        for (next = link->next; next != NULL; next = next->next){
+            other = next->data;
+            if (other->conv != reference->conv || other->id != reference->id)
+                break;
+        }
+
+        images = g_hash_table_lookup(by_conversation, reference->conv);
+        if (over_budget(images))
+            unload(reference);
+    }
+}
+
+/* Drops the references of a conversation that is going away */
+void pifo_imgreg_release(PurpleConversation *conv){
+    struct conversation_images *images;
+    struct image_reference *reference;
+    GList *link;
+
+    if (by_conversation == NULL
+            || (images = g_hash_table_lookup(by_conversation, conv)) == NULL)
+        return;
+
+    for (link = images->references.head; link != NULL; link = link->next){
+        reference = link->data;
+        unref_image(reference->id);
+    }
+
+    total_bytes -= images->bytes;
+    g_hash_table_remove(by_conversation, conv);
+    pifo_stats_gauge(PIFO_GAUGE_IMAGE_BYTES, total_bytes);
+}
+
+/* What the images of every conversation take up right now, as
+ * html for purple_notify_formatted() */
+GString *pifo_imgreg_report(void){
+    GString *report = g_string_new(NULL);
+    GHashTableIter iter;
+    PurpleConversation *conv;
+    struct conversation_images *images;
+    struct registered_image *image;
+    gsize stored = 0;
+    gchar *name;
+
+    if (by_conversation == NULL)
+        return report;
+
+    g_hash_table_iter_init(&iter, by_conversation);
+    while (g_hash_table_iter_next(&iter, (gpointer *) &conv,
+                (gpointer *) &images)){
+        name = g_markup_escape_text(conv->name, -1);
+        g_string_append_printf(report,
+                "<b>%s</b>: %u images, %lu KB, %u unloaded<br>",
+                name, g_queue_get_length(&images->references),
+                (unsigned long) images->bytes / 1024, images->unloaded);
+        g_free(name);
+    }
+
+    g_hash_table_iter_init(&iter, by_checksum);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &image)){
+        stored += image->size;
+    }
+
+    g_string_append_printf(report,
+            "<br><b>All conversations</b>: %lu KB of %lu KB allowed<br>"
+            "<b>Distinct images</b>: %u, %lu KB<br>",
+            (unsigned long) total_bytes / 1024,
+            (unsigned long) total_budget / 1024,
+            g_hash_table_size(by_checksum), (unsigned long) stored / 1024);
+
+    return report;
+}
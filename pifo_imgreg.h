@@ -0,0 +1,29 @@
+#ifndef PIFO_IMGREG
+#define PIFO_IMGREG
+
+#include "pifo.h"
+
+/* Rendered images in the imgstore, keyed by a hash over their png
+ * data. An image that is already in there is reused instead of being
+ * stored once more, so a formula seen in twenty conversations takes
+ * up memory only once. Every message showing an image holds a
+ * reference on it for its conversation, which are dropped when the
+ * conversation is closed.
+ *
+ * What the images of a conversation, and all images together, may
+ * take up is bounded. Once there are more, the oldest images that
+ * are not on screen are unloaded: they are replaced by an icon that
+ * renders the snippet again when clicked. Only used from the main
+ * thread. */
+
+void pifo_imgreg_init(void);
+void pifo_imgreg_shutdown(void);
+void pifo_imgreg_set_budgets(gsize conversation_bytes, gsize total_bytes);
+void pifo_imgreg_enforce_budgets(void);
+
+int pifo_imgreg_add(PurpleConversation *conv, const char *command,
+        const char *snippet, gchar *data, gsize size);
+void pifo_imgreg_release(PurpleConversation *conv);
+GString *pifo_imgreg_report(void);
+
+#endif
@@ -0,0 +1,809 @@
+#include "pifo_job.h"
+#include "pifo_generator.h"
+#include "pifo_spawn.h"
+#include "pifo_util.h"
+#include "pifo_imgreg.h"
+#include "pifo_stats.h"
+#include "pifo_trace.h"
+#include "pifo.h"
+
+#include <pidgin/gtkconv.h>
+#include <pidgin/gtkimhtml.h>
+
+#include <string.h>
+
+/* Every job runs in a workspace of its own, so backends may
+ * run side by side, up to one per core */
+#define RENDER_THREADS_MAX 4
+
+/* Snippets of the same template arriving within this window are
+ * compiled together, e.g. a message full of formulas or the
+ * backlog that gets replayed at login */
+#define BATCH_WINDOW_MS 25
+#define BATCH_MAX 64
+
+#define PLACEHOLDER_MIN 16
+#define PLACEHOLDER_MAX 480
+#define OBJECT_CHAR "\xef\xbf\xbc"
+
+static GThreadPool *render_pool = NULL;
+static GAsyncQueue *finished_jobs = NULL;
+static guint drain_source = 0;
+static guint next_job_id = 1;
+/* Jobs submitted that no render thread took yet */
+static gint queued_jobs = 0;
+/* Set on shutdown, render threads then hand queued jobs back
+ * without rendering them */
+static gint cancelled = 0;
+G_LOCK_DEFINE_STATIC(drain_lock);
+
+/* Batch kind -> GPtrArray of jobs waiting for the window to close.
+ * Only touched from the main thread */
+static GHashTable *pending_batches = NULL;
+static guint flush_source = 0;
+/* Enforces the image budgets after cache hits went in */
+static guint budgets_source = 0;
+
+static void free_job(struct render_job *job){
+    g_string_free(job->command, TRUE);
+    g_string_free(job->snippet, TRUE);
+    g_free(job->png_data);
+    g_free(job);
+}
+
+/* Guesses how large the rendered snippet will be, so that the
+ * conversation does not jump around too much once it arrives */
+static void placeholder_size(const GString *command,
+        const GString *snippet, int *width, int *height){
+    int lines = 1;
+    int column = 0, longest = 0;
+    int i;
+
+    for (i=0; i<snippet->len; i++){
+        if (snippet->str[i] == '\n'){
+            lines++;
+            column = 0;
+        } else {
+            column++;
+            longest = MAX(longest, column);
+        }
+    }
+
+    if (!strcmp(command->str, "formula")){
+        *width = longest * 9;
+        *height = 24 * lines;
+    } else if (!strcmp(command->str, "dot")
+            || !strcmp(command->str, "tikz")
+            || !strcmp(command->str, "svg")){
+        *width = 96;
+        *height = 96;
+    } else {
+        *width = longest * 8;
+        *height = 16 * lines + 8;
+    }
+
+    *width = CLAMP(*width, PLACEHOLDER_MIN, PLACEHOLDER_MAX);
+    *height = CLAMP(*height, PLACEHOLDER_MIN, PLACEHOLDER_MAX);
+}
+
+static int new_placeholder(const GString *command, const GString *snippet){
+    GdkPixbuf *pixbuf;
+    GError *error = NULL;
+    gchar *buffer;
+    gsize size;
+    int width, height;
+
+    placeholder_size(command, snippet, &width, &height);
+
+    pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, width, height);
+    gdk_pixbuf_fill(pixbuf, 0xe0e0e080);
+
+    if (!gdk_pixbuf_save_to_buffer(pixbuf, &buffer, &size,
+                "png", &error, NULL)){
+        purple_debug_error("PiFo",
+                "Could not create placeholder: [%s]\n",
+                error->message);
+        g_error_free(error);
+        g_object_unref(pixbuf);
+        return 0;
+    }
+    g_object_unref(pixbuf);
+
+    /* The imgstore takes ownership of buffer */
+    return purple_imgstore_add_with_id(buffer, size, "pifo-pending.png");
+}
+
+static GdkPixbuf *pixbuf_from_png(const gchar *data, gsize size){
+    GdkPixbufLoader *loader = gdk_pixbuf_loader_new();
+    GdkPixbuf *pixbuf = NULL;
+
+    if (gdk_pixbuf_loader_write(loader, (const guchar *) data, size, NULL)
+            && gdk_pixbuf_loader_close(loader, NULL)){
+        pixbuf = gdk_pixbuf_loader_get_pixbuf(loader);
+        if (pixbuf)
+            g_object_ref(pixbuf);
+    } else {
+        gdk_pixbuf_loader_close(loader, NULL);
+    }
+
+    g_object_unref(loader);
+
+    return pixbuf;
+}
+
+static GtkWidget *find_image(GtkWidget *widget){
+    GList *children, *child;
+    GtkWidget *image = NULL;
+
+    if (GTK_IS_IMAGE(widget))
+        return widget;
+
+    if (!GTK_IS_CONTAINER(widget))
+        return NULL;
+
+    children = gtk_container_get_children(GTK_CONTAINER(widget));
+    for (child = children; child != NULL && image == NULL;
+            child = child->next){
+        image = find_image(child->data);
+    }
+    g_list_free(children);
+
+    return image;
+}
+
+/* The original GtkIMHtml keeps of the pixbuf in image, to scale it
+ * when the window gets narrower */
+static GtkIMHtmlImage *imhtml_image(GtkIMHtml *imhtml, GtkWidget *image){
+    GtkIMHtmlScalable *scalable;
+    GList *item;
+
+    for (item = imhtml->scalables; item != NULL; item = item->next){
+        scalable = item->data;
+        if (scalable->scale == gtk_imhtml_image_scale
+                && ((GtkIMHtmlImage *) scalable)->image == GTK_IMAGE(image))
+            return (GtkIMHtmlImage *) scalable;
+    }
+
+    return NULL;
+}
+
+/* Shows pixbuf in image. The original has to be replaced as well,
+ * or the old pixels would come back once the image is scaled, and
+ * could never be freed */
+static void set_image(GtkIMHtml *imhtml, GtkWidget *image,
+        GdkPixbuf *pixbuf){
+    GtkIMHtmlImage *original = imhtml_image(imhtml, image);
+
+    gtk_image_set_from_pixbuf(GTK_IMAGE(image), pixbuf);
+
+    if (original != NULL){
+        g_object_ref(pixbuf);
+        g_object_unref(original->pixbuf);
+        original->pixbuf = pixbuf;
+        original->width = gdk_pixbuf_get_width(pixbuf);
+        original->height = gdk_pixbuf_get_height(pixbuf);
+    }
+}
+
+/* Shows pixbuf in every widget of the anchor */
+static void set_anchor_image(GtkIMHtml *imhtml, GtkTextChildAnchor *anchor,
+        GdkPixbuf *pixbuf, const char *tooltip){
+    GList *widgets, *widget;
+    GtkWidget *image;
+
+    widgets = gtk_text_child_anchor_get_widgets(anchor);
+    for (widget = widgets; widget != NULL; widget = widget->next){
+        image = find_image(widget->data);
+        if (image == NULL)
+            continue;
+
+        set_image(imhtml, image, pixbuf);
+        gtk_widget_set_tooltip_text(image, tooltip);
+    }
+    g_list_free(widgets);
+}
+
+/* Looks for the anchors GtkIMHtml created for the image with the
+ * given id. The search starts at the end of the buffer, because
+ * that's where new messages are. */
+static GList *find_anchors(PurpleConversation *conv, int id){
+    PidginConversation *gtkconv;
+    GtkTextBuffer *buffer;
+    GtkTextIter iter, match;
+    GtkTextChildAnchor *anchor;
+    GList *anchors = NULL;
+    gchar *needle;
+    const gchar *htmltext;
+
+    if (!PIDGIN_IS_PIDGIN_CONVERSATION(conv))
+        return NULL;
+
+    gtkconv = PIDGIN_CONVERSATION(conv);
+    buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(gtkconv->imhtml));
+    needle = g_strdup_printf(IMG_BEG "%d" IMG_END, id);
+
+    gtk_text_buffer_get_end_iter(buffer, &iter);
+    while (gtk_text_iter_backward_search(&iter, OBJECT_CHAR, 0,
+                &match, NULL, NULL)){
+        iter = match;
+
+        anchor = gtk_text_iter_get_child_anchor(&match);
+        if (anchor == NULL)
+            continue;
+
+        htmltext = g_object_get_data(G_OBJECT(anchor),
+                "gtkimhtml_htmltext");
+        if (htmltext == NULL || strcmp(htmltext, needle))
+            continue;
+
+        anchors = g_list_prepend(anchors, anchor);
+    }
+
+    g_free(needle);
+
+    return g_list_reverse(anchors);
+}
+
+/* Puts the rendered image (or the stock icon) where the placeholder
+ * is, and htmltext in place of its html. Returns the number of
+ * anchors that got updated. */
+static int swap_placeholder(PurpleConversation *conv, int placeholder_id,
+        const char *htmltext, GdkPixbuf *pixbuf, const char *stock,
+        const char *tooltip){
+    GtkIMHtml *imhtml;
+    GList *anchors, *anchor;
+    GdkPixbuf *icon = NULL;
+    int swapped = 0;
+
+    if ((anchors = find_anchors(conv, placeholder_id)) == NULL)
+        return 0;
+
+    imhtml = GTK_IMHTML(PIDGIN_CONVERSATION(conv)->imhtml);
+    if (pixbuf == NULL){
+        icon = gtk_widget_render_icon(GTK_WIDGET(imhtml), stock,
+                GTK_ICON_SIZE_MENU, NULL);
+    }
+
+    for (anchor = anchors; anchor != NULL; anchor = anchor->next){
+        set_anchor_image(imhtml, anchor->data, pixbuf ? pixbuf : icon,
+                tooltip);
+
+        /* Copying the conversation must yield the real image, or
+         * the snippet if there is none. The placeholder is gone */
+        g_object_set_data_full(G_OBJECT(anchor->data), "gtkimhtml_htmltext",
+                g_strdup(htmltext), g_free);
+
+        swapped++;
+    }
+
+    if (icon)
+        g_object_unref(icon);
+    g_list_free(anchors);
+
+    return swapped;
+}
+
+/* What it takes to bring an unloaded image back */
+struct unloaded_image {
+    PurpleConversation *conv;
+    GString *command;
+    GString *snippet;
+};
+
+static void free_unloaded_image(gpointer data){
+    struct unloaded_image *unloaded = data;
+
+    g_string_free(unloaded->command, TRUE);
+    g_string_free(unloaded->snippet, TRUE);
+    g_free(unloaded);
+}
+
+/* Renders an unloaded image again, the usual way: a placeholder
+ * stands in for it until the job is done */
+static gboolean reload_clicked(GtkWidget *widget, GdkEventButton *event,
+        gpointer data){
+    GtkTextChildAnchor *anchor = data;
+    struct unloaded_image *unloaded;
+    PurpleStoredImage *stored;
+    GdkPixbuf *pixbuf;
+    int placeholder_id;
+
+    unloaded = g_object_get_data(G_OBJECT(anchor), "pifo-unloaded");
+    if (unloaded == NULL || event->type != GDK_BUTTON_PRESS
+            || event->button != 1)
+        return FALSE;
+
+    if (!g_list_find(purple_get_conversations(), unloaded->conv))
+        return FALSE;
+
+    placeholder_id = pifo_job_submit(unloaded->conv,
+            unloaded->command, unloaded->snippet);
+    if (placeholder_id == 0)
+        return TRUE;
+
+    stored = purple_imgstore_find_by_id(placeholder_id);
+    pixbuf = pixbuf_from_png(purple_imgstore_get_data(stored),
+            purple_imgstore_get_size(stored));
+    if (pixbuf != NULL){
+        set_anchor_image(GTK_IMHTML(PIDGIN_CONVERSATION(
+                        unloaded->conv)->imhtml), anchor, pixbuf, NULL);
+        g_object_unref(pixbuf);
+    }
+
+    g_object_set_data_full(G_OBJECT(anchor), "gtkimhtml_htmltext",
+            g_strdup_printf(IMG_BEG "%d" IMG_END, placeholder_id),
+            g_free);
+    g_object_set_data(G_OBJECT(anchor), "pifo-unloaded", NULL);
+
+    return TRUE;
+}
+
+static gboolean anchor_visible(GtkTextView *view, GtkTextChildAnchor *anchor){
+    GdkRectangle visible;
+    GtkTextIter iter;
+    gint y, height;
+
+    if (!gtk_widget_get_mapped(GTK_WIDGET(view)))
+        return FALSE;
+
+    gtk_text_view_get_visible_rect(view, &visible);
+    gtk_text_buffer_get_iter_at_child_anchor(
+            gtk_text_view_get_buffer(view), &iter, anchor);
+    gtk_text_view_get_line_yrange(view, &iter, &y, &height);
+
+    return y < visible.y + visible.height && y + height > visible.y;
+}
+
+/* Swaps every copy of the image in the conversation for an icon,
+ * which renders the snippet again once it is clicked, so the pixels
+ * can be freed. Copying the conversation yields the snippet. Nothing
+ * happens if any of them is on screen. */
+enum pifo_unload pifo_job_unload_image(PurpleConversation *conv,
+        int image_id, const char *command, const char *snippet){
+    GtkIMHtml *imhtml;
+    GList *anchors, *anchor, *widgets, *widget;
+    struct unloaded_image *unloaded;
+    GdkPixbuf *icon;
+    gchar *tooltip;
+
+    if ((anchors = find_anchors(conv, image_id)) == NULL)
+        return PIFO_UNLOAD_GONE;
+
+    imhtml = GTK_IMHTML(PIDGIN_CONVERSATION(conv)->imhtml);
+    for (anchor = anchors; anchor != NULL; anchor = anchor->next){
+        if (anchor_visible(GTK_TEXT_VIEW(imhtml), anchor->data)){
+            g_list_free(anchors);
+            return PIFO_UNLOAD_VISIBLE;
+        }
+    }
+
+    icon = gtk_widget_render_icon(GTK_WIDGET(imhtml), GTK_STOCK_REFRESH,
+            GTK_ICON_SIZE_MENU, NULL);
+    tooltip = g_strdup_printf("PiFo: [%s] was unloaded to save memory, "
+            "click to render it again", command);
+
+    for (anchor = anchors; anchor != NULL; anchor = anchor->next){
+        set_anchor_image(imhtml, anchor->data, icon, tooltip);
+
+        unloaded = g_new0(struct unloaded_image, 1);
+        unloaded->conv = conv;
+        unloaded->command = g_string_new(command);
+        unloaded->snippet = g_string_new(snippet);
+        g_object_set_data_full(G_OBJECT(anchor->data), "pifo-unloaded",
+                unloaded, free_unloaded_image);
+        g_object_set_data_full(G_OBJECT(anchor->data), "gtkimhtml_htmltext",
+                g_strdup_printf("\\%s{%s}", command, snippet), g_free);
+
+        widgets = gtk_text_child_anchor_get_widgets(anchor->data);
+        for (widget = widgets; widget != NULL; widget = widget->next){
+            if (g_object_get_data(G_OBJECT(widget->data), "pifo-reload"))
+                continue;
+
+            g_signal_connect(G_OBJECT(widget->data), "button-press-event",
+                    G_CALLBACK(reload_clicked), anchor->data);
+            g_object_set_data(G_OBJECT(widget->data), "pifo-reload",
+                    GINT_TO_POINTER(TRUE));
+        }
+        g_list_free(widgets);
+    }
+
+    g_object_unref(icon);
+    g_free(tooltip);
+    g_list_free(anchors);
+
+    return PIFO_UNLOAD_DONE;
+}
+
+/* Runs in the main thread once the backend is done */
+static void finish_job(struct render_job *job){
+    GdkPixbuf *pixbuf = NULL;
+    const char *stock = GTK_STOCK_DIALOG_ERROR;
+    gchar *tooltip, *htmltext;
+    gint64 started, traced, finished = pifo_trace_start();
+    int image_id = 0;
+
+    pifo_stats_count(PIFO_COUNT_JOBS);
+    if (job->timed_out)
+        pifo_stats_count(PIFO_COUNT_JOBS_TIMED_OUT);
+    else if (!job->ok)
+        pifo_stats_count(PIFO_COUNT_JOBS_FAILED);
+
+    if (!g_list_find(purple_get_conversations(), job->conv)){
+        purple_debug_info("PiFo",
+                "Conversation of job #%u is gone\n", job->id);
+        purple_imgstore_unref_by_id(job->placeholder_id);
+        free_job(job);
+        return;
+    }
+
+    pifo_trace_add_job(job->id, job->hash);
+
+    if (job->ok){
+        started = pifo_stats_start();
+        pixbuf = pixbuf_from_png(job->png_data, job->png_size);
+        pifo_stats_stage(PIFO_STAGE_IMAGE_LOAD, started);
+    }
+
+    if (pixbuf){
+        tooltip = g_strdup_printf("\\%s{%s}",
+                job->command->str, job->snippet->str);
+
+        /* The registry takes ownership of the image data */
+        started = pifo_stats_start();
+        traced = pifo_trace_start();
+        image_id = load_image(job->conv, job->command, job->snippet,
+                job->png_data, job->png_size);
+        pifo_stats_stage(PIFO_STAGE_IMGSTORE, started);
+        pifo_trace_span("load_image", traced, job->command->str);
+        job->png_data = NULL;
+    } else if (job->timed_out){
+        stock = GTK_STOCK_MEDIA_STOP;
+        tooltip = g_strdup_printf("PiFo: [%s] took too long and "
+                "was stopped", job->command->str);
+    } else {
+        tooltip = g_strdup_printf("PiFo: [%s] could not be rendered!",
+                job->command->str);
+    }
+
+    if (image_id > 0)
+        htmltext = g_strdup_printf(IMG_BEG "%d" IMG_END, image_id);
+    else
+        htmltext = g_strdup_printf("\\%s{%s}",
+                job->command->str, job->snippet->str);
+
+    if (swap_placeholder(job->conv, job->placeholder_id,
+                htmltext, pixbuf, stock, tooltip) == 0){
+        purple_debug_info("PiFo",
+                "Placeholder of job #%u not found\n", job->id);
+    }
+
+    if (pixbuf)
+        g_object_unref(pixbuf);
+    g_free(htmltext);
+    g_free(tooltip);
+
+    pifo_trace_span("finish_job", finished, job->command->str);
+    pifo_trace_clear_jobs();
+
+    purple_imgstore_unref_by_id(job->placeholder_id);
+    free_job(job);
+
+    /* Now that the new image is on screen, older ones may have
+     * to make room for it */
+    if (image_id > 0)
+        pifo_imgreg_enforce_budgets();
+}
+
+static gboolean drain_finished_jobs(gpointer data){
+    struct render_job *job;
+
+    G_LOCK(drain_lock);
+    drain_source = 0;
+    G_UNLOCK(drain_lock);
+
+    while ((job = g_async_queue_try_pop(finished_jobs)) != NULL){
+        finish_job(job);
+    }
+
+    return FALSE;
+}
+
+static void job_done(struct render_job *job, GString *png){
+    if (png != NULL){
+        job->png_size = png->len;
+        job->png_data = g_string_free(png, FALSE);
+        job->ok = TRUE;
+    }
+
+    g_async_queue_push(finished_jobs, job);
+}
+
+/* Runs in a render thread */
+static void run_batch(gpointer data, gpointer user_data){
+    GPtrArray *batch = data;
+    GPtrArray *commands, *snippets;
+    GString **results, *png;
+    gboolean *timed_out;
+    struct render_job *job;
+    int i;
+
+    pifo_stats_gauge(PIFO_GAUGE_QUEUE_DEPTH,
+            g_atomic_int_add(&queued_jobs, -(gint) batch->len)
+            - (gint) batch->len);
+
+    if (g_atomic_int_get(&cancelled)){
+        for (i=0; i<batch->len; i++)
+            job_done(g_ptr_array_index(batch, i), NULL);
+        g_ptr_array_free(batch, TRUE);
+        return;
+    }
+
+    for (i=0; i<batch->len; i++){
+        job = g_ptr_array_index(batch, i);
+        pifo_stats_stage(PIFO_STAGE_QUEUE, job->queued);
+        pifo_trace_add_job(job->id, job->hash);
+    }
+
+    if (batch->len == 1){
+        job = g_ptr_array_index(batch, 0);
+
+        pifo_debug_info("PiFo",
+                "Rendering job #%u [%s]\n",
+                job->id, job->command->str);
+
+        png = dispatch_command(job->command, job->snippet);
+        job->timed_out = pifo_spawn_timed_out();
+        job_done(job, png);
+    } else {
+        commands = g_ptr_array_sized_new(batch->len);
+        snippets = g_ptr_array_sized_new(batch->len);
+        results = g_new0(GString *, batch->len);
+        timed_out = g_new0(gboolean, batch->len);
+
+        for (i=0; i<batch->len; i++){
+            job = g_ptr_array_index(batch, i);
+            g_ptr_array_add(commands, job->command);
+            g_ptr_array_add(snippets, job->snippet);
+        }
+
+        pifo_debug_info("PiFo",
+                "Rendering jobs #%u to #%u as one batch\n",
+                ((struct render_job *) g_ptr_array_index(batch, 0))->id,
+                job->id);
+
+        dispatch_batch(commands, snippets, results, timed_out);
+
+        for (i=0; i<batch->len; i++){
+            job = g_ptr_array_index(batch, i);
+            job->timed_out = timed_out[i];
+            job_done(job, results[i]);
+        }
+
+        g_ptr_array_free(commands, TRUE);
+        g_ptr_array_free(snippets, TRUE);
+        g_free(results);
+        g_free(timed_out);
+    }
+
+    g_ptr_array_free(batch, TRUE);
+    pifo_trace_clear_jobs();
+
+    G_LOCK(drain_lock);
+    if (drain_source == 0)
+        drain_source = g_idle_add(drain_finished_jobs, NULL);
+    G_UNLOCK(drain_lock);
+}
+
+/* Cheap renders go first, otherwise first come first served */
+static gint compare_batches(gconstpointer a, gconstpointer b, gpointer data){
+    const struct render_job *x = g_ptr_array_index((GPtrArray *) a, 0);
+    const struct render_job *y = g_ptr_array_index((GPtrArray *) b, 0);
+
+    if (x->cost != y->cost)
+        return x->cost < y->cost ? -1 : 1;
+
+    return x->id < y->id ? -1 : x->id > y->id;
+}
+
+static void push_batch(GPtrArray *batch){
+    g_thread_pool_push(render_pool, batch, NULL);
+}
+
+static gboolean flush_batch(gpointer key, gpointer value, gpointer data){
+    push_batch(value);
+
+    return TRUE;
+}
+
+static gboolean flush_pending_batches(gpointer data){
+    flush_source = 0;
+    g_hash_table_foreach_steal(pending_batches, flush_batch, NULL);
+
+    return FALSE;
+}
+
+static gboolean drop_batch(gpointer key, gpointer value, gpointer data){
+    GPtrArray *batch = value;
+    struct render_job *job;
+    int i;
+
+    for (i=0; i<batch->len; i++){
+        job = g_ptr_array_index(batch, i);
+        purple_imgstore_unref_by_id(job->placeholder_id);
+        free_job(job);
+    }
+    g_ptr_array_free(batch, TRUE);
+
+    return TRUE;
+}
+
+/* Holds the job back until the batch window closes, unless
+ * its backend cannot compile several snippets at once */
+static void queue_job(struct render_job *job){
+    const char *kind = batch_kind(job->command);
+    GPtrArray *batch;
+
+    pifo_stats_gauge(PIFO_GAUGE_QUEUE_DEPTH,
+            g_atomic_int_add(&queued_jobs, 1) + 1);
+
+    if (kind == NULL){
+        batch = g_ptr_array_sized_new(1);
+        g_ptr_array_add(batch, job);
+        push_batch(batch);
+        return;
+    }
+
+    if ((batch = g_hash_table_lookup(pending_batches, kind)) == NULL){
+        batch = g_ptr_array_new();
+        g_hash_table_insert(pending_batches, (gpointer) kind, batch);
+    }
+    g_ptr_array_add(batch, job);
+
+    if (batch->len >= BATCH_MAX){
+        g_hash_table_steal(pending_batches, kind);
+        push_batch(batch);
+    } else if (flush_source == 0){
+        flush_source = g_timeout_add(BATCH_WINDOW_MS,
+                flush_pending_batches, NULL);
+    }
+}
+
+void pifo_job_init(void){
+    GError *error = NULL;
+
+    g_atomic_int_set(&cancelled, 0);
+    finished_jobs = g_async_queue_new();
+    pending_batches = g_hash_table_new(g_str_hash, g_str_equal);
+    render_pool = g_thread_pool_new(run_batch, NULL,
+            CLAMP(g_get_num_processors(), 1, RENDER_THREADS_MAX),
+            FALSE, &error);
+
+    if (render_pool == NULL){
+        purple_debug_error("PiFo",
+                "Could not start render threads: [%s]\n",
+                error->message);
+        g_error_free(error);
+        return;
+    }
+
+    g_thread_pool_set_sort_function(render_pool, compare_batches, NULL);
+}
+
+void pifo_job_shutdown(void){
+    struct render_job *job;
+
+    if (flush_source != 0){
+        g_source_remove(flush_source);
+        flush_source = 0;
+    }
+
+    if (budgets_source != 0){
+        g_source_remove(budgets_source);
+        budgets_source = 0;
+    }
+
+    if (pending_batches != NULL){
+        g_hash_table_foreach_remove(pending_batches, drop_batch, NULL);
+        g_hash_table_destroy(pending_batches);
+        pending_batches = NULL;
+    }
+
+    /* Queued jobs come back unrendered and are finished below
+     * along with the ones that were running */
+    if (render_pool != NULL){
+        g_atomic_int_set(&cancelled, 1);
+        g_thread_pool_free(render_pool, FALSE, TRUE);
+        render_pool = NULL;
+    }
+    g_atomic_int_set(&queued_jobs, 0);
+
+    G_LOCK(drain_lock);
+    if (drain_source != 0){
+        g_source_remove(drain_source);
+        drain_source = 0;
+    }
+    G_UNLOCK(drain_lock);
+
+    if (finished_jobs != NULL){
+        while ((job = g_async_queue_try_pop(finished_jobs)) != NULL){
+            finish_job(job);
+        }
+        g_async_queue_unref(finished_jobs);
+        finished_jobs = NULL;
+    }
+}
+
+static gboolean enforce_budgets(gpointer data){
+    budgets_source = 0;
+    pifo_imgreg_enforce_budgets();
+
+    return FALSE;
+}
+
+/* Returns the imgstore id of the image of snippet if it is already
+ * rendered, so it goes into the message right away instead of
+ * through a job. Returns 0 if it has to be rendered first. */
+int pifo_job_cached(PurpleConversation *conv,
+        const GString *command, const GString *snippet){
+    GString *png;
+    gsize size;
+    int image_id;
+
+    if ((png = lookup_render(command, snippet)) == NULL)
+        return 0;
+
+    /* The registry takes ownership of the image data */
+    size = png->len;
+    image_id = pifo_imgreg_add(conv, command->str, snippet->str,
+            g_string_free(png, FALSE), size);
+    if (image_id == 0)
+        return 0;
+
+    purple_debug_info("PiFo", "[%s] is cached as image [%d]\n",
+            command->str, image_id);
+
+    /* Once the message is laid out, older images may have to make
+     * room for it, like for the images of finished jobs */
+    if (budgets_source == 0)
+        budgets_source = g_idle_add_full(G_PRIORITY_LOW,
+                enforce_budgets, NULL, NULL);
+
+    return image_id;
+}
+
+/* Queues the snippet for rendering and returns the imgstore id of
+ * a placeholder image that stands in for it until the backend is
+ * done. Returns 0 if the job could not be queued. */
+int pifo_job_submit(PurpleConversation *conv,
+        const GString *command, const GString *snippet){
+    struct render_job *job;
+    int placeholder_id;
+
+    if (render_pool == NULL)
+        return 0;
+
+    placeholder_id = new_placeholder(command, snippet);
+    if (placeholder_id == 0)
+        return 0;
+
+    job = g_new0(struct render_job, 1);
+    job->id = next_job_id++;
+    job->conv = conv;
+    job->command = g_string_new(command->str);
+    job->snippet = g_string_new(snippet->str);
+    job->cost = backend_cost(command);
+    job->placeholder_id = placeholder_id;
+    job->queued = pifo_stats_start();
+    job->hash = pifo_trace_hash(snippet);
+
+    /* The message the job came from is traced with its id */
+    pifo_trace_add_job(job->id, job->hash);
+
+    purple_debug_info("PiFo",
+            "Queued job #%u [%s] with placeholder [%d]\n",
+            job->id, command->str, placeholder_id);
+
+    queue_job(job);
+
+    return placeholder_id;
+}
@@ -0,0 +1,52 @@
+#ifndef PIFO_JOB
+#define PIFO_JOB
+
+#include "pifo.h"
+#include "pifo_generator.h"
+
+/* A single snippet waiting for (or coming back from) its backend */
+struct render_job {
+    guint id;
+    PurpleConversation *conv;
+    GString *command;
+    GString *snippet;
+
+    /* Jobs of cheaper backends are rendered first */
+    enum pifo_cost cost;
+
+    /* imgstore id of the placeholder that was written
+     * into the conversation in place of the snippet */
+    int placeholder_id;
+
+    /* When the job was submitted, for pifo_stats_stage() */
+    gint64 queued;
+    /* Of the snippet, tags the spans of the job in traces */
+    guint64 hash;
+
+    /* Filled in by the render thread */
+    gboolean ok;
+    gboolean timed_out;
+    gchar *png_data;
+    gsize png_size;
+};
+
+/* What became of an image pifo_job_unload_image() was asked to unload */
+enum pifo_unload {
+    PIFO_UNLOAD_DONE,
+    /* Left alone, it is on screen */
+    PIFO_UNLOAD_VISIBLE,
+    /* No message shows it anymore, e.g. because it was scrolled
+     * out of the buffer */
+    PIFO_UNLOAD_GONE
+};
+
+void pifo_job_init(void);
+void pifo_job_shutdown(void);
+int pifo_job_cached(PurpleConversation *conv,
+        const GString *command, const GString *snippet);
+int pifo_job_submit(PurpleConversation *conv,
+        const GString *command, const GString *snippet);
+enum pifo_unload pifo_job_unload_image(PurpleConversation *conv,
+        int image_id, const char *command, const char *snippet);
+
+#endif
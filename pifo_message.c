@@ -0,0 +1,155 @@
+#include "pifo_message.h"
+#include "pifo_scan.h"
+#include "pifo_generator.h"
+#include "pifo_job.h"
+#include "pifo_stats.h"
+#include "pifo_trace.h"
+#include "pifo.h"
+
+#include <string.h>
+
+gboolean contains_work(const char *message){
+    return pifo_scan_has_command(message, strlen(message));
+}
+
+gboolean free_commands(const GPtrArray *commands){
+    int i;
+    GString *command;
+    for (i=0; i<commands->len; i++){
+        command = g_ptr_array_index(commands, i);
+        g_string_free(command, TRUE);
+    }
+
+    return TRUE;
+}
+
+gboolean free_snippets(const GPtrArray *snippets){
+    int i;
+    GString *snippet;
+    for (i=0; i<snippets->len; i++){
+        snippet = g_ptr_array_index(snippets, i);
+        g_string_free(snippet, TRUE);
+    }
+
+    return TRUE;
+}
+
+/* snippet is only vaild if it contains at least
+   one non-whitespace char */
+gboolean snippet_valid(const GString *snippet){
+     int i;
+     for (i=0; i<snippet->len; i++)
+	  if (! g_ascii_isspace (snippet->str[i]))
+	       return TRUE;
+
+     return FALSE;
+}
+
+GString *modify_message(PurpleConversation *conv, const GString *message){
+    int image_id;
+    int i;
+    gsize copied = 0;
+
+    GString *snippet;
+    GString *command;
+    GString *new;
+    struct command_span *span;
+    gchar *key;
+
+    /* \command{snippet} -> placeholder id. A snippet that shows up
+     * more than once is rendered once, and all of its placeholders
+     * are swapped for the same image */
+    GHashTable *rendered;
+
+    GPtrArray *snippets, *commands;
+    GArray *spans;
+    gint64 started = pifo_stats_start(), traced = pifo_trace_start();
+    gboolean found = get_commands(message, &commands, &snippets, &spans);
+
+    pifo_stats_stage(PIFO_STAGE_SCAN, started);
+    pifo_trace_span("get_commands", traced, NULL);
+
+    if (!found){
+        purple_debug_info("PiFo",
+                "No commands in there! "
+                "Message not changed!\n");
+        return NULL;
+    }
+
+    /* The spans are in message order and do not overlap, so the new
+     * message is put together in one go: the text in front of each
+     * command, then whatever the command is replaced with */
+    new = g_string_sized_new(message->len);
+    rendered = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+    for (i=0; i<commands->len; i++){
+        command = g_ptr_array_index(commands, i);
+        snippet = g_ptr_array_index(snippets, i);
+        span = &g_array_index(spans, struct command_span, i);
+
+        g_string_append_len(new, message->str + copied,
+                span->start - copied);
+        copied = span->end;
+
+	if (!snippet_valid(snippet)){
+            purple_debug_info("PiFo",
+			      "Could not dispatch command\n",
+			      "Argument empty\n"); 
+
+            g_string_append_printf(new,
+                    "{PiFo: [%s] You have to provide an Argument!}",
+                    command->str);
+
+        } else if (!is_command(command)){
+	     purple_debug_info("PiFo",
+			       "Could not dispatch command: [%s(%s,%s)]\n",
+			       "Command not found: ", command->str, snippet->str);
+
+	     g_string_append_printf(new,
+				    "{PiFo: [%s] is not a valid command!}",
+				    command->str);
+	} else {
+	     key = g_strdup_printf("%s{%s}", command->str, snippet->str);
+
+	     /* Cached images go in right away. Otherwise the backend
+	      * runs in a render thread, and until it is done a
+	      * placeholder is shown in place of the image */
+	     if ((image_id = GPOINTER_TO_INT(
+			       g_hash_table_lookup(rendered, key))) != 0){
+		  g_free(key);
+	     } else if ((image_id = pifo_job_cached(conv,
+						   command, snippet)) != 0
+			|| (image_id = pifo_job_submit(conv,
+						   command, snippet)) != 0){
+		  g_hash_table_insert(rendered, key,
+				      GINT_TO_POINTER(image_id));
+	     } else {
+		  /* The snippets before it are already queued, so
+		   * this one is left as it was written */
+		  g_free(key);
+		  g_string_append_len(new, message->str + span->start,
+				      span->end - span->start);
+		  continue;
+	     }
+
+	     g_string_append_printf(new, IMG_BEG "%d" IMG_END, image_id);
+	}
+    }
+
+    g_string_append_len(new, message->str + copied,
+            message->len - copied);
+
+    purple_debug_info("PiFo",
+            "Changed message from [%s] to [%s]\n",
+            message->str, new->str);
+
+    free_snippets(snippets);
+    free_commands(commands);
+    g_ptr_array_free(snippets, TRUE);
+    g_ptr_array_free(commands, TRUE);
+    g_array_free(spans, TRUE);
+    g_hash_table_destroy(rendered);
+
+    return new;
+}
+
@@ -0,0 +1,18 @@
+#ifndef PIFO_MESSAGE
+#define PIFO_MESSAGE
+
+#include "pifo.h"
+
+/* Turning a message into the one that is shown: the commands in it
+ * are found, handed to the render threads and replaced by their
+ * placeholders. Kept apart from the plugin glue in pifo.c, so it can
+ * be linked without Pidgin (see bench/bench_message.c). */
+
+gboolean contains_work(const char *message);
+GString *modify_message(PurpleConversation *conv,
+        const GString *message);
+gboolean snippet_valid(const GString *snippet);
+gboolean free_commands(const GPtrArray *commands);
+gboolean free_snippets(const GPtrArray *commands);
+
+#endif
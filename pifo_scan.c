@@ -0,0 +1,181 @@
+#include "pifo_scan.h"
+
+#include <stdio.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define CLASS_ALNUM (1 << 0)
+/* Bytes that nest or end a snippet */
+#define CLASS_BRACE (1 << 1)
+
+static const guint8 byte_class[256] = {
+    ['0' ... '9'] = CLASS_ALNUM,
+    ['A' ... 'Z'] = CLASS_ALNUM,
+    ['a' ... 'z'] = CLASS_ALNUM,
+    ['{'] = CLASS_BRACE,
+    ['}'] = CLASS_BRACE,
+    ['\0'] = CLASS_BRACE
+};
+
+struct command_match {
+    gsize start;
+    gsize name;
+    gsize name_len;
+    gsize arg;
+    gsize arg_len;
+    gsize end;
+};
+
+/* Returns the first of '{', '}' or '\0' in [p, end), or end */
+static const char *find_brace(const char *p, const char *end){
+#ifdef __SSE2__
+    const __m128i open = _mm_set1_epi8('{');
+    const __m128i close = _mm_set1_epi8('}');
+    const __m128i nul = _mm_setzero_si128();
+    __m128i chunk;
+    int mask;
+
+    for (; end - p >= 16; p += 16){
+        chunk = _mm_loadu_si128((const __m128i *) p);
+        mask = _mm_movemask_epi8(_mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(chunk, open),
+                        _mm_cmpeq_epi8(chunk, close)),
+                    _mm_cmpeq_epi8(chunk, nul)));
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+    }
+#endif
+
+    for (; p < end; p++)
+        if (byte_class[(guchar) *p] & CLASS_BRACE)
+            return p;
+
+    return end;
+}
+
+/*
+ * The scanner is the FSM below, with the states that ignore most
+ * bytes turned into searches for the bytes they do not ignore.
+   digraph fsm {
+       NORMAL -> BACKSLASH [label="\\"];
+       BACKSLASH -> NORMAL [label="[^(::alnum::|\\)]"];
+       BACKSLASH -> BACKSLASH [label="\\"];
+       BACKSLASH -> COMMAND [label="[::alnum::]"];
+       COMMAND -> BACKSLASH [label="\\"];
+       COMMAND -> NORMAL [label="[^(::alnum::|\\)]"];
+       COMMAND -> COMMAND [label="[::alnum::]"];
+       COMMAND -> ARGUMENT [label="{"];
+       ARGUMENT -> NORMAL [label="}"];
+   }
+ * Finds the next command at or after *offset and moves *offset
+ * past it. Returns FALSE once there are no more.
+ */
+static gboolean next_command(const char *buffer, gsize len, gsize *offset,
+        struct command_match *match){
+    const char *p = buffer + *offset;
+    const char *end = buffer + len;
+    const char *name, *arg;
+    int depth;
+
+    while (p < end){
+        /* NORMAL: nothing happens until a backslash */
+        if ((p = memchr(p, '\\', end - p)) == NULL)
+            break;
+
+        /* BACKSLASH and COMMAND: only the last backslash of a run
+         * counts, and a backslash after a name starts over */
+        do {
+            while (p < end && *p == '\\')
+                p++;
+            name = p;
+            while (p < end && byte_class[(guchar) *p] & CLASS_ALNUM)
+                p++;
+        } while (p > name && p < end && *p == '\\');
+
+        if (p == name || p == end || *p != '{')
+            continue;
+
+        /* ARGUMENT: braces nest, everything else is snippet */
+        arg = ++p;
+        depth = 1;
+        while ((p = find_brace(p, end)) < end && *p != '\0'){
+            if (*p++ == '{'){
+                depth++;
+            } else if (--depth == 0){
+                match->start = name - 1 - buffer;
+                match->name = name - buffer;
+                match->name_len = arg - 1 - name;
+                match->arg = arg - buffer;
+                match->arg_len = p - 1 - arg;
+                match->end = p - buffer;
+                *offset = match->end;
+                return TRUE;
+            }
+        }
+
+        /* A snippet that is never closed ends the scan */
+        break;
+    }
+
+    *offset = len;
+    return FALSE;
+}
+
+/* Whether there is at least one complete command in buffer. Stops
+ * at the first one. */
+gboolean pifo_scan_has_command(const char *buffer, gsize len){
+    struct command_match match;
+    gsize offset = 0;
+
+    return next_command(buffer, len, &offset, &match);
+}
+
+gboolean get_commands(const GString *buffer,
+        GPtrArray **cmds, GPtrArray **args, GArray **locs){
+    GPtrArray *commands = g_ptr_array_new();
+    GPtrArray *arguments = g_ptr_array_new();
+    GArray *spans = g_array_new(FALSE, FALSE, sizeof(struct command_span));
+
+    struct command_match match;
+    struct command_span span;
+    gsize offset = 0;
+
+    while (next_command(buffer->str, buffer->len, &offset, &match)){
+        span.start = match.start;
+        span.end = match.end;
+
+        g_ptr_array_add(commands,
+                g_string_new_len(buffer->str + match.name, match.name_len));
+        g_ptr_array_add(arguments,
+                g_string_new_len(buffer->str + match.arg, match.arg_len));
+        g_array_append_val(spans, span);
+
+#ifdef DEBUG
+        printf("Salvaged command #%u = [%.*s] at [%lu, %lu)\n",
+                commands->len - 1, (int) match.name_len,
+                buffer->str + match.name, (unsigned long) span.start,
+                (unsigned long) span.end);
+        printf("Salvaged snippet #%u = [%.*s]\n",
+                arguments->len - 1, (int) match.arg_len,
+                buffer->str + match.arg);
+#endif
+    }
+
+    if (commands->len > 0){
+        *cmds = commands;
+        *args = arguments;
+        *locs = spans;
+
+        return TRUE;
+    } else {
+        g_ptr_array_free(commands, TRUE);
+        g_ptr_array_free(arguments, TRUE);
+        g_array_free(spans, TRUE);
+        *cmds = NULL;
+        *args = NULL;
+        *locs = NULL;
+        return FALSE;
+    }
+}
@@ -0,0 +1,23 @@
+#ifndef PIFO_SCAN
+#define PIFO_SCAN
+
+#include <glib.h>
+
+/* Finds the \command{snippet} constructs in a message. Instead of
+ * looking at every byte, the scanner jumps from one byte that could
+ * change its state to the next, so long messages without commands,
+ * or with long snippets, are skimmed at memchr speed. Only depends
+ * on GLib, so it can be benchmarked outside of pidgin. */
+
+/* Where a \command{snippet} was found in a message, in bytes.
+ * end is just past the closing brace */
+struct command_span {
+    gsize start;
+    gsize end;
+};
+
+gboolean pifo_scan_has_command(const char *buffer, gsize len);
+gboolean get_commands(const GString *buffer,
+        GPtrArray **cmds, GPtrArray **args, GArray **spans);
+
+#endif
@@ -0,0 +1,540 @@
+#include "pifo_spawn.h"
+#include "pifo_util.h"
+#include "pifo.h"
+
+#include <glib-unix.h>
+
+#include <spawn.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+/* glibc got a way to set the working directory of spawned
+ * children in 2.29. Without it, we have to fork for those */
+#if defined(__GLIBC__) \
+    && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+#define HAVE_SPAWN_CHDIR
+#endif
+
+#ifdef __linux__
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_SHIFT 13
+/* Older C libraries do not know it, the kernel does since 5.3 */
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#endif
+
+/* Longest pause between two looks at a child with a deadline, for
+ * kernels without pidfds */
+#define POLL_INTERVAL_MAX (50 * 1000)
+
+/* What the output buffer grows by at least for every read */
+#define READ_CHUNK (64 * 1024)
+
+extern char **environ;
+
+/* Set from the prefs on the main thread, read by render threads */
+static struct pifo_limits limits;
+G_LOCK_DEFINE_STATIC(limits);
+
+/* Whether a child of this thread was killed for its deadline */
+static GPrivate timed_out = G_PRIVATE_INIT(NULL);
+/* Largest resident set in KB of the children this thread reaped */
+static GPrivate peak_rss = G_PRIVATE_INIT(NULL);
+
+static const int pipe_flags[3] = {
+    PIFO_SPAWN_PIPE_STDIN,
+    PIFO_SPAWN_PIPE_STDOUT,
+    PIFO_SPAWN_PIPE_STDERR
+};
+
+void pifo_spawn_set_limits(const struct pifo_limits *new_limits){
+    G_LOCK(limits);
+    limits = *new_limits;
+    G_UNLOCK(limits);
+}
+
+/* Tells whether a child of the calling thread was killed because
+ * it took too long since the last time this was asked */
+gboolean pifo_spawn_timed_out(void){
+    gboolean result = GPOINTER_TO_INT(g_private_get(&timed_out));
+
+    g_private_set(&timed_out, GINT_TO_POINTER(FALSE));
+
+    return result;
+}
+
+/* Like pifo_spawn_timed_out(), but leaves the answer to whoever
+ * asks next */
+gboolean pifo_spawn_peek_timed_out(void){
+    return GPOINTER_TO_INT(g_private_get(&timed_out));
+}
+
+/* Largest resident set, in KB, any child of the calling thread
+ * had since the last time this was asked */
+glong pifo_spawn_peak_rss(void){
+    glong result = (glong) GPOINTER_TO_SIZE(g_private_get(&peak_rss));
+
+    g_private_set(&peak_rss, GSIZE_TO_POINTER(0));
+
+    return result;
+}
+
+static void close_fd(int *fd){
+    if (*fd != -1){
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+static void close_pipes(struct pifo_process *process){
+    close_fd(&process->in);
+    close_fd(&process->out);
+    close_fd(&process->err);
+}
+
+/* The end of pipe i the child gets, stdin is read from */
+static int child_end(int pipes[3][2], int i){
+    return i == 0 ? pipes[i][0] : pipes[i][1];
+}
+
+static gboolean needs_limits(const struct pifo_limits *current){
+    return current->cpu_s > 0 || current->memory_mb > 0
+        || current->nice > 0 || current->ioprio > 0;
+}
+
+static void set_rlimit(int resource, rlim_t value){
+    struct rlimit limit = { value, value };
+
+    setrlimit(resource, &limit);
+}
+
+/* Runs in the child between fork() and execve(). Pidgin has threads,
+ * one of which may have held a lock of malloc or stdio at the time of
+ * the fork, so only async-signal-safe calls are made here. Whatever
+ * needs more, like looking up the program in PATH, the parent did */
+static void G_GNUC_NORETURN exec_child(const char *path,
+        const char *cwd, char * const argv[], int flags, int pipes[3][2],
+        int devnull, const struct pifo_limits *current){
+    struct sigaction action;
+    sigset_t signals;
+    int i;
+
+    for (i=0; i<3; i++){
+        if (pipes[i][0] != -1)
+            dup2(child_end(pipes, i), i);
+        else if (i == 0 || flags & PIFO_SPAWN_SILENT)
+            dup2(devnull, i);
+    }
+
+    /* Pidgin ignores SIGPIPE, the tools should not */
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_DFL;
+    sigaction(SIGPIPE, &action, NULL);
+    setpgid(0, 0);
+
+    /* The limits hold before the tool runs a single instruction, and
+     * everything it starts later on inherits them */
+    if (current->cpu_s > 0)
+        set_rlimit(RLIMIT_CPU, (rlim_t) current->cpu_s);
+    if (current->memory_mb > 0)
+        set_rlimit(RLIMIT_AS, (rlim_t) current->memory_mb << 20);
+    if (current->nice > 0)
+        setpriority(PRIO_PROCESS, 0, current->nice);
+#ifdef __linux__
+    if (current->ioprio > 0)
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT
+                | MIN(current->ioprio, 7));
+#endif
+
+    sigemptyset(&signals);
+    sigprocmask(SIG_SETMASK, &signals, NULL);
+
+    if (cwd == NULL || chdir(cwd) == 0)
+        execve(path, argv, environ);
+
+    _exit(127);
+}
+
+/* Forks a child that sets itself up before it runs argv. Signals are
+ * blocked meanwhile, so none of Pidgin's handlers run in the child */
+static pid_t fork_child(const char *cwd, char * const argv[], int flags,
+        int pipes[3][2], const struct pifo_limits *current){
+    sigset_t all, old;
+    gchar *path;
+    pid_t pid;
+    int devnull, saved;
+
+    if ((path = g_find_program_in_path(argv[0])) == NULL){
+        errno = ENOENT;
+        return -1;
+    }
+
+    if ((devnull = open("/dev/null", O_RDWR | O_CLOEXEC)) == -1){
+        saved = errno;
+        g_free(path);
+        errno = saved;
+        return -1;
+    }
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    if ((pid = fork()) == 0)
+        exec_child(path, cwd, argv, flags, pipes, devnull, current);
+
+    saved = errno;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    close(devnull);
+    g_free(path);
+    errno = saved;
+
+    return pid;
+}
+
+/* Starts argv[0] (looked up in PATH) in cwd, or in our own working
+ * directory if that is NULL. Standard streams named in flags are
+ * connected to pipes, whose other ends end up in process. stdin is
+ * /dev/null unless it is piped. */
+gboolean pifo_spawn(const char *cwd, char * const argv[], int flags,
+        struct pifo_process *process){
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    struct pifo_limits current;
+    sigset_t signals;
+    int pipes[3][2] = {{-1, -1}, {-1, -1}, {-1, -1}};
+    GError *error = NULL;
+    int i, spawn_error = 0;
+
+    process->pid = 0;
+    process->in = process->out = process->err = -1;
+
+    G_LOCK(limits);
+    current = limits;
+    G_UNLOCK(limits);
+    process->timeout = (gint64) current.timeout_s * G_USEC_PER_SEC;
+
+    /* Close-on-exec, so no other child inherits our ends */
+    for (i=0; i<3; i++){
+        if ((flags & pipe_flags[i])
+                && !g_unix_open_pipe(pipes[i], FD_CLOEXEC, &error)){
+            pifo_debug_error("PiFo",
+                    "Could not create pipe for [%s]: [%s]\n",
+                    argv[0], error->message);
+            g_error_free(error);
+            goto out;
+        }
+    }
+
+    /* posix_spawn cannot set limits for the child, and setting them
+     * once it runs would leave the tool unlimited for a while */
+#ifdef HAVE_SPAWN_CHDIR
+    if (needs_limits(&current)){
+#else
+    if (needs_limits(&current) || cwd != NULL){
+#endif
+        if ((process->pid = fork_child(cwd, argv, flags, pipes,
+                        &current)) == -1){
+            spawn_error = errno;
+            process->pid = 0;
+        }
+        goto spawned;
+    }
+
+    posix_spawn_file_actions_init(&actions);
+    for (i=0; i<3; i++){
+        if (pipes[i][0] != -1){
+            posix_spawn_file_actions_adddup2(&actions,
+                    child_end(pipes, i), i);
+        } else if (i == 0 || flags & PIFO_SPAWN_SILENT){
+            posix_spawn_file_actions_addopen(&actions, i, "/dev/null",
+                    i == 0 ? O_RDONLY : O_WRONLY, 0);
+        }
+    }
+#ifdef HAVE_SPAWN_CHDIR
+    if (cwd != NULL)
+        posix_spawn_file_actions_addchdir_np(&actions, cwd);
+#endif
+
+    /* Pidgin ignores SIGPIPE, the tools should not */
+    posix_spawnattr_init(&attr);
+    sigemptyset(&signals);
+    posix_spawnattr_setsigmask(&attr, &signals);
+    sigaddset(&signals, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &signals);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP
+            | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    spawn_error = posix_spawnp(&process->pid, argv[0],
+            &actions, &attr, argv, environ);
+    if (spawn_error != 0)
+        process->pid = 0;
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+spawned:
+    if (process->pid == 0){
+        pifo_debug_error("PiFo",
+                "Could not start [%s]: [%s]\n",
+                argv[0], strerror(spawn_error));
+    } else {
+        process->in = pipes[0][1];
+        process->out = pipes[1][0];
+        process->err = pipes[2][0];
+        pipes[0][1] = pipes[1][0] = pipes[2][0] = -1;
+    }
+
+out:
+    for (i=0; i<3; i++){
+        close_fd(&pipes[i][0]);
+        close_fd(&pipes[i][1]);
+    }
+
+    return process->pid != 0;
+}
+
+static int exit_code(int status){
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/* waitpid() that also keeps track of the memory the child used */
+static pid_t reap(pid_t pid, int *status, int options){
+    struct rusage usage;
+    pid_t reaped;
+
+    if ((reaped = wait4(pid, status, options, &usage)) > 0
+            && (gsize) usage.ru_maxrss
+                > GPOINTER_TO_SIZE(g_private_get(&peak_rss)))
+        g_private_set(&peak_rss, GSIZE_TO_POINTER(usage.ru_maxrss));
+
+    return reaped;
+}
+
+static pid_t wait_blocking(pid_t pid, int *status){
+    pid_t reaped;
+
+    do {
+        reaped = reap(pid, status, 0);
+    } while (reaped == -1 && errno == EINTR);
+
+    return reaped;
+}
+
+/* Kills the whole process group of a child that ran into its
+ * deadline and reaps it */
+static void kill_overdue(struct pifo_process *process, int *status){
+    pifo_debug_error("PiFo",
+            "Killing [%d], it took longer than %" G_GINT64_FORMAT
+            " seconds\n", process->pid,
+            process->timeout / G_USEC_PER_SEC);
+    kill(-process->pid, SIGKILL);
+    g_private_set(&timed_out, GINT_TO_POINTER(TRUE));
+    wait_blocking(process->pid, status);
+}
+
+/* Sleeps until the child exits or the deadline passes, whichever
+ * comes first, without looking at it again and again. Returns at
+ * once if the kernel has no pidfds to wait on */
+static void wait_pidfd(pid_t pid, gint64 deadline){
+#ifdef __linux__
+    struct pollfd fd;
+    gint64 remaining;
+
+    if ((fd.fd = syscall(SYS_pidfd_open, pid, 0)) == -1)
+        return;
+    fd.events = POLLIN;
+
+    while ((remaining = deadline - g_get_monotonic_time()) > 0
+            && poll(&fd, 1, (int) MIN(remaining / 1000 + 1, G_MAXINT)) == -1
+            && errno == EINTR)
+        ;
+
+    close(fd.fd);
+#endif
+}
+
+/* Waits for the child until its deadline passes, then kills its
+ * whole process group */
+static pid_t wait_deadline(struct pifo_process *process, int *status){
+    gint64 deadline = g_get_monotonic_time() + process->timeout;
+    gulong interval = 1000;
+    pid_t reaped;
+
+    /* Once that returns, the child is either done or overdue,
+     * the loop below only polls if it could not be used */
+    wait_pidfd(process->pid, deadline);
+
+    while ((reaped = reap(process->pid, status, WNOHANG)) == 0
+            || (reaped == -1 && errno == EINTR)){
+        if (g_get_monotonic_time() >= deadline){
+            kill_overdue(process, status);
+            return -1;
+        }
+
+        g_usleep(interval);
+        interval = MIN(interval * 2, POLL_INTERVAL_MAX);
+    }
+
+    return reaped;
+}
+
+/* Closes our ends of the pipes, as the child may be waiting for the
+ * end of its input, and waits for it to exit. Anything the child
+ * writes into its pipes must have been read before. Returns the
+ * exit code, or -1 if the child did not exit normally or ran into
+ * its deadline. */
+int pifo_spawn_wait(struct pifo_process *process){
+    int status;
+    pid_t reaped;
+
+    close_pipes(process);
+
+    if (process->pid == 0)
+        return -1;
+
+    if (process->timeout > 0)
+        reaped = wait_deadline(process, &status);
+    else
+        reaped = wait_blocking(process->pid, &status);
+
+    process->pid = 0;
+
+    return reaped > 0 ? exit_code(status) : -1;
+}
+
+/* Feeds input into the stdin pipe of the child and collects what
+ * it writes to its stdout pipe into output at the same time, so
+ * neither side can block the other on a full pipe. Either pipe may
+ * be missing. The deadline covers the whole conversation, a child
+ * that neither reads nor writes is killed like one that does not
+ * exit. Then waits for the child like pifo_spawn_wait(). */
+int pifo_spawn_communicate(struct pifo_process *process,
+        const char *input, gsize length, GString *output){
+    struct pollfd fds[2];
+    gint64 deadline = 0, remaining;
+    gsize written = 0, old_length;
+    gssize transferred;
+    int status, count, i;
+
+    if (process->pid == 0){
+        close_pipes(process);
+        return -1;
+    }
+
+    if (process->timeout > 0)
+        deadline = g_get_monotonic_time() + process->timeout;
+
+    if (process->in != -1){
+        if (length == 0)
+            close_fd(&process->in);
+        else
+            fcntl(process->in, F_SETFL,
+                    fcntl(process->in, F_GETFL) | O_NONBLOCK);
+    }
+
+    while (process->in != -1 || process->out != -1){
+        count = 0;
+        if (process->in != -1){
+            fds[count].fd = process->in;
+            fds[count++].events = POLLOUT;
+        }
+        if (process->out != -1){
+            fds[count].fd = process->out;
+            fds[count++].events = POLLIN;
+        }
+
+        remaining = -1;
+        if (deadline > 0
+                && (remaining = deadline - g_get_monotonic_time()) <= 0){
+            close_pipes(process);
+            kill_overdue(process, &status);
+            process->pid = 0;
+            return -1;
+        }
+
+        if (poll(fds, count, remaining == -1 ? -1
+                    : (int) MIN(remaining / 1000 + 1, G_MAXINT)) == -1){
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        for (i=0; i<count; i++){
+            if (fds[i].revents == 0)
+                continue;
+
+            if (fds[i].fd == process->in){
+                transferred = write(process->in, input + written,
+                        length - written);
+                /* A child that stops reading gets EPIPE */
+                if (transferred == -1 && errno != EINTR && errno != EAGAIN)
+                    close_fd(&process->in);
+                else if (transferred > 0
+                        && (written += transferred) == length)
+                    close_fd(&process->in);
+            } else {
+                /* Read straight into the buffer, which grows
+                 * geometrically like every GString */
+                old_length = output->len;
+                g_string_set_size(output, old_length + READ_CHUNK);
+                transferred = read(process->out, output->str + old_length,
+                        READ_CHUNK);
+                g_string_truncate(output,
+                        old_length + MAX(transferred, 0));
+                if (transferred == 0 || (transferred == -1
+                            && errno != EINTR && errno != EAGAIN))
+                    close_fd(&process->out);
+            }
+        }
+    }
+
+    /* Whatever is left of the deadline applies to the exit */
+    if (deadline > 0)
+        process->timeout = MAX(deadline - g_get_monotonic_time(), 1);
+
+    return pifo_spawn_wait(process);
+}
+
+/* Reaps the child if it is gone already, without blocking */
+gboolean pifo_spawn_exited(struct pifo_process *process, int *exitcode){
+    int status;
+    pid_t reaped;
+
+    if (process->pid == 0)
+        return TRUE;
+
+    if ((reaped = reap(process->pid, &status, WNOHANG)) == 0)
+        return FALSE;
+
+    if (exitcode != NULL)
+        *exitcode = reaped > 0 ? exit_code(status) : -1;
+
+    process->pid = 0;
+    close_pipes(process);
+
+    return TRUE;
+}
+
+void pifo_spawn_kill(struct pifo_process *process){
+    close_pipes(process);
+
+    if (process->pid != 0){
+        kill(-process->pid, SIGKILL);
+        wait_blocking(process->pid, NULL);
+        process->pid = 0;
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef PIFO_SPAWN
+#define PIFO_SPAWN
+
+#include "pifo.h"
+
+#include <sys/types.h>
+
+/* Starting external tools. Children are created with posix_spawn,
+ * which does not have to copy the page tables of the whole Pidgin
+ * process like fork() does. Children that need limits posix_spawn
+ * cannot set are forked instead and set them up before they exec,
+ * like g_spawn does for a child setup function. Children are only
+ * ever reaped by their own pid, so renders running in parallel do
+ * not steal each other's exit codes. Every child leads its own
+ * process group, so it can be killed along with everything it
+ * started once it runs into one of the limits below. */
+
+/* Which standard streams of the child get a pipe to us */
+#define PIFO_SPAWN_PIPE_STDIN   (1 << 0)
+#define PIFO_SPAWN_PIPE_STDOUT  (1 << 1)
+#define PIFO_SPAWN_PIPE_STDERR  (1 << 2)
+/* Streams without a pipe go to /dev/null instead of our own */
+#define PIFO_SPAWN_SILENT       (1 << 3)
+
+/* 0 leaves the respective limit off */
+struct pifo_limits {
+    /* Wall clock time a child may take once it is waited for */
+    int timeout_s;
+    int cpu_s;
+    int memory_mb;
+    int nice;
+    /* Best effort I/O priority, 0 (high) to 7 (low) */
+    int ioprio;
+};
+
+struct pifo_process {
+    pid_t pid;
+    /* Wall clock deadline in microseconds, 0 for none */
+    gint64 timeout;
+    /* Our ends of the pipes, -1 if not requested */
+    int in;
+    int out;
+    int err;
+};
+
+void pifo_spawn_set_limits(const struct pifo_limits *limits);
+gboolean pifo_spawn_timed_out(void);
+gboolean pifo_spawn_peek_timed_out(void);
+glong pifo_spawn_peak_rss(void);
+gboolean pifo_spawn(const char *cwd, char * const argv[], int flags,
+        struct pifo_process *process);
+int pifo_spawn_wait(struct pifo_process *process);
+int pifo_spawn_communicate(struct pifo_process *process,
+        const char *input, gsize length, GString *output);
+gboolean pifo_spawn_exited(struct pifo_process *process, int *exitcode);
+void pifo_spawn_kill(struct pifo_process *process);
+
+#endif
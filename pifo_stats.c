@@ -0,0 +1,397 @@
+#include "pifo_stats.h"
+#include "pifo_util.h"
+#include "pifo.h"
+
+#include <string.h>
+
+/* Bucket i counts durations of at least 2^(i-1) and below 2^i
+ * microseconds, the last one everything longer (2^26 us are about
+ * a minute) */
+#define BUCKETS 28
+
+struct histogram {
+    guint64 count;
+    guint64 failures;
+    gint64 total_us;
+    gint64 max_us;
+    guint64 buckets[BUCKETS];
+};
+
+struct gauge {
+    gint64 current;
+    gint64 max;
+};
+
+static const char *stage_names[PIFO_STAGES] = {
+    "scan",
+    "queue",
+    "template",
+    "image_load",
+    "imgstore"
+};
+
+static const char *counter_names[PIFO_COUNTERS] = {
+    "cache_hits",
+    "disk_cache_hits",
+    "cache_misses",
+    "jobs",
+    "jobs_failed",
+    "jobs_timed_out"
+};
+
+static const char *gauge_names[PIFO_GAUGES] = {
+    "queue_depth",
+    "image_bytes"
+};
+
+/* The tools the backends run, anything else is counted as "other" */
+static const char *tool_names[] = {
+    "latex", "pdflatex", "dvipng", "pdftops", "convert", "dot", "pandoc",
+    "other"
+};
+#define TOOLS G_N_ELEMENTS(tool_names)
+
+/* Only switched from the main thread. Probes read it without the
+ * lock, at worst one sample is lost or taken too many */
+static gboolean enabled = FALSE;
+
+static struct histogram stages[PIFO_STAGES];
+static struct histogram tools[TOOLS];
+/* Command -> struct histogram, one for each backend seen so far */
+static GHashTable *backends = NULL;
+static guint64 counters[PIFO_COUNTERS];
+static struct gauge gauges[PIFO_GAUGES];
+static gint64 since = 0;
+
+static gchar *dump_path = NULL;
+static guint dump_source = 0;
+
+G_LOCK_DEFINE_STATIC(stats);
+
+static void record(struct histogram *histogram, gint64 elapsed,
+        gboolean ok){
+    int bucket = elapsed > 0
+        ? MIN((int) g_bit_storage((gulong) elapsed), BUCKETS - 1) : 0;
+
+    histogram->count++;
+    if (!ok)
+        histogram->failures++;
+    histogram->total_us += elapsed;
+    histogram->max_us = MAX(histogram->max_us, elapsed);
+    histogram->buckets[bucket]++;
+}
+
+/* Upper bound of the bucket the sample of rank percent/100 is in,
+ * but no more than the longest one seen */
+static gint64 percentile(const struct histogram *histogram, int percent){
+    guint64 rank = (histogram->count * percent + 99) / 100, seen = 0;
+    int bucket;
+
+    for (bucket=0; bucket<BUCKETS - 1; bucket++){
+        seen += histogram->buckets[bucket];
+        if (seen >= MAX(rank, 1))
+            return MIN((gint64) 1 << bucket, histogram->max_us);
+    }
+
+    return histogram->max_us;
+}
+
+void pifo_stats_init(void){
+    G_LOCK(stats);
+    memset(stages, 0, sizeof(stages));
+    memset(tools, 0, sizeof(tools));
+    memset(counters, 0, sizeof(counters));
+    memset(gauges, 0, sizeof(gauges));
+    backends = g_hash_table_new_full(g_str_hash, g_str_equal,
+            g_free, g_free);
+    since = g_get_real_time();
+    G_UNLOCK(stats);
+}
+
+void pifo_stats_shutdown(void){
+    pifo_stats_set_dump(NULL, 0);
+
+    G_LOCK(stats);
+    enabled = FALSE;
+    if (backends != NULL){
+        g_hash_table_destroy(backends);
+        backends = NULL;
+    }
+    G_UNLOCK(stats);
+}
+
+void pifo_stats_set_enabled(gboolean enable){
+    enabled = enable;
+}
+
+gint64 pifo_stats_start(void){
+    return enabled ? g_get_monotonic_time() : 0;
+}
+
+void pifo_stats_stage(enum pifo_stage stage, gint64 started){
+    gint64 elapsed;
+
+    if (started == 0 || !enabled)
+        return;
+
+    elapsed = g_get_monotonic_time() - started;
+
+    G_LOCK(stats);
+    record(&stages[stage], elapsed, TRUE);
+    G_UNLOCK(stats);
+}
+
+/* Only the first render of a backend allocates anything */
+void pifo_stats_backend(const char *command, gint64 started,
+        gboolean ok){
+    struct histogram *histogram;
+    gint64 elapsed;
+
+    if (started == 0 || !enabled)
+        return;
+
+    elapsed = g_get_monotonic_time() - started;
+
+    G_LOCK(stats);
+    if (backends != NULL){
+        if ((histogram = g_hash_table_lookup(backends, command)) == NULL){
+            histogram = g_new0(struct histogram, 1);
+            g_hash_table_insert(backends, g_strdup(command), histogram);
+        }
+        record(histogram, elapsed, ok);
+    }
+    G_UNLOCK(stats);
+}
+
+void pifo_stats_tool(const char *tool, gint64 started, int exitcode){
+    gint64 elapsed;
+    int i;
+
+    if (started == 0 || !enabled)
+        return;
+
+    elapsed = g_get_monotonic_time() - started;
+
+    for (i=0; i<TOOLS - 1; i++){
+        if (!strcmp(tool, tool_names[i]))
+            break;
+    }
+
+    G_LOCK(stats);
+    record(&tools[i], elapsed, exitcode == 0);
+    G_UNLOCK(stats);
+}
+
+void pifo_stats_count(enum pifo_counter counter){
+    if (!enabled)
+        return;
+
+    G_LOCK(stats);
+    counters[counter]++;
+    G_UNLOCK(stats);
+}
+
+void pifo_stats_gauge(enum pifo_gauge gauge, gint64 value){
+    if (!enabled)
+        return;
+
+    G_LOCK(stats);
+    gauges[gauge].current = value;
+    gauges[gauge].max = MAX(gauges[gauge].max, value);
+    G_UNLOCK(stats);
+}
+
+static void append_report_row(GString *report, const char *name,
+        const struct histogram *histogram){
+    gchar *escaped;
+
+    if (histogram->count == 0)
+        return;
+
+    escaped = g_markup_escape_text(name, -1);
+    g_string_append_printf(report,
+            "%s: %" G_GUINT64_FORMAT " times, "
+            "p50 %.1f ms, p95 %.1f ms, p99 %.1f ms, max %.1f ms",
+            escaped, histogram->count,
+            percentile(histogram, 50) / 1000.0,
+            percentile(histogram, 95) / 1000.0,
+            percentile(histogram, 99) / 1000.0,
+            histogram->max_us / 1000.0);
+    if (histogram->failures > 0)
+        g_string_append_printf(report,
+                ", %" G_GUINT64_FORMAT " failed", histogram->failures);
+    g_string_append(report, "<br>");
+    g_free(escaped);
+}
+
+/* Everything recorded so far, as html for purple_notify_formatted() */
+GString *pifo_stats_report(void){
+    GString *report = g_string_new(NULL);
+    GHashTableIter iter;
+    const char *command;
+    struct histogram *histogram;
+    int i;
+
+    if (!enabled){
+        g_string_append(report, "Statistics are turned off, set "
+                PREF_STATS " to collect them.");
+        return report;
+    }
+
+    G_LOCK(stats);
+    g_string_append(report, "<b>Stages</b><br>");
+    for (i=0; i<PIFO_STAGES; i++)
+        append_report_row(report, stage_names[i], &stages[i]);
+
+    g_string_append(report, "<br><b>Backends</b><br>");
+    if (backends != NULL){
+        g_hash_table_iter_init(&iter, backends);
+        while (g_hash_table_iter_next(&iter, (gpointer *) &command,
+                    (gpointer *) &histogram)){
+            append_report_row(report, command, histogram);
+        }
+    }
+
+    g_string_append(report, "<br><b>Tools</b><br>");
+    for (i=0; i<TOOLS; i++)
+        append_report_row(report, tool_names[i], &tools[i]);
+
+    g_string_append(report, "<br><b>Counters</b><br>");
+    for (i=0; i<PIFO_COUNTERS; i++)
+        g_string_append_printf(report, "%s: %" G_GUINT64_FORMAT "<br>",
+                counter_names[i], counters[i]);
+    for (i=0; i<PIFO_GAUGES; i++)
+        g_string_append_printf(report,
+                "%s: %" G_GINT64_FORMAT " (at most %" G_GINT64_FORMAT
+                ")<br>", gauge_names[i], gauges[i].current, gauges[i].max);
+    G_UNLOCK(stats);
+
+    return report;
+}
+
+static void append_json_histogram(GString *json, const char *name,
+        const struct histogram *histogram, gboolean first){
+    int bucket, used = 0;
+
+    if (!first)
+        g_string_append(json, ",");
+    g_string_append(json, "\n    ");
+    append_json(json, name);
+    g_string_append_printf(json,
+            ": {\"count\": %" G_GUINT64_FORMAT
+            ", \"failures\": %" G_GUINT64_FORMAT
+            ", \"mean_us\": %" G_GINT64_FORMAT
+            ", \"max_us\": %" G_GINT64_FORMAT
+            ", \"p50_us\": %" G_GINT64_FORMAT
+            ", \"p95_us\": %" G_GINT64_FORMAT
+            ", \"p99_us\": %" G_GINT64_FORMAT ", \"buckets\": [",
+            histogram->count, histogram->failures,
+            histogram->count > 0
+                ? histogram->total_us / (gint64) histogram->count : 0,
+            histogram->max_us,
+            percentile(histogram, 50), percentile(histogram, 95),
+            percentile(histogram, 99));
+
+    /* Trailing empty buckets are left out */
+    for (bucket=0; bucket<BUCKETS; bucket++){
+        if (histogram->buckets[bucket] > 0)
+            used = bucket + 1;
+    }
+    for (bucket=0; bucket<used; bucket++)
+        g_string_append_printf(json, "%s%" G_GUINT64_FORMAT,
+                bucket > 0 ? ", " : "", histogram->buckets[bucket]);
+
+    g_string_append(json, "]}");
+}
+
+/* Everything recorded so far as JSON. Bucket i of a histogram
+ * counts durations below bucket_bounds_us[i] and at least as long
+ * as the bound before, the last one everything longer */
+GString *pifo_stats_json(void){
+    GString *json = g_string_new(NULL);
+    GHashTableIter iter;
+    const char *command;
+    struct histogram *histogram;
+    gboolean first = TRUE;
+    int i;
+
+    G_LOCK(stats);
+    g_string_append_printf(json,
+            "{\n  \"enabled\": %s,\n  \"since\": %" G_GINT64_FORMAT
+            ",\n  \"now\": %" G_GINT64_FORMAT ",\n  \"bucket_bounds_us\": [",
+            enabled ? "true" : "false", since / G_USEC_PER_SEC,
+            g_get_real_time() / G_USEC_PER_SEC);
+    for (i=0; i<BUCKETS - 1; i++)
+        g_string_append_printf(json, "%s%" G_GINT64_FORMAT,
+                i > 0 ? ", " : "", (gint64) 1 << i);
+
+    g_string_append(json, "],\n  \"stages\": {");
+    for (i=0; i<PIFO_STAGES; i++)
+        append_json_histogram(json, stage_names[i], &stages[i], i == 0);
+
+    g_string_append(json, "\n  },\n  \"backends\": {");
+    if (backends != NULL){
+        g_hash_table_iter_init(&iter, backends);
+        while (g_hash_table_iter_next(&iter, (gpointer *) &command,
+                    (gpointer *) &histogram)){
+            append_json_histogram(json, command, histogram, first);
+            first = FALSE;
+        }
+    }
+
+    g_string_append(json, "\n  },\n  \"tools\": {");
+    for (i=0; i<TOOLS; i++)
+        append_json_histogram(json, tool_names[i], &tools[i], i == 0);
+
+    g_string_append(json, "\n  },\n  \"counters\": {");
+    for (i=0; i<PIFO_COUNTERS; i++)
+        g_string_append_printf(json, "%s\n    \"%s\": %" G_GUINT64_FORMAT,
+                i > 0 ? "," : "", counter_names[i], counters[i]);
+
+    g_string_append(json, "\n  },\n  \"gauges\": {");
+    for (i=0; i<PIFO_GAUGES; i++)
+        g_string_append_printf(json, "%s\n    \"%s\": {\"current\": %"
+                G_GINT64_FORMAT ", \"max\": %" G_GINT64_FORMAT "}",
+                i > 0 ? "," : "", gauge_names[i],
+                gauges[i].current, gauges[i].max);
+    g_string_append(json, "\n  }\n}\n");
+    G_UNLOCK(stats);
+
+    return json;
+}
+
+static gboolean dump_stats(gpointer data){
+    GString *json;
+    GError *error = NULL;
+
+    if (!enabled)
+        return TRUE;
+
+    json = pifo_stats_json();
+    if (!g_file_set_contents(dump_path, json->str, json->len, &error)){
+        purple_debug_error("PiFo",
+                "Could not write statistics to [%s]: [%s]\n",
+                dump_path, error->message);
+        g_error_free(error);
+    }
+    g_string_free(json, TRUE);
+
+    return TRUE;
+}
+
+/* Writes pifo_stats_json() to path every interval_s seconds, or
+ * stops doing so if interval_s is 0. Only from the main thread */
+void pifo_stats_set_dump(const char *path, int interval_s){
+    if (dump_source != 0){
+        g_source_remove(dump_source);
+        dump_source = 0;
+    }
+    g_free(dump_path);
+    dump_path = NULL;
+
+    if (path == NULL || interval_s <= 0)
+        return;
+
+    dump_path = g_strdup(path);
+    dump_source = g_timeout_add_seconds(interval_s, dump_stats, NULL);
+}
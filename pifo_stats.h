@@ -0,0 +1,66 @@
+#ifndef PIFO_STATS
+#define PIFO_STATS
+
+#include "pifo.h"
+
+/* Counters and latency histograms of what the plugin spends its
+ * time on: the stages a snippet goes through, every backend and
+ * every tool run. Recording takes a lock and a few additions into
+ * fixed tables, nothing is written out on the way. The numbers are
+ * only put together when someone asks for them, see
+ * pifo_stats_report(), pifo_stats_json() and pifo_stats_set_dump().
+ * With stats off, every probe is a single test. May be used from
+ * any thread. */
+
+enum pifo_stage {
+    /* Finding the commands of a message */
+    PIFO_STAGE_SCAN,
+    /* From submitting a job until a render thread takes it */
+    PIFO_STAGE_QUEUE,
+    /* Putting a template together, format dumps included */
+    PIFO_STAGE_TEMPLATE,
+    /* Decoding the png for the conversation */
+    PIFO_STAGE_IMAGE_LOAD,
+    /* Handing the image to the registry and the imgstore */
+    PIFO_STAGE_IMGSTORE,
+    PIFO_STAGES
+};
+
+enum pifo_counter {
+    PIFO_COUNT_CACHE_HIT,
+    PIFO_COUNT_DISK_CACHE_HIT,
+    PIFO_COUNT_CACHE_MISS,
+    PIFO_COUNT_JOBS,
+    PIFO_COUNT_JOBS_FAILED,
+    PIFO_COUNT_JOBS_TIMED_OUT,
+    PIFO_COUNTERS
+};
+
+/* Values that go up and down. The largest one seen is kept too */
+enum pifo_gauge {
+    /* Jobs waiting for a render thread */
+    PIFO_GAUGE_QUEUE_DEPTH,
+    /* What the images of all conversations take up */
+    PIFO_GAUGE_IMAGE_BYTES,
+    PIFO_GAUGES
+};
+
+void pifo_stats_init(void);
+void pifo_stats_shutdown(void);
+void pifo_stats_set_enabled(gboolean enabled);
+void pifo_stats_set_dump(const char *path, int interval_s);
+
+/* Probes take the time pifo_stats_start() returned when the work
+ * began, which is 0 when stats are off */
+gint64 pifo_stats_start(void);
+void pifo_stats_stage(enum pifo_stage stage, gint64 started);
+void pifo_stats_backend(const char *command, gint64 started,
+        gboolean ok);
+void pifo_stats_tool(const char *tool, gint64 started, int exitcode);
+void pifo_stats_count(enum pifo_counter counter);
+void pifo_stats_gauge(enum pifo_gauge gauge, gint64 value);
+
+GString *pifo_stats_report(void);
+GString *pifo_stats_json(void);
+
+#endif
@@ -0,0 +1,319 @@
+#include "pifo_trace.h"
+#include "pifo_util.h"
+#include "pifo.h"
+
+#include <string.h>
+#include <unistd.h>
+
+/* Spans kept, the oldest ones are dropped first */
+#define TRACE_SPANS 4096
+
+struct trace_span {
+    /* Static strings */
+    const char *name;
+    gint64 start_us;
+    gint64 duration_us;
+    guint thread;
+    gchar *detail;
+    /* "3,4", the jobs and snippet hashes the span worked for */
+    gchar *jobs;
+    gchar *snippets;
+    /* Of the child a tool span is about, 0 for other spans */
+    int pid;
+    int exitcode;
+};
+
+/* What each thread works on */
+struct trace_thread {
+    guint id;
+    gboolean main;
+    GString *jobs;
+    GString *snippets;
+    /* struct trace_span, while a message is open */
+    GArray *held;
+    gboolean holding;
+};
+
+static void free_thread(gpointer data);
+
+/* Only switched from the main thread. Spans check it without the
+ * lock, at worst one is lost or recorded too many */
+static gboolean enabled = FALSE;
+
+static struct trace_span spans[TRACE_SPANS];
+/* Where the next span goes, and how many there are */
+static guint next_span = 0;
+static guint span_count = 0;
+static guint next_thread = 1;
+/* Thread ids that ever recorded a span, and whether it was main */
+static GHashTable *threads = NULL;
+static GThread *main_thread = NULL;
+
+static GPrivate current = G_PRIVATE_INIT(free_thread);
+
+G_LOCK_DEFINE_STATIC(trace);
+
+static void free_span(struct trace_span *span){
+    g_free(span->detail);
+    g_free(span->jobs);
+    g_free(span->snippets);
+    memset(span, 0, sizeof(*span));
+}
+
+static void free_thread(gpointer data){
+    struct trace_thread *thread = data;
+    guint i;
+
+    g_string_free(thread->jobs, TRUE);
+    g_string_free(thread->snippets, TRUE);
+    for (i=0; i<thread->held->len; i++)
+        free_span(&g_array_index(thread->held, struct trace_span, i));
+    g_array_free(thread->held, TRUE);
+    g_free(thread);
+}
+
+static struct trace_thread *this_thread(void){
+    struct trace_thread *thread = g_private_get(&current);
+
+    if (thread != NULL)
+        return thread;
+
+    thread = g_new0(struct trace_thread, 1);
+    thread->main = g_thread_self() == main_thread;
+    thread->jobs = g_string_new(NULL);
+    thread->snippets = g_string_new(NULL);
+    thread->held = g_array_new(FALSE, TRUE, sizeof(struct trace_span));
+
+    G_LOCK(trace);
+    thread->id = next_thread++;
+    if (threads != NULL)
+        g_hash_table_insert(threads, GUINT_TO_POINTER(thread->id),
+                GINT_TO_POINTER(thread->main));
+    G_UNLOCK(trace);
+
+    g_private_set(&current, thread);
+
+    return thread;
+}
+
+/* Takes over the strings of span */
+static void append_span(struct trace_span *span){
+    G_LOCK(trace);
+    free_span(&spans[next_span]);
+    spans[next_span] = *span;
+    next_span = (next_span + 1) % TRACE_SPANS;
+    span_count = MIN(span_count + 1, TRACE_SPANS);
+    G_UNLOCK(trace);
+}
+
+/* Must be called from the main thread */
+void pifo_trace_init(void){
+    G_LOCK(trace);
+    main_thread = g_thread_self();
+    threads = g_hash_table_new(g_direct_hash, g_direct_equal);
+    G_UNLOCK(trace);
+}
+
+void pifo_trace_shutdown(void){
+    guint i;
+
+    G_LOCK(trace);
+    enabled = FALSE;
+    for (i=0; i<TRACE_SPANS; i++)
+        free_span(&spans[i]);
+    next_span = span_count = 0;
+    if (threads != NULL){
+        g_hash_table_destroy(threads);
+        threads = NULL;
+    }
+    G_UNLOCK(trace);
+}
+
+void pifo_trace_set_enabled(gboolean enable){
+    enabled = enable;
+}
+
+/* FNV-1a, shown as 16 hex digits */
+guint64 pifo_trace_hash(const GString *snippet){
+    guint64 hash = G_GUINT64_CONSTANT(14695981039346656037);
+    gsize i;
+
+    for (i=0; i<snippet->len; i++){
+        hash ^= (guchar) snippet->str[i];
+        hash *= G_GUINT64_CONSTANT(1099511628211);
+    }
+
+    return hash;
+}
+
+void pifo_trace_add_job(guint job, guint64 hash){
+    struct trace_thread *thread;
+
+    if (!enabled)
+        return;
+
+    thread = this_thread();
+    if (thread->jobs->len > 0){
+        g_string_append_c(thread->jobs, ',');
+        g_string_append_c(thread->snippets, ',');
+    }
+    g_string_append_printf(thread->jobs, "%u", job);
+    g_string_append_printf(thread->snippets, "%016" G_GINT64_MODIFIER "x",
+            hash);
+}
+
+void pifo_trace_clear_jobs(void){
+    struct trace_thread *thread = g_private_get(&current);
+
+    if (thread == NULL)
+        return;
+
+    g_string_truncate(thread->jobs, 0);
+    g_string_truncate(thread->snippets, 0);
+}
+
+void pifo_trace_message_begin(void){
+    struct trace_thread *thread;
+
+    if (!enabled)
+        return;
+
+    thread = this_thread();
+    pifo_trace_clear_jobs();
+    thread->holding = TRUE;
+}
+
+void pifo_trace_message_end(void){
+    struct trace_thread *thread = g_private_get(&current);
+    struct trace_span *span;
+    guint i;
+
+    if (thread == NULL || !thread->holding)
+        return;
+
+    for (i=0; i<thread->held->len; i++){
+        span = &g_array_index(thread->held, struct trace_span, i);
+        span->jobs = g_strdup(thread->jobs->str);
+        span->snippets = g_strdup(thread->snippets->str);
+        append_span(span);
+    }
+    g_array_set_size(thread->held, 0);
+
+    thread->holding = FALSE;
+    pifo_trace_clear_jobs();
+}
+
+gint64 pifo_trace_start(void){
+    return enabled ? g_get_monotonic_time() : 0;
+}
+
+static void record(const char *name, gint64 started, const char *detail,
+        int pid, int exitcode){
+    struct trace_thread *thread;
+    struct trace_span span;
+
+    if (started == 0 || !enabled)
+        return;
+
+    thread = this_thread();
+
+    span.name = name;
+    span.start_us = started;
+    span.duration_us = g_get_monotonic_time() - started;
+    span.thread = thread->id;
+    span.detail = g_strdup(detail);
+    span.pid = pid;
+    span.exitcode = exitcode;
+
+    if (thread->holding){
+        span.jobs = span.snippets = NULL;
+        g_array_append_val(thread->held, span);
+        return;
+    }
+
+    span.jobs = g_strdup(thread->jobs->str);
+    span.snippets = g_strdup(thread->snippets->str);
+    append_span(&span);
+}
+
+void pifo_trace_span(const char *name, gint64 started, const char *detail){
+    record(name, started, detail, 0, 0);
+}
+
+/* A tool that ran as child pid and exited with exitcode */
+void pifo_trace_child(const char *tool, gint64 started, int pid,
+        int exitcode){
+    record(tool, started, NULL, pid, exitcode);
+}
+
+static void append_json_span(GString *json, const struct trace_span *span,
+        int pid){
+    g_string_append(json, ",\n  {\"name\": ");
+    append_json(json, span->name);
+    g_string_append_printf(json, ", \"cat\": \"%s\", \"ph\": \"X\", "
+            "\"ts\": %" G_GINT64_FORMAT ", \"dur\": %" G_GINT64_FORMAT
+            ", \"pid\": %d, \"tid\": %u, \"args\": {\"jobs\": ",
+            span->pid != 0 ? "tool" : "pifo",
+            span->start_us, span->duration_us, pid, span->thread);
+    append_json(json, span->jobs != NULL ? span->jobs : "");
+    g_string_append(json, ", \"snippets\": ");
+    append_json(json, span->snippets != NULL ? span->snippets : "");
+    if (span->detail != NULL){
+        g_string_append(json, ", \"detail\": ");
+        append_json(json, span->detail);
+    }
+    if (span->pid != 0)
+        g_string_append_printf(json,
+                ", \"child_pid\": %d, \"exit_code\": %d",
+                span->pid, span->exitcode);
+    g_string_append(json, "}}");
+}
+
+/* How many spans pifo_trace_json() would write */
+guint pifo_trace_count(void){
+    guint count;
+
+    G_LOCK(trace);
+    count = span_count;
+    G_UNLOCK(trace);
+
+    return count;
+}
+
+/* The spans recorded so far, oldest first, as a Chrome trace. Times
+ * are microseconds of the monotonic clock */
+GString *pifo_trace_json(void){
+    GString *json = g_string_new("{\"displayTimeUnit\": \"ms\", "
+            "\"traceEvents\": [\n  {\"name\": \"process_name\", "
+            "\"ph\": \"M\", ");
+    int pid = getpid();
+    GHashTableIter iter;
+    gpointer id, main;
+    guint i;
+
+    g_string_append_printf(json, "\"pid\": %d, \"tid\": 0, "
+            "\"args\": {\"name\": \"Pidgin (PiFo)\"}}", pid);
+
+    G_LOCK(trace);
+    if (threads != NULL){
+        g_hash_table_iter_init(&iter, threads);
+        while (g_hash_table_iter_next(&iter, &id, &main)){
+            g_string_append_printf(json,
+                    ",\n  {\"name\": \"thread_name\", \"ph\": \"M\", "
+                    "\"pid\": %d, \"tid\": %u, \"args\": {\"name\": "
+                    "\"%s %u\"}}", pid, GPOINTER_TO_UINT(id),
+                    GPOINTER_TO_INT(main) ? "main" : "render",
+                    GPOINTER_TO_UINT(id));
+        }
+    }
+
+    for (i=0; i<span_count; i++)
+        append_json_span(json,
+                &spans[(next_span + TRACE_SPANS - span_count + i)
+                    % TRACE_SPANS], pid);
+    G_UNLOCK(trace);
+
+    g_string_append(json, "\n]}\n");
+
+    return json;
+}
@@ -0,0 +1,42 @@
+#ifndef PIFO_TRACE
+#define PIFO_TRACE
+
+#include "pifo.h"
+
+/* Traces of what happened to the snippets of the last messages, in
+ * the Chrome trace event format (chrome://tracing, ui.perfetto.dev).
+ * Every span is tagged with the jobs it worked for, and the hashes
+ * of their snippets, so a slow message can be followed from
+ * message_receive() through its render thread and every tool run
+ * back into the conversation, next to whatever other jobs ran at
+ * the same time. Spans are kept in a ring of the last few thousand
+ * and only turned into JSON by pifo_trace_json(). May be used from
+ * any thread. */
+
+void pifo_trace_init(void);
+void pifo_trace_shutdown(void);
+void pifo_trace_set_enabled(gboolean enabled);
+
+guint64 pifo_trace_hash(const GString *snippet);
+
+/* The jobs the spans of the calling thread work for from now on */
+void pifo_trace_add_job(guint job, guint64 hash);
+void pifo_trace_clear_jobs(void);
+
+/* Spans of the calling thread are held back until the message is
+ * done, so the ones from before its jobs were submitted get their
+ * ids too */
+void pifo_trace_message_begin(void);
+void pifo_trace_message_end(void);
+
+/* Spans take the time pifo_trace_start() returned when the work
+ * began, which is 0 when tracing is off */
+gint64 pifo_trace_start(void);
+void pifo_trace_span(const char *name, gint64 started, const char *detail);
+void pifo_trace_child(const char *tool, gint64 started, int pid,
+        int exitcode);
+
+guint pifo_trace_count(void);
+GString *pifo_trace_json(void);
+
+#endif
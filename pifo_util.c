@@ -1,79 +1,192 @@
 #include "pifo_util.h"
 #include "pifo.h"
 #include "pifo_generator.h"
+#include "pifo_spawn.h"
+#include "pifo_stats.h"
+#include "pifo_trace.h"
 #include <string.h>
+#include <stdarg.h>
 #include <unistd.h>
-#include <sys/wait.h>
-#include <errno.h>
 
-GString *get_unique_tmppath(void){
-    FILE *temp;
-    char *filename_temp;
-    GString *result = g_string_new(NULL);
+/* Most rendered images fit in here without growing the buffer */
+#define READ_SIZE_HINT (16 * 1024)
 
-    temp = purple_mkstemp(&filename_temp,TRUE);
-    fclose(temp);
-    unlink(filename_temp);
-    g_string_append(result, filename_temp);
-    free(filename_temp);
+struct deferred_debug {
+    PurpleDebugLevel level;
+    gchar *category;
+    gchar *text;
+};
 
-    return result;
+static GThread *main_thread = NULL;
+
+/* Remembers the thread running the purple main loop */
+void pifo_util_init(void){
+    main_thread = g_thread_self();
+}
+
+static gboolean flush_debug(gpointer data){
+    struct deferred_debug *debug = data;
+
+    purple_debug(debug->level, debug->category, "%s", debug->text);
+
+    g_free(debug->category);
+    g_free(debug->text);
+    g_free(debug);
+
+    return FALSE;
+}
+
+void pifo_debug(PurpleDebugLevel level, const char *category,
+        const char *format, ...){
+    struct deferred_debug *debug;
+    va_list args;
+
+    va_start(args, format);
+
+    if (main_thread == NULL || g_thread_self() == main_thread){
+        gchar *text = g_strdup_vprintf(format, args);
+        purple_debug(level, category, "%s", text);
+        g_free(text);
+    } else {
+        debug = g_new0(struct deferred_debug, 1);
+        debug->level = level;
+        debug->category = g_strdup(category);
+        debug->text = g_strdup_vprintf(format, args);
+        g_idle_add(flush_debug, debug);
+    }
+
+    va_end(args);
 }
 
-/* Helper function for command execution */
-int execute(const char *prog, char * const cmd[]){
-	int i = 0;
-	int j = 0;
-	int exitcode = -1, exitstatus;
-	pid_t child_id = 0;
+/* Helper function for command execution. Runs the program in cwd
+ * (or ours, if that is NULL) to its end and returns its exit
+ * code, or -1 if it could not be run */
+int execute(const char *cwd, const char *prog, char * const cmd[]){
+	struct pifo_process process;
+	gint64 started = pifo_stats_start();
+	gint64 traced = pifo_trace_start();
+	pid_t pid;
+	int exitcode;
 
-	purple_debug_info("PiFo",
+	pifo_debug_info("PiFo",
             "Execution of program"
             "[%s] started\n",
             cmd[0]);
 
+	if (!pifo_spawn(cwd, cmd, 0, &process))
+		return -1;
+
+	pid = process.pid;
+	exitcode = pifo_spawn_wait(&process);
+	pifo_stats_tool(prog, started, exitcode);
+	pifo_trace_child(prog, traced, pid, exitcode);
 
-    child_id = fork();
-	switch (child_id) {
-        case 0:
-            /* In child */
-		    exitcode = execvp(prog, cmd);
-		    exit(exitcode);
-            break;
-        case -1:
-            purple_debug_error("LaTeX",
-                    "[execute()] Error while executing '%s'",
-                    "Could not fork");
-            return exitcode;
-            break;
-        default:
-            /* In parent. Nothing to do */
-            break;
+	if (exitcode != -1) {
+		pifo_debug_info("LaTeX",
+                "[execute()] '%s' ended normally "
+                "with exitcode '%d'\n",
+                prog, exitcode);
+	} else {
+		pifo_debug_error("LaTeX",
+                "[execute()] '%s' ended abnormally\n",
+                prog);
 	}
 
-	if (wait(&exitstatus) > 0) {
-		if (WIFEXITED(exitstatus)) {
-			exitcode = WEXITSTATUS(exitstatus);
-			purple_debug_info("LaTeX",
-                    "[execute()] '%s' ended normally "
-                    "with exitcode '%d'\n",
-                    prog, exitcode);
-		} else {
-			purple_debug_error("LaTeX",
-                    "[execute()] '%s' ended abnormally "
-                    "via the signal '%d'\n",
-                    prog, WTERMSIG(exitstatus));
-        }
+	return exitcode;
+}
+
+/* Like execute(), but streams input (if not NULL) into the stdin
+ * of the program and collects its stdout into *output (if not
+ * NULL), which is left NULL unless the program exits with 0. No
+ * file has to be written for the program or read back from it */
+int execute_pipe(const char *cwd, const char *prog, char * const cmd[],
+        const GString *input, GString **output){
+	struct pifo_process process;
+	GString *collected = NULL;
+	gint64 started = pifo_stats_start();
+	gint64 traced = pifo_trace_start();
+	pid_t pid;
+	int exitcode, flags = 0;
+
+	pifo_debug_info("PiFo",
+            "Execution of program"
+            "[%s] started with pipes\n",
+            cmd[0]);
+
+	if (input != NULL)
+		flags |= PIFO_SPAWN_PIPE_STDIN;
+	if (output != NULL){
+		*output = NULL;
+		flags |= PIFO_SPAWN_PIPE_STDOUT;
+		collected = g_string_sized_new(READ_SIZE_HINT);
+	}
+
+	if (!pifo_spawn(cwd, cmd, flags, &process)){
+		if (collected != NULL)
+			g_string_free(collected, TRUE);
+		return -1;
+	}
+
+	pid = process.pid;
+	exitcode = pifo_spawn_communicate(&process,
+            input ? input->str : NULL, input ? input->len : 0,
+            collected);
+	pifo_stats_tool(prog, started, exitcode);
+	pifo_trace_child(prog, traced, pid, exitcode);
+
+	if (exitcode != -1) {
+		pifo_debug_info("LaTeX",
+                "[execute_pipe()] '%s' ended normally "
+                "with exitcode '%d' after writing %lu bytes\n",
+                prog, exitcode,
+                (unsigned long) (collected ? collected->len : 0));
 	} else {
-		purple_debug_error("LaTeX",
-                "Error while executing [%s]. "
-                "The following error occured: [%s](%d)\n",
-                prog, strerror(errno), errno);
+		pifo_debug_error("LaTeX",
+                "[execute_pipe()] '%s' ended abnormally\n",
+                prog);
+	}
+
+	if (collected != NULL){
+		if (exitcode == 0)
+			*output = collected;
+		else
+			g_string_free(collected, TRUE);
 	}
 
 	return exitcode;
 }
 
+/* What a tool says about its version, on stdout and stderr alike.
+ * A tool that is not installed says nothing, which gives "" */
+gchar *tool_version(char * const cmd[]){
+	gchar *out = NULL, *err = NULL, *version;
+
+	g_spawn_sync(NULL, (gchar **) cmd, NULL, G_SPAWN_SEARCH_PATH,
+			NULL, NULL, &out, &err, NULL, NULL);
+
+	version = g_strconcat(out ? out : "", err ? err : "", NULL);
+	g_free(out);
+	g_free(err);
+
+	return version;
+}
+
+/* Appends string to json as a quoted and escaped JSON string */
+void append_json(GString *json, const char *string){
+    const char *c;
+
+    g_string_append_c(json, '"');
+    for (c = string; *c != '\0'; c++){
+        if (*c == '"' || *c == '\\')
+            g_string_append_printf(json, "\\%c", *c);
+        else if ((guchar) *c < 0x20)
+            g_string_append_printf(json, "\\u%04x", (guchar) *c);
+        else
+            g_string_append_c(json, *c);
+    }
+    g_string_append_c(json, '"');
+}
+
 /* Cuts off the file name in file leaving you with just the path.
  * The function also makes a new copy of the string on the heap.
  */
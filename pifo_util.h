@@ -3,9 +3,23 @@
 
 #include "pifo.h"
 
-GString *get_unique_tmppath(void);
-int execute(const char *prog, char * const cmd[]);
+/* Debug output that may be issued from render threads. Messages
+ * coming from other threads than the main loop are handed over
+ * to it, because libpurple's debug ui is not thread safe */
+#define pifo_debug_info(category, ...) \
+    pifo_debug(PURPLE_DEBUG_INFO, category, __VA_ARGS__)
+#define pifo_debug_error(category, ...) \
+    pifo_debug(PURPLE_DEBUG_ERROR, category, __VA_ARGS__)
+
+void pifo_util_init(void);
+void pifo_debug(PurpleDebugLevel level, const char *category,
+        const char *format, ...);
+int execute(const char *cwd, const char *prog, char * const cmd[]);
+int execute_pipe(const char *cwd, const char *prog, char * const cmd[],
+        const GString *input, GString **output);
 char* getfilename(const char const *file);
 char* getdirname(const char const *file);
+gchar *tool_version(char * const cmd[]);
+void append_json(GString *json, const char *string);
 
 #endif
@@ -0,0 +1,395 @@
+#include "pifo_worker.h"
+#include "pifo_spawn.h"
+#include "pifo_workspace.h"
+#include "pifo_stats.h"
+#include "pifo_trace.h"
+#include "pifo_util.h"
+#include "pifo.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+/* Idle workers kept per format */
+#define WARM_WORKERS 2
+
+/* Idle workers kept over all formats. Every color, preamble and
+ * tikz variant has a format of its own, only the ones used last
+ * keep their workers */
+#define IDLE_WORKERS_MAX 4
+
+/* Idle workers older than this are replaced by fresh ones */
+#define WORKER_MAX_AGE (10 * 60 * G_USEC_PER_SEC)
+
+/* Pools nobody took a worker from for this long are dropped */
+#define POOL_MAX_UNUSED (2 * 60 * G_USEC_PER_SEC)
+/* How often dead, old and unused workers are looked for */
+#define REAP_INTERVAL_S 30
+
+#define WORKER_JOBNAME "pifo"
+
+struct tex_worker {
+    struct pifo_process process;
+    gchar *dir;
+    gint64 started;
+};
+
+struct worker_pool {
+    gchar *engine;
+    gchar *format;
+    GQueue idle;
+    /* When a worker was last taken from it */
+    gint64 used;
+};
+
+/* "engine format" -> struct worker_pool */
+static GHashTable *pools = NULL;
+static guint reap_source = 0;
+G_LOCK_DEFINE_STATIC(workers);
+
+/* The worker gets "\relax" as its first line, so it loads the
+ * format right away and then asks the terminal (our pipe) for
+ * more. In nonstopmode reading from the terminal is fatal, so
+ * it has to run in scrollmode. */
+static struct tex_worker *spawn_worker(const char *engine,
+        const char *format){
+    struct tex_worker *worker;
+    gchar *fmtopt = g_strdup_printf("-fmt=%s", format);
+    gchar *dir;
+
+    char *argv[] = {
+        (char *) engine,
+        "--no-shell-escape",
+        "--interaction=scrollmode",
+        fmtopt,
+        "-jobname=" WORKER_JOBNAME,
+        "\\relax", NULL
+    };
+
+    if ((dir = pifo_workspace_acquire()) == NULL){
+        g_free(fmtopt);
+        return NULL;
+    }
+
+    worker = g_new0(struct tex_worker, 1);
+    worker->dir = dir;
+    worker->started = g_get_monotonic_time();
+
+    if (!pifo_spawn(dir, argv,
+                PIFO_SPAWN_PIPE_STDIN | PIFO_SPAWN_SILENT,
+                &worker->process)){
+        pifo_workspace_release(dir);
+        g_free(worker);
+        worker = NULL;
+    }
+
+    g_free(fmtopt);
+
+    return worker;
+}
+
+static void retire_worker(struct tex_worker *worker){
+    pifo_spawn_kill(&worker->process);
+
+    pifo_workspace_release(worker->dir);
+    g_free(worker);
+}
+
+/* A worker is healthy as long as it still waits for its job
+ * and has not been idle for too long */
+static gboolean worker_healthy(struct tex_worker *worker){
+    if (pifo_spawn_exited(&worker->process, NULL))
+        return FALSE;
+
+    return g_get_monotonic_time() - worker->started < WORKER_MAX_AGE;
+}
+
+/* Killing a worker waits for it, so that is done without the lock */
+static void retire_workers(GList *retired){
+    GList *item;
+
+    for (item = retired; item != NULL; item = item->next)
+        retire_worker(item->data);
+    g_list_free(retired);
+}
+
+/* Takes idle workers from the pools used longest ago, but never
+ * from keep, until no more than IDLE_WORKERS_MAX are left. They
+ * are added to retired. Must hold the lock */
+static GList *trim_pools(struct worker_pool *keep, GList *retired){
+    GHashTableIter iter;
+    struct worker_pool *pool, *oldest;
+    guint idle;
+
+    for (;;){
+        idle = 0;
+        oldest = NULL;
+
+        g_hash_table_iter_init(&iter, pools);
+        while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &pool)){
+            idle += g_queue_get_length(&pool->idle);
+            if (pool != keep && !g_queue_is_empty(&pool->idle)
+                    && (oldest == NULL || pool->used < oldest->used))
+                oldest = pool;
+        }
+
+        if (idle <= IDLE_WORKERS_MAX || oldest == NULL)
+            return retired;
+
+        retired = g_list_prepend(retired, g_queue_pop_head(&oldest->idle));
+    }
+}
+
+/* Runs in the main thread every REAP_INTERVAL_S */
+static gboolean reap_workers(gpointer data){
+    GHashTableIter iter;
+    struct worker_pool *pool;
+    struct tex_worker *worker;
+    GList *item, *next, *retired = NULL;
+    gint64 now = g_get_monotonic_time();
+
+    G_LOCK(workers);
+    if (pools == NULL){
+        G_UNLOCK(workers);
+        return FALSE;
+    }
+
+    g_hash_table_iter_init(&iter, pools);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &pool)){
+        if (now - pool->used > POOL_MAX_UNUSED){
+            while ((worker = g_queue_pop_head(&pool->idle)) != NULL)
+                retired = g_list_prepend(retired, worker);
+            g_hash_table_iter_remove(&iter);
+            continue;
+        }
+
+        for (item = pool->idle.head; item != NULL; item = next){
+            next = item->next;
+            if (!worker_healthy(item->data)){
+                retired = g_list_prepend(retired, item->data);
+                g_queue_delete_link(&pool->idle, item);
+            }
+        }
+    }
+    G_UNLOCK(workers);
+
+    retire_workers(retired);
+
+    return TRUE;
+}
+
+static void free_pool(gpointer data){
+    struct worker_pool *pool = data;
+    struct tex_worker *worker;
+
+    while ((worker = g_queue_pop_head(&pool->idle)) != NULL)
+        retire_worker(worker);
+
+    g_free(pool->engine);
+    g_free(pool->format);
+    g_free(pool);
+}
+
+static struct tex_worker *take_worker(const char *engine,
+        const char *format){
+    struct worker_pool *pool;
+    struct tex_worker *worker = NULL, *spare;
+    GList *retired = NULL;
+    gchar *key = g_strdup_printf("%s %s", engine, format);
+    guint wanted;
+
+    G_LOCK(workers);
+    if (pools == NULL){
+        G_UNLOCK(workers);
+        g_free(key);
+        return NULL;
+    }
+
+    if ((pool = g_hash_table_lookup(pools, key)) == NULL){
+        pool = g_new0(struct worker_pool, 1);
+        pool->engine = g_strdup(engine);
+        pool->format = g_strdup(format);
+        g_queue_init(&pool->idle);
+        g_hash_table_insert(pools, g_strdup(key), pool);
+    }
+    pool->used = g_get_monotonic_time();
+
+    while (worker == NULL
+            && (worker = g_queue_pop_head(&pool->idle)) != NULL){
+        if (!worker_healthy(worker)){
+            pifo_debug_info("PiFo",
+                    "Recycling stale [%s] worker\n", engine);
+            retired = g_list_prepend(retired, worker);
+            worker = NULL;
+        }
+    }
+
+    wanted = WARM_WORKERS - MIN(g_queue_get_length(&pool->idle),
+            WARM_WORKERS);
+    G_UNLOCK(workers);
+
+    retire_workers(retired);
+    retired = NULL;
+
+    /* Nothing warm yet, this one starts cold */
+    if (worker == NULL)
+        worker = spawn_worker(engine, format);
+
+    /* Keep the pool topped up for the next jobs. The new workers
+     * load their format while this job runs. Other render threads
+     * need not wait for them to be started */
+    for (; wanted > 0; wanted--){
+        if ((spare = spawn_worker(engine, format)) == NULL)
+            break;
+
+        G_LOCK(workers);
+        if (pools != NULL
+                && (pool = g_hash_table_lookup(pools, key)) != NULL
+                && g_queue_get_length(&pool->idle) < WARM_WORKERS){
+            g_queue_push_tail(&pool->idle, spare);
+            spare = NULL;
+            retired = trim_pools(pool, retired);
+        }
+        G_UNLOCK(workers);
+
+        /* Another thread topped the pool up first */
+        if (spare != NULL){
+            retire_worker(spare);
+            break;
+        }
+    }
+
+    retire_workers(retired);
+    g_free(key);
+
+    return worker;
+}
+
+static gboolean write_all(int fd, const char *data, gsize length){
+    gssize written;
+
+    while (length > 0){
+        written = write(fd, data, length);
+        if (written == -1){
+            if (errno == EINTR)
+                continue;
+            return FALSE;
+        }
+        data += written;
+        length -= written;
+    }
+
+    return TRUE;
+}
+
+static gboolean move_file(const char *from, const char *to){
+    gchar *data;
+    gsize size;
+    gboolean moved;
+
+    if (rename(from, to) == 0)
+        return TRUE;
+
+    /* Workers and jobs may live on different file systems */
+    if (!g_file_get_contents(from, &data, &size, NULL))
+        return FALSE;
+
+    moved = g_file_set_contents(to, data, size, NULL);
+    g_free(data);
+
+    return moved;
+}
+
+void pifo_worker_init(void){
+    G_LOCK(workers);
+    pools = g_hash_table_new_full(g_str_hash, g_str_equal,
+            g_free, free_pool);
+    G_UNLOCK(workers);
+
+    reap_source = g_timeout_add_seconds(REAP_INTERVAL_S,
+            reap_workers, NULL);
+}
+
+void pifo_worker_shutdown(void){
+    if (reap_source != 0){
+        g_source_remove(reap_source);
+        reap_source = 0;
+    }
+
+    G_LOCK(workers);
+    if (pools != NULL){
+        g_hash_table_destroy(pools);
+        pools = NULL;
+    }
+    G_UNLOCK(workers);
+}
+
+/* Compiles body with a warm worker of engine that has format
+ * loaded and moves the output file (of type suffix) to output,
+ * and the log to log unless that is NULL. Returns the exit code
+ * of the engine like execute() does, or -1 if no worker could
+ * be used at all, e.g. because the format did not load. */
+int pifo_worker_compile(const char *engine, const char *format,
+        const char *body, const char *suffix, const GString *output,
+        const GString *log){
+    struct tex_worker *worker;
+    gchar *produced, *logfile;
+    gint64 started, traced;
+    pid_t pid;
+    int exitcode;
+
+    if ((worker = take_worker(engine, format)) == NULL)
+        return -1;
+
+    started = pifo_stats_start();
+    traced = pifo_trace_start();
+    pid = worker->process.pid;
+
+    pifo_debug_info("PiFo",
+            "Compiling with [%s] worker [%d]\n",
+            engine, worker->process.pid);
+
+    /* Pidgin ignores SIGPIPE, a worker that died early
+     * just makes the write fail */
+    if (!write_all(worker->process.in, body, strlen(body))
+            || !write_all(worker->process.in, "\n", 1)){
+        pifo_debug_error("PiFo",
+                "Could not feed [%s] worker: [%s]\n",
+                engine, strerror(errno));
+        retire_worker(worker);
+        return -1;
+    }
+
+    /* Closing its input lets the worker run into the end */
+    exitcode = pifo_spawn_wait(&worker->process);
+    pifo_stats_tool(engine, started, exitcode);
+    pifo_trace_child(engine, traced, pid, exitcode);
+
+    produced = g_strdup_printf("%s" G_DIR_SEPARATOR_S WORKER_JOBNAME ".%s",
+            worker->dir, suffix);
+
+    if (exitcode == 0 && !move_file(produced, output->str)){
+        pifo_debug_error("PiFo",
+                "Worker output [%s] is missing\n", produced);
+        exitcode = -1;
+    }
+
+    /* The log is wanted even if the engine failed. A worker that
+     * could not load its format stopped before it opened the log,
+     * it never got to the job */
+    logfile = g_strdup_printf("%s" G_DIR_SEPARATOR_S WORKER_JOBNAME ".log",
+            worker->dir);
+    if (exitcode > 0 && !g_file_test(logfile, G_FILE_TEST_EXISTS)){
+        pifo_debug_error("PiFo",
+                "[%s] worker could not load [%s]\n", engine, format);
+        exitcode = -1;
+    }
+    if (log != NULL && exitcode != -1)
+        move_file(logfile, log->str);
+
+    g_free(produced);
+    g_free(logfile);
+    retire_worker(worker);
+
+    return exitcode;
+}
@@ -0,0 +1,19 @@
+#ifndef PIFO_WORKER
+#define PIFO_WORKER
+
+#include "pifo.h"
+
+/* Warm TeX processes. A worker is started ahead of time with its
+ * format already loaded and then sits waiting for a document body
+ * on its stdin. TeX only finishes its output file on exit, so
+ * every worker serves a single job and a fresh one is started
+ * in its place right away. */
+
+void pifo_worker_init(void);
+void pifo_worker_shutdown(void);
+
+int pifo_worker_compile(const char *engine, const char *format,
+        const char *body, const char *suffix, const GString *output,
+        const GString *log);
+
+#endif
@@ -0,0 +1,237 @@
+#include "pifo_workspace.h"
+#include "pifo_util.h"
+#include "pifo.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#ifdef __linux__
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#endif
+
+#define SHM_DIR "/dev/shm"
+
+/* Idle directories kept around for the next jobs */
+#define WORKSPACE_POOL 8
+
+/* Our own directory below the one of the user. Every Pidgin the
+ * user runs has one, locked for as long as it runs */
+static gchar *root = NULL;
+static int root_lock = -1;
+static GQueue idle = G_QUEUE_INIT;
+G_LOCK_DEFINE_STATIC(workspaces);
+
+/* Removes everything below path, and path itself if asked to */
+static void empty_directory(const char *path, gboolean remove_self){
+    GDir *dir;
+    const gchar *name;
+    gchar *file;
+
+    if ((dir = g_dir_open(path, 0, NULL)) != NULL){
+        while ((name = g_dir_read_name(dir)) != NULL){
+            file = g_build_filename(path, name, NULL);
+            if (g_file_test(file, G_FILE_TEST_IS_DIR)
+                    && !g_file_test(file, G_FILE_TEST_IS_SYMLINK))
+                empty_directory(file, TRUE);
+            else
+                unlink(file);
+            g_free(file);
+        }
+        g_dir_close(dir);
+    }
+
+    if (remove_self)
+        rmdir(path);
+}
+
+/* RAM backed, so the intermediate files never hit the disk */
+static gboolean is_tmpfs(const char *path){
+#ifdef __linux__
+    struct statfs fs;
+
+    return statfs(path, &fs) == 0 && fs.f_type == TMPFS_MAGIC
+        && access(path, W_OK | X_OK) == 0;
+#else
+    return FALSE;
+#endif
+}
+
+/* Creates the directory all workspaces go into. Other users may
+ * write to its parent, so it has to be ours and private */
+static gboolean make_root(const char *path){
+    struct stat st;
+
+    if (mkdir(path, 0700) == -1 && errno != EEXIST)
+        return FALSE;
+
+    return lstat(path, &st) == 0 && S_ISDIR(st.st_mode)
+        && st.st_uid == getuid() && (st.st_mode & 077) == 0;
+}
+
+/* Removes the directories of Pidgins that are gone, along with the
+ * leftovers of the renders they never finished. The ones still
+ * running hold the lock on theirs */
+static void remove_stale(const char *path){
+    GDir *dir;
+    const gchar *name;
+    gchar *stale;
+    int fd;
+
+    if ((dir = g_dir_open(path, 0, NULL)) == NULL)
+        return;
+
+    while ((name = g_dir_read_name(dir)) != NULL){
+        stale = g_build_filename(path, name, NULL);
+        fd = open(stale, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd == -1 && errno == ENOTDIR){
+            unlink(stale);
+        } else if (fd != -1){
+            if (flock(fd, LOCK_EX | LOCK_NB) == 0)
+                empty_directory(stale, TRUE);
+            close(fd);
+        }
+        g_free(stale);
+    }
+
+    g_dir_close(dir);
+}
+
+/* Creates our own directory in path and locks it */
+static gchar *make_own(const char *path){
+    gchar *name = g_strdup_printf("%d", (int) getpid());
+    gchar *own = g_build_filename(path, name, NULL);
+
+    g_free(name);
+
+    if (mkdir(own, 0700) == -1){
+        g_free(own);
+        return NULL;
+    }
+
+    if ((root_lock = open(own, O_RDONLY | O_DIRECTORY
+                    | O_CLOEXEC)) == -1){
+        rmdir(own);
+        g_free(own);
+        return NULL;
+    }
+
+    if (flock(root_lock, LOCK_EX | LOCK_NB) == -1){
+        purple_debug_error("PiFo",
+                "Could not lock workspace directory [%s]: [%s]\n",
+                own, strerror(errno));
+    }
+
+    return own;
+}
+
+void pifo_workspace_init(void){
+    gchar *name = g_strdup_printf("pifo-%u", (guint) getuid());
+    gchar *path = NULL, *own;
+
+    if (is_tmpfs(SHM_DIR)){
+        path = g_build_filename(SHM_DIR, name, NULL);
+        if (!make_root(path)){
+            g_free(path);
+            path = NULL;
+        }
+    }
+
+    if (path == NULL){
+        path = g_build_filename(g_get_tmp_dir(), name, NULL);
+        if (!make_root(path)){
+            purple_debug_error("PiFo",
+                    "Could not create workspace directory [%s]\n",
+                    path);
+            g_free(path);
+            path = NULL;
+        }
+    }
+
+    if (path != NULL)
+        remove_stale(path);
+
+    own = path ? make_own(path) : NULL;
+
+    purple_debug_info("PiFo",
+            "Using [%s] for workspaces\n",
+            own ? own : "nothing");
+
+    G_LOCK(workspaces);
+    root = own;
+    G_UNLOCK(workspaces);
+
+    g_free(path);
+    g_free(name);
+}
+
+void pifo_workspace_shutdown(void){
+    gchar *workspace;
+
+    G_LOCK(workspaces);
+    while ((workspace = g_queue_pop_head(&idle)) != NULL)
+        g_free(workspace);
+    if (root != NULL)
+        empty_directory(root, TRUE);
+    g_free(root);
+    root = NULL;
+    if (root_lock != -1){
+        close(root_lock);
+        root_lock = -1;
+    }
+    G_UNLOCK(workspaces);
+}
+
+/* Returns an empty directory for a single job, which has to be
+ * handed back with pifo_workspace_release(). Returns NULL if
+ * there is none to be had. */
+gchar *pifo_workspace_acquire(void){
+    gchar *workspace, *template;
+
+    G_LOCK(workspaces);
+    if (root == NULL){
+        G_UNLOCK(workspaces);
+        return NULL;
+    }
+
+    if ((workspace = g_queue_pop_head(&idle)) != NULL){
+        G_UNLOCK(workspaces);
+        return workspace;
+    }
+
+    template = g_build_filename(root, "job-XXXXXX", NULL);
+    G_UNLOCK(workspaces);
+
+    if ((workspace = g_mkdtemp_full(template, 0700)) == NULL){
+        pifo_debug_error("PiFo",
+                "Could not create workspace [%s]: [%s]\n",
+                template, strerror(errno));
+        g_free(template);
+    }
+
+    return workspace;
+}
+
+/* Empties the directory, whatever the job left in there,
+ * and keeps it for the next one */
+void pifo_workspace_release(gchar *workspace){
+    if (workspace == NULL)
+        return;
+
+    empty_directory(workspace, FALSE);
+
+    G_LOCK(workspaces);
+    if (root != NULL && g_queue_get_length(&idle) < WORKSPACE_POOL){
+        g_queue_push_head(&idle, workspace);
+        workspace = NULL;
+    }
+    G_UNLOCK(workspaces);
+
+    if (workspace != NULL){
+        rmdir(workspace);
+        g_free(workspace);
+    }
+}
@@ -0,0 +1,20 @@
+#ifndef PIFO_WORKSPACE
+#define PIFO_WORKSPACE
+
+#include "pifo.h"
+
+/* Scratch directories for the backends. Every job gets a directory
+ * of its own, which the tools are started in, so nothing has to
+ * chdir() the whole process and jobs can run side by side. The
+ * directories live on a tmpfs when there is one, are emptied and
+ * kept for the next job when done. Each running pidgin keeps them in
+ * a locked directory of its own, and whatever a crashed one left
+ * behind is swept away on the next start. */
+
+void pifo_workspace_init(void);
+void pifo_workspace_shutdown(void);
+
+gchar *pifo_workspace_acquire(void);
+void pifo_workspace_release(gchar *workspace);
+
+#endif